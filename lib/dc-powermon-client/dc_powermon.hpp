@@ -0,0 +1,297 @@
+#ifndef DC_POWERMON_HPP
+#define DC_POWERMON_HPP
+
+// header-only C++20 wrapper of the client library
+// each dc_powermon::client owns its own connection, queries are awaitable from coroutines:
+//
+//   dc_powermon::task<float> measure(dc_powermon::client& mon) {
+//     auto meas = co_await mon.read_all();
+//     co_return meas.ch[DC_POWERMON_CH_P_SHUNT].avg;
+//   }
+//
+//   dc_powermon::client mon("localhost", 41123);
+//   float power = mon.run(measure(mon));
+//
+// coroutines are resumed from client::process, so everything runs on the caller's thread
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <cerrno>
+#include <cstdlib>
+
+#include <poll.h>
+
+#include "dc_powermon_client.h"
+
+namespace dc_powermon {
+
+// all failures are reported as this exception, code is one of dc_powermon_err_e
+class error : public std::runtime_error {
+  public:
+    explicit error(int code) : std::runtime_error("dc-powermon error " + std::to_string(code)), code(code) {}
+    int code;
+};
+
+template<typename T>
+class task;
+
+namespace detail {
+
+  // common part of all task promises
+  struct promise_base {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    // when done, continue whoever was waiting for this task
+    struct final_awaiter {
+      bool await_ready() noexcept { return(false); }
+      template<typename P>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+        std::coroutine_handle<> cont = h.promise().continuation;
+        return(cont ? cont : std::noop_coroutine());
+      }
+      void await_resume() noexcept {}
+    };
+    final_awaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { exception = std::current_exception(); }
+  };
+
+  template<typename T>
+  struct promise : promise_base {
+    std::optional<T> value;
+    task<T> get_return_object();
+    void return_value(T v) { value = std::move(v); }
+    T result() {
+      if(exception) { std::rethrow_exception(exception); }
+      return(std::move(*value));
+    }
+  };
+
+  template<>
+  struct promise<void> : promise_base {
+    task<void> get_return_object();
+    void return_void() {}
+    void result() {
+      if(exception) { std::rethrow_exception(exception); }
+    }
+  };
+
+}
+
+// lazily started coroutine, runs once it is awaited or passed to client::run
+template<typename T = void>
+class task {
+  public:
+    using promise_type = detail::promise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    task(task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+    ~task() { if(handle) { handle.destroy(); } }
+
+    bool done() const { return(!handle || handle.done()); }
+
+    // start the task without waiting for it, it then progresses as responses arrive
+    void start() { if(handle && !handle.done()) { handle.resume(); } }
+
+    T result() { return(handle.promise().result()); }
+
+    bool await_ready() const noexcept { return(done()); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept {
+      handle.promise().continuation = cont;
+      return(handle);
+    }
+    T await_resume() { return(handle.promise().result()); }
+
+  private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+
+  template<typename T>
+  inline task<T> promise<T>::get_return_object() {
+    return(task<T>(std::coroutine_handle<promise<T>>::from_promise(*this)));
+  }
+
+  inline task<void> promise<void>::get_return_object() {
+    return(task<void>(std::coroutine_handle<promise<void>>::from_promise(*this)));
+  }
+
+  // submits a single command when awaited, resumes once its response arrived
+  template<typename T, T (*Parse)(const std::string&)>
+  class query_awaiter {
+    public:
+      query_awaiter(struct dc_powermon_t* dev, std::string cmd) : dev(dev), cmd(std::move(cmd)) {}
+
+      bool await_ready() const noexcept { return(false); }
+
+      bool await_suspend(std::coroutine_handle<> h) {
+        handle = h;
+        int ret = dc_powermon_async_submit(dev, cmd.c_str(), complete, this);
+
+        // a failed send completes the request before submit returns, then there is nothing to wait for
+        if(completed) {
+          return(false);
+        }
+        if(ret != DC_POWERMON_ERR_NONE) {
+          err = ret;
+          return(false);
+        }
+        suspended = true;
+        return(true);
+      }
+
+      T await_resume() {
+        if(err != DC_POWERMON_ERR_NONE) {
+          throw error(err);
+        }
+        return(Parse(rsp));
+      }
+
+    private:
+      static void complete(struct dc_powermon_t* dev, int err, const char* rsp, size_t len, void* user) {
+        (void)dev;
+        query_awaiter* self = static_cast<query_awaiter*>(user);
+        self->err = err;
+        if(rsp) {
+          self->rsp.assign(rsp, len);
+        }
+        self->completed = true;
+        if(self->suspended) {
+          self->handle.resume();
+        }
+      }
+
+      struct dc_powermon_t* dev;
+      std::string cmd;
+      std::string rsp;
+      int err = DC_POWERMON_ERR_NONE;
+      bool completed = false;
+      bool suspended = false;
+      std::coroutine_handle<> handle;
+  };
+
+  inline std::string parse_string(const std::string& rsp) {
+    return(rsp);
+  }
+
+  inline float parse_float(const std::string& rsp) {
+    return(std::strtof(rsp.c_str(), nullptr));
+  }
+
+  inline struct dc_powermon_meas_t parse_meas(const std::string& rsp) {
+    struct dc_powermon_meas_t meas;
+    int err = dc_powermon_parse_meas(rsp.c_str(), &meas);
+    if(err != DC_POWERMON_ERR_NONE) {
+      throw error(err);
+    }
+    return(meas);
+  }
+
+}
+
+// a single dc-powermon instance, any number of them can be used on one thread
+class client {
+  public:
+    client(const char* hostname, int port) : dev(dc_powermon_open(hostname, port)) {
+      if(!dev) {
+        throw error(DC_POWERMON_ERR_CONNECT);
+      }
+    }
+    // any URI accepted by dc_powermon_open_uri
+    explicit client(const char* uri) : dev(dc_powermon_open_uri(uri)) {
+      if(!dev) {
+        throw error(DC_POWERMON_ERR_CONNECT);
+      }
+    }
+    client(client&& other) noexcept : dev(std::exchange(other.dev, nullptr)) {}
+    client(const client&) = delete;
+    client& operator=(const client&) = delete;
+
+    // requests still pending are resumed with an error
+    ~client() { dc_powermon_close(dev); }
+
+    struct dc_powermon_t* handle() const { return(dev); }
+
+    void set_timeout(int timeout_ms) { dc_powermon_dev_set_timeout(dev, timeout_ms); }
+
+    // awaitable queries
+    auto query(std::string cmd) { return(detail::query_awaiter<std::string, detail::parse_string>(dev, std::move(cmd))); }
+    auto read_power() { return(detail::query_awaiter<float, detail::parse_float>(dev, DC_POWERMON_CMD_READ_POWER)); }
+    auto read_current() { return(detail::query_awaiter<float, detail::parse_float>(dev, DC_POWERMON_CMD_READ_CURRENT)); }
+    auto read_vbus() { return(detail::query_awaiter<float, detail::parse_float>(dev, DC_POWERMON_CMD_READ_V_BUS)); }
+    auto read_vshunt() { return(detail::query_awaiter<float, detail::parse_float>(dev, DC_POWERMON_CMD_READ_V_SHUNT)); }
+    auto read_all() { return(detail::query_awaiter<struct dc_powermon_meas_t, detail::parse_meas>(dev, DC_POWERMON_CMD_MEAS_ALL)); }
+    auto reset() { return(detail::query_awaiter<std::string, detail::parse_string>(dev, DC_POWERMON_CMD_RESET)); }
+    auto id() { return(detail::query_awaiter<std::string, detail::parse_string>(dev, DC_POWERMON_CMD_ID)); }
+
+    // the result is the marker timestamp as "<sec>.<nsec>", the label may not contain quotes or line breaks
+    auto mark(const std::string& label) {
+      return(detail::query_awaiter<std::string, detail::parse_string>(dev, DC_POWERMON_CMD_MARK " \"" + label + "\"" DC_POWERMON_CMD_LINEFEED));
+    }
+
+    // event loop integration, for callers that wait on several file descriptors
+    int fd() const { return(dc_powermon_async_fd(dev)); }
+    short events() const { return(dc_powermon_async_events(dev)); }
+    size_t pending() const { return(dc_powermon_async_pending(dev)); }
+    void process() {
+      int err = dc_powermon_async_process(dev);
+      if(err != DC_POWERMON_ERR_NONE) {
+        throw error(err);
+      }
+    }
+
+    // wait up to timeout_ms for responses and resume whoever was waiting for them
+    // returns false on timeout
+    bool poll(int timeout_ms) {
+      struct pollfd pfd = { .fd = fd(), .events = events(), .revents = 0 };
+      if(pfd.fd < 0) {
+        throw error(DC_POWERMON_ERR_CONNECT);
+      }
+
+      // a signal does not cut the wait short, the remaining time is waited for again
+      auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+      int ret;
+      while(((ret = ::poll(&pfd, 1, timeout_ms)) < 0) && (errno == EINTR)) {
+        if(timeout_ms >= 0) {
+          auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+          timeout_ms = (left.count() > 0) ? (int)left.count() : 0;
+        }
+      }
+      if(ret <= 0) {
+        return(false);
+      }
+      process();
+      return(true);
+    }
+
+    // run a task to completion, driving only this client
+    // requests without a response within timeout_ms are failed
+    template<typename T>
+    T run(task<T> t, int timeout_ms = DC_POWERMON_TIMEOUT_DEFAULT) {
+      t.start();
+      while(!t.done()) {
+        if(!poll(timeout_ms)) {
+          dc_powermon_async_cancel(dev);
+        }
+      }
+      return(t.result());
+    }
+
+  private:
+    struct dc_powermon_t* dev;
+};
+
+}
+
+#endif
@@ -0,0 +1,321 @@
+#include "dc_powermon_client.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "dc_powermon_priv.h"
+
+static struct dc_powermon_async_req_t* async_pop(struct dc_powermon_t* dev) {
+  struct dc_powermon_async_req_t* req = &dev->async_reqs[dev->async_head];
+  dev->async_head = (dev->async_head + 1) % DC_POWERMON_ASYNC_MAX;
+  dev->async_num--;
+  return(req);
+}
+
+static ssize_t async_response_len(const char* buff, size_t len, const char** data, size_t* data_len) {
+  // returns the total length of the first complete response in the buffer, 0 if there is none yet or -1 if it is garbage
+  if(len && (buff[0] == '#')) {
+    // IEEE 488.2 definite-length block followed by a linefeed
+    if(len < 2) {
+      return(0);
+    }
+    if((buff[1] < '1') || (buff[1] > '9')) {
+      return(-1);
+    }
+    size_t len_digits = buff[1] - '0';
+    if(len < 2 + len_digits) {
+      return(0);
+    }
+    size_t block_len = 0;
+    for(size_t i = 0; i < len_digits; i++) {
+      block_len = block_len * 10 + (buff[2 + i] - '0');
+    }
+    const char* end = (len > 2 + len_digits + block_len) ? memchr(&buff[2 + len_digits + block_len], '\n', len - 2 - len_digits - block_len) : NULL;
+    if(!end) {
+      return(0);
+    }
+    *data = &buff[2 + len_digits];
+    *data_len = block_len;
+    return(end - buff + 1);
+  }
+
+  const char* end = memchr(buff, '\n', len);
+  if(!end) {
+    return(0);
+  }
+  *data = buff;
+  *data_len = end - buff;
+  if(*data_len && (buff[*data_len - 1] == '\r')) {
+    (*data_len)--;
+  }
+  return(end - buff + 1);
+}
+
+static ssize_t async_record_len(const char* buff, size_t len, uint8_t* type, const char** data, size_t* data_len) {
+  // same as async_response_len, for connections in binary format
+  struct dc_powermon_rec_hdr_t hdr;
+  if(len < sizeof(hdr)) {
+    return(0);
+  }
+  memcpy(&hdr, buff, sizeof(hdr));
+  if(hdr.magic != DC_POWERMON_REC_MAGIC) {
+    return(-1);
+  }
+  if(len < sizeof(hdr) + hdr.len) {
+    return(0);
+  }
+  *type = hdr.type;
+  *data = &buff[sizeof(hdr)];
+  *data_len = hdr.len;
+  return(sizeof(hdr) + hdr.len);
+}
+
+static int async_send(struct dc_powermon_t* dev) {
+  if(dev->fd < 0) {
+    return(DC_POWERMON_ERR_CLOSED);
+  }
+
+  // send whatever the socket takes
+  size_t sent_total = 0;
+  while(sent_total < dev->async_tx_len) {
+    ssize_t sent = send(dev->fd, &dev->async_tx[sent_total], dev->async_tx_len - sent_total, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(sent < 0) {
+      if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        break;
+      } else if(errno == EINTR) {
+        continue;
+      }
+      dc_powermon_priv_disconnect(dev);
+      return(DC_POWERMON_ERR_CLOSED);
+    }
+    sent_total += sent;
+  }
+  dev->async_tx_len -= sent_total;
+  memmove(dev->async_tx, &dev->async_tx[sent_total], dev->async_tx_len);
+  return(DC_POWERMON_ERR_NONE);
+}
+
+static void async_complete(struct dc_powermon_t* dev, const struct dc_powermon_async_req_t* req, int err, const char* rsp, size_t len) {
+  if(!req->cb) {
+    return;
+  }
+  dev->async_depth++;
+  req->cb(dev, err, rsp, len, req->user);
+  dev->async_depth--;
+}
+
+int dc_powermon_priv_async_finish(struct dc_powermon_t* dev, int ret) {
+  // called on the way out of every function that runs callbacks, the outermost one frees a handle closed by them
+  if(dev->async_closing && !dev->async_depth) {
+    dc_powermon_close(dev);
+    return(DC_POWERMON_ERR_CLOSED);
+  }
+  return(ret);
+}
+
+void dc_powermon_priv_async_fail(struct dc_powermon_t* dev, int err) {
+  // nothing that was sent will ever get a response now
+  dev->async_tx_len = 0;
+  dev->async_rx_len = 0;
+
+  // requests submitted by the callbacks are not failed with the rest
+  size_t num = dev->async_num;
+  while(num--) {
+    struct dc_powermon_async_req_t req = *async_pop(dev);
+    async_complete(dev, &req, err, NULL, 0);
+  }
+}
+
+void dc_powermon_priv_async_free(struct dc_powermon_t* dev) {
+  free(dev->async_tx);
+  free(dev->async_rx);
+  dev->async_tx = NULL;
+  dev->async_rx = NULL;
+  dev->async_tx_size = 0;
+  dev->async_rx_size = 0;
+}
+
+int dc_powermon_async_fd(struct dc_powermon_t* dev) {
+  // local transports have nothing to wait for, they are only usable synchronously
+  if(!dev || dev->local) {
+    return(-1);
+  }
+
+  // connecting is the only blocking part
+  if(dev->fd < 0) {
+    struct timespec deadline;
+    dc_powermon_priv_deadline(&deadline, dev->timeout_ms);
+    if(dc_powermon_priv_connect(dev, (dev->timeout_ms < 0) ? NULL : &deadline)) {
+      return(-1);
+    }
+  }
+
+  return(dev->fd);
+}
+
+short dc_powermon_async_events(struct dc_powermon_t* dev) {
+  if(!dev) {
+    return(0);
+  }
+  return(POLLIN | (dev->async_tx_len ? POLLOUT : 0));
+}
+
+size_t dc_powermon_async_pending(struct dc_powermon_t* dev) {
+  return(dev ? dev->async_num : 0);
+}
+
+static bool async_cmd_valid(const char* cmd, size_t len) {
+  // responses are matched to requests by their order, so it has to be exactly one command with exactly one response
+  if(!len || (cmd[len - 1] != '\n') || (memchr(cmd, '\n', len - 1) != NULL)) {
+    return(false);
+  }
+
+  // the format reply does not follow the format of the connection and the exit would leave the rest of the queue hanging
+  const char* rejected[] = { DC_POWERMON_CMD_FORM_BIN, DC_POWERMON_CMD_FORM_ASC, DC_POWERMON_CMD_SYSTEM_EXIT };
+  for(size_t i = 0; i < sizeof(rejected) / sizeof(rejected[0]); i++) {
+    if(strncmp(cmd, rejected[i], strcspn(rejected[i], "\r\n")) == 0) {
+      return(false);
+    }
+  }
+  return(true);
+}
+
+int dc_powermon_async_submit(struct dc_powermon_t* dev, const char* cmd, dc_powermon_cb_t cb, void* user) {
+  if(!dev || !cmd || dev->streaming || dev->local || dev->async_closing) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+
+  if(dev->async_num >= DC_POWERMON_ASYNC_MAX) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+
+  if(dc_powermon_async_fd(dev) < 0) {
+    return(DC_POWERMON_ERR_CONNECT);
+  }
+
+  // without a persistent connection the server would close it after the first response
+  if(!dev->persistent) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+
+  size_t len = strlen(cmd);
+  if(!async_cmd_valid(cmd, len)) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+
+  if(dc_powermon_priv_reserve(&dev->async_tx, &dev->async_tx_size, dev->async_tx_len + len) < 0) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+  memcpy(&dev->async_tx[dev->async_tx_len], cmd, len);
+  dev->async_tx_len += len;
+
+  struct dc_powermon_async_req_t* req = &dev->async_reqs[(dev->async_head + dev->async_num) % DC_POWERMON_ASYNC_MAX];
+  req->cb = cb;
+  req->user = user;
+  dev->async_num++;
+
+  // try to get it out right away, whatever does not fit is sent from dc_powermon_async_process
+  return(dc_powermon_priv_async_finish(dev, async_send(dev)));
+}
+
+int dc_powermon_async_process(struct dc_powermon_t* dev) {
+  if(!dev) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+
+  int ret = async_send(dev);
+  if(ret) {
+    return(dc_powermon_priv_async_finish(dev, ret));
+  }
+
+  // receive whatever is there, starting with data buffered by a previous synchronous call
+  if(dev->rx_len) {
+    if(dc_powermon_priv_reserve(&dev->async_rx, &dev->async_rx_size, dev->async_rx_len + dev->rx_len) < 0) {
+      return(DC_POWERMON_ERR_FAILED);
+    }
+    memcpy(&dev->async_rx[dev->async_rx_len], dev->rx_buff, dev->rx_len);
+    dev->async_rx_len += dev->rx_len;
+    dev->rx_len = 0;
+  }
+  while(dev->async_num) {
+    if(dc_powermon_priv_reserve(&dev->async_rx, &dev->async_rx_size, dev->async_rx_len + 4096) < 0) {
+      return(DC_POWERMON_ERR_FAILED);
+    }
+    ssize_t len = recv(dev->fd, &dev->async_rx[dev->async_rx_len], dev->async_rx_size - dev->async_rx_len, MSG_DONTWAIT);
+    if(len == 0) {
+      dc_powermon_priv_disconnect(dev);
+      return(dc_powermon_priv_async_finish(dev, DC_POWERMON_ERR_CLOSED));
+    } else if(len < 0) {
+      if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        break;
+      } else if(errno == EINTR) {
+        continue;
+      }
+      dc_powermon_priv_disconnect(dev);
+      return(dc_powermon_priv_async_finish(dev, DC_POWERMON_ERR_CLOSED));
+    }
+    dev->async_rx_len += len;
+  }
+
+  // responses come in the same order as the requests were sent
+  size_t pos = 0;
+  while(dev->async_num) {
+    const char* data = NULL;
+    size_t data_len = 0;
+    uint8_t type = DC_POWERMON_REC_TEXT;
+    char* rsp = &dev->async_rx[pos];
+    ssize_t len = dev->binary ? async_record_len(rsp, dev->async_rx_len - pos, &type, &data, &data_len) :
+                                async_response_len(rsp, dev->async_rx_len - pos, &data, &data_len);
+    if(len < 0) {
+      // there is no telling where the next response starts
+      dc_powermon_priv_async_fail(dev, DC_POWERMON_ERR_RESPONSE);
+      dc_powermon_priv_disconnect(dev);
+      return(dc_powermon_priv_async_finish(dev, DC_POWERMON_ERR_RESPONSE));
+    } else if(len == 0) {
+      break;
+    }
+
+    // responses are handed out as strings in the text format, only blocks stay binary
+    char text[512];
+    if(!dev->binary && (rsp[0] != '#')) {
+      rsp[data_len] = '\0';
+    } else if(dev->binary && (type != DC_POWERMON_REC_SAMPLES) && (type != DC_POWERMON_REC_MARKERS)) {
+      int text_len = dc_powermon_priv_format_rsp(text, sizeof(text), type, data, data_len);
+      if(text_len >= 0) {
+        data = text;
+        data_len = text_len;
+      }
+    }
+    pos += len;
+
+    // the callback may submit new requests, so the request is taken off the queue first
+    struct dc_powermon_async_req_t req = *async_pop(dev);
+    async_complete(dev, &req, DC_POWERMON_ERR_NONE, data, data_len);
+
+    // or it may have closed the handle or cancelled everything, which also drops what was received
+    if(dev->async_closing || (dev->async_rx_len < pos)) {
+      return(dc_powermon_priv_async_finish(dev, DC_POWERMON_ERR_CLOSED));
+    }
+  }
+  dev->async_rx_len -= pos;
+  memmove(dev->async_rx, &dev->async_rx[pos], dev->async_rx_len);
+
+  return(DC_POWERMON_ERR_NONE);
+}
+
+void dc_powermon_async_cancel(struct dc_powermon_t* dev) {
+  if(!dev) {
+    return;
+  }
+
+  // responses to the cancelled requests may still arrive, so the connection has to go
+  dc_powermon_priv_async_fail(dev, DC_POWERMON_ERR_FAILED);
+  dc_powermon_priv_disconnect(dev);
+  dc_powermon_priv_async_finish(dev, DC_POWERMON_ERR_NONE);
+}
@@ -5,137 +5,1084 @@
 #include <stdio.h>
 
 #include <unistd.h>
-#include <fcntl.h>
 #include <errno.h>
-#include <sys/ioctl.h>
-
-#include <netinet/in.h>
-#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
 #include "dc_powermon_cmds.h"
+#include "dc_powermon_priv.h"
 
-static struct sockaddr_in server = {
-  .sin_family = AF_INET,
-  .sin_port = 0,
-  .sin_addr = { 0 },
-  .sin_zero = { 0 },
-};
-
-typedef int (*cb_setup_t)(void);
-typedef int (*cb_read_t)(int, char*);
-typedef void (*cb_write_t)(int, const char*);
+// handle used by the functions without an explicit one
+// calls hold the lock for reading, so they can run concurrently, replacing the handle needs it for writing
+static struct dc_powermon_t* dev_default = NULL;
+static pthread_rwlock_t dev_default_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-static cb_setup_t cb_setup = NULL;
-static cb_read_t cb_read = NULL;
-static cb_write_t cb_write = NULL;
+int dc_powermon_priv_reserve(char** buff, size_t* size, size_t len) {
+  if(len <= *size) {
+    return(0);
+  }
 
-static int socket_setup(void) {
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
-  if(fd < 0) {
+  size_t new_size = *size ? *size : 1024;
+  while(new_size < len) {
+    new_size *= 2;
+  }
+  char* ptr = realloc(*buff, new_size);
+  if(!ptr) {
     return(-1);
   }
+  *buff = ptr;
+  *size = new_size;
+  return(0);
+}
+
+void dc_powermon_priv_deadline(struct timespec* deadline, int timeout_ms) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += timeout_ms / 1000;
+  deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+  if(deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
+
+int dc_powermon_priv_wait(int fd, short events, const struct timespec* deadline) {
+  for(;;) {
+    // no deadline means wait forever
+    int timeout = -1;
+    if(deadline) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long long left = (long long)(deadline->tv_sec - now.tv_sec) * 1000LL + (deadline->tv_nsec - now.tv_nsec) / 1000000L;
+      timeout = (left > 0) ? (int)left : 0;
+    }
+
+    struct pollfd pfd = { .fd = fd, .events = events, .revents = 0 };
+    int ret = poll(&pfd, 1, timeout);
+    if(ret > 0) {
+      return(DC_POWERMON_ERR_NONE);
+    } else if(ret == 0) {
+      return(-DC_POWERMON_ERR_TIMEOUT);
+    } else if(errno != EINTR) {
+      return(-DC_POWERMON_ERR_FAILED);
+    }
+  }
+}
+
+void dc_powermon_priv_disconnect(struct dc_powermon_t* dev) {
+  if(dev->fd >= 0) {
+    dev->cb_close(dev);
+  }
+  dev->fd = -1;
+  dev->rx_len = 0;
+
+  // the handle is down by now, so callbacks can safely submit again on a fresh connection
+  if(dev->async_num) {
+    dc_powermon_priv_async_fail(dev, DC_POWERMON_ERR_CLOSED);
+  }
+}
+
+static int dev_read_line(struct dc_powermon_t* dev, char* buff, size_t size, const struct timespec* deadline) {
+  // keep reading until there is a complete line buffered, the response may come in any number of packets
+  char* end = NULL;
+  while(!(end = memchr(dev->rx_buff, '\n', dev->rx_len))) {
+    if(dev->rx_len == sizeof(dev->rx_buff)) {
+      return(-DC_POWERMON_ERR_RESPONSE);
+    }
+    int len = dev->cb_read(dev, &dev->rx_buff[dev->rx_len], sizeof(dev->rx_buff) - dev->rx_len, deadline);
+    if(len <= 0) {
+      return(len ? len : -DC_POWERMON_ERR_CLOSED);
+    }
+    dev->rx_len += len;
+  }
+
+  // hand out the line without the trailing CR/LF
+  size_t line_len = end - dev->rx_buff + 1;
+  size_t copy_len = line_len - 1;
+  if(copy_len && (dev->rx_buff[copy_len - 1] == '\r')) {
+    copy_len--;
+  }
+  if(buff) {
+    if(copy_len >= size) {
+      copy_len = size - 1;
+    }
+    memcpy(buff, dev->rx_buff, copy_len);
+    buff[copy_len] = '\0';
+  }
+  dev->rx_len -= line_len;
+  memmove(dev->rx_buff, &dev->rx_buff[line_len], dev->rx_len);
+  return(DC_POWERMON_ERR_NONE);
+}
+
+static int dev_read_exact(struct dc_powermon_t* dev, void* buff, size_t len, const struct timespec* deadline) {
+  // use up whatever is already buffered first
+  size_t buffered = (dev->rx_len < len) ? dev->rx_len : len;
+  if(buff) {
+    memcpy(buff, dev->rx_buff, buffered);
+  }
+  dev->rx_len -= buffered;
+  memmove(dev->rx_buff, &dev->rx_buff[buffered], dev->rx_len);
+
+  char* ptr = buff;
+  for(size_t pos = buffered; pos < len;) {
+    char discard[256];
+    size_t chunk = len - pos;
+    if(!buff && (chunk > sizeof(discard))) {
+      chunk = sizeof(discard);
+    }
+    int ret = dev->cb_read(dev, buff ? &ptr[pos] : discard, chunk, deadline);
+    if(ret <= 0) {
+      return(ret ? ret : -DC_POWERMON_ERR_CLOSED);
+    }
+    pos += ret;
+  }
+  return(DC_POWERMON_ERR_NONE);
+}
 
-  int ret = connect(fd, (struct sockaddr*)&server, sizeof(struct sockaddr_in));
+int dc_powermon_priv_connect(struct dc_powermon_t* dev, const struct timespec* deadline) {
+  if(dev->fd >= 0) {
+    // an idle connection may have been closed by the server in the meantime,
+    // a shared memory segment may belong to a daemon that is gone or was restarted
+    char c;
+    if(dev->local ? dc_powermon_shm_alive(&dev->shm) : (recv(dev->fd, &c, 1, MSG_DONTWAIT | MSG_PEEK) != 0)) {
+      return(DC_POWERMON_ERR_NONE);
+    }
+    dc_powermon_priv_disconnect(dev);
+  }
+
+  dev->fd = dev->cb_setup(dev, deadline);
+  if(dev->fd < 0) {
+    int ret = dev->fd;
+    dev->fd = -1;
+    return(ret);
+  }
+
+  // ask the server to keep the connection open
+  char rpl_buff[64];
+  int ret = dev->cb_write(dev, DC_POWERMON_CMD_KEEP_ON, strlen(DC_POWERMON_CMD_KEEP_ON), deadline);
+  if(ret == DC_POWERMON_ERR_NONE) {
+    ret = dev_read_line(dev, rpl_buff, sizeof(rpl_buff), deadline);
+  }
+  if(ret == -DC_POWERMON_ERR_TIMEOUT) {
+    dc_powermon_priv_disconnect(dev);
+    return(ret);
+  }
+  dev->persistent = (ret == DC_POWERMON_ERR_NONE) && (strcmp(rpl_buff, "OK") == 0);
+  dev->binary = false;
+  if(!dev->persistent) {
+    // server doesn't support it and probably closed the connection, so start over
+    dc_powermon_priv_disconnect(dev);
+    dev->fd = dev->cb_setup(dev, deadline);
+    if(dev->fd < 0) {
+      ret = dev->fd;
+      dev->fd = -1;
+      return(ret);
+    }
+    return(DC_POWERMON_ERR_NONE);
+  }
+
+  // binary responses save formatting and parsing on both ends, older servers just reply ERR
+  ret = dc_powermon_priv_set_binary(dev, true, deadline);
   if(ret) {
-    return(-1);
+    dc_powermon_priv_disconnect(dev);
+    return(ret);
   }
 
-  return(fd);
+  return(DC_POWERMON_ERR_NONE);
 }
 
-static int socket_read(int socket, char* cmd_buff) {
-  int len = 0;
-  do {
-    ioctl(socket, FIONREAD, &len);
-  } while(!len);
+int dc_powermon_priv_set_binary(struct dc_powermon_t* dev, bool binary, const struct timespec* deadline) {
+  // the reply is an ASCII line in either format
+  const char* cmd = binary ? DC_POWERMON_CMD_FORM_BIN : DC_POWERMON_CMD_FORM_ASC;
+  char rpl_buff[64];
+  int ret = dev->cb_write(dev, cmd, strlen(cmd), deadline);
+  if(ret == DC_POWERMON_ERR_NONE) {
+    ret = dev_read_line(dev, rpl_buff, sizeof(rpl_buff), deadline);
+  }
+  if(ret) {
+    return(ret);
+  }
+  if(strcmp(rpl_buff, "OK") == 0) {
+    dev->binary = binary;
+  }
+  return(DC_POWERMON_ERR_NONE);
+}
 
-  len = recv(socket, cmd_buff, len, 0);
-  if(len < 0) {
-    // something went wrong
-    return(0);
+static int dev_read_record(struct dc_powermon_t* dev, struct dc_powermon_rsp_t* rsp, const struct timespec* deadline) {
+  struct dc_powermon_rec_hdr_t hdr;
+  int ret = dev_read_exact(dev, &hdr, sizeof(hdr), deadline);
+  if(ret) {
+    return(ret);
+  }
+  if(hdr.magic != DC_POWERMON_REC_MAGIC) {
+    return(-DC_POWERMON_ERR_RESPONSE);
+  }
+
+  // keep what fits, leaving space for the terminator of text records
+  size_t num = (hdr.len < sizeof(rsp->data)) ? hdr.len : sizeof(rsp->data) - 1;
+  if((ret = dev_read_exact(dev, rsp->data, num, deadline)) || (ret = dev_read_exact(dev, NULL, hdr.len - num, deadline))) {
+    return(ret);
+  }
+  rsp->data[num] = '\0';
+  rsp->type = hdr.type;
+  rsp->len = num;
+  return(DC_POWERMON_ERR_NONE);
+}
+
+static int dev_read_rsp(struct dc_powermon_t* dev, struct dc_powermon_rsp_t* rsp, const struct timespec* deadline) {
+  if(dev->binary) {
+    return(dev_read_record(dev, rsp, deadline));
+  }
+
+  int ret = dev_read_line(dev, rsp->data, sizeof(rsp->data), deadline);
+  rsp->type = DC_POWERMON_REC_TEXT;
+  rsp->len = ret ? 0 : strlen(rsp->data);
+  return(ret);
+}
+
+static int scpi_exec_locked(struct dc_powermon_t* dev, const char* cmd, struct dc_powermon_rsp_t* rsp, int timeout_ms) {
+  if(!dev->cb_read || !dev->cb_write || !dev->cb_setup || dev->async_num || dev->streaming) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+
+  // the deadline covers the whole exchange, including a reconnect
+  if(timeout_ms == DC_POWERMON_PRIV_TIMEOUT_DEV) {
+    timeout_ms = dev->timeout_ms;
+  }
+  struct timespec deadline;
+  dc_powermon_priv_deadline(&deadline, timeout_ms);
+  const struct timespec* deadline_ptr = (timeout_ms < 0) ? NULL : &deadline;
+
+  // if the connection broke since the last time, try again once on a fresh one
+  int ret = DC_POWERMON_ERR_FAILED;
+  for(int attempt = 0; attempt < 2; attempt++) {
+    ret = dc_powermon_priv_connect(dev, deadline_ptr);
+    if(ret) {
+      return(-ret);
+    }
+
+    ret = dev->cb_write(dev, cmd, strlen(cmd), deadline_ptr);
+    if((ret == DC_POWERMON_ERR_NONE) && rsp) {
+      ret = dev_read_rsp(dev, rsp, deadline_ptr);
+    }
+    if(ret == DC_POWERMON_ERR_NONE) {
+      if(!dev->persistent) {
+        dc_powermon_priv_disconnect(dev);
+      }
+      return(DC_POWERMON_ERR_NONE);
+    }
+
+    // a late response would get mixed up with the next one, so the connection can't be used anymore
+    dc_powermon_priv_disconnect(dev);
+    if(ret != -DC_POWERMON_ERR_CLOSED) {
+      break;
+    }
+  }
+
+  return(-ret);
+}
+
+static int scpi_exec_block_locked(struct dc_powermon_t* dev, const char* cmd, uint8_t type, void* buff, size_t max, size_t* len) {
+  if(!dev->cb_read || !dev->cb_write || !dev->cb_setup || dev->async_num || dev->streaming) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+
+  struct timespec deadline;
+  dc_powermon_priv_deadline(&deadline, dev->timeout_ms);
+  const struct timespec* deadline_ptr = (dev->timeout_ms < 0) ? NULL : &deadline;
+
+  int ret = DC_POWERMON_ERR_FAILED;
+  for(int attempt = 0; attempt < 2; attempt++) {
+    ret = dc_powermon_priv_connect(dev, deadline_ptr);
+    if(ret) {
+      return(-ret);
+    }
+
+    // IEEE 488.2 definite-length block: '#', number of length digits, length, data, linefeed
+    // or a record header in binary format
+    char header[16] = { 0 };
+    ret = dev->cb_write(dev, cmd, strlen(cmd), deadline_ptr);
+    if(ret == DC_POWERMON_ERR_NONE) {
+      ret = dev_read_exact(dev, header, dev->binary ? sizeof(struct dc_powermon_rec_hdr_t) : 2, deadline_ptr);
+    }
+    if(ret == -DC_POWERMON_ERR_CLOSED) {
+      dc_powermon_priv_disconnect(dev);
+      continue;
+    } else if(ret) {
+      break;
+    }
+
+    ret = -DC_POWERMON_ERR_RESPONSE;
+    size_t block_len = 0;
+    if(dev->binary) {
+      struct dc_powermon_rec_hdr_t hdr;
+      memcpy(&hdr, header, sizeof(hdr));
+      if((hdr.magic != DC_POWERMON_REC_MAGIC) || (hdr.type != type)) {
+        break;
+      }
+      block_len = hdr.len;
+    } else {
+      if((header[0] != '#') || (header[1] < '1') || (header[1] > '9')) {
+        break;
+      }
+      int len_digits = header[1] - '0';
+      if((ret = dev_read_exact(dev, header, len_digits, deadline_ptr))) {
+        break;
+      }
+      header[len_digits] = '\0';
+      block_len = strtoull(header, NULL, 10);
+    }
+
+    // read what fits into the buffer, drop the rest
+    size_t num = (block_len < max) ? block_len : max;
+    if((ret = dev_read_exact(dev, buff, num, deadline_ptr)) || (ret = dev_read_exact(dev, NULL, block_len - num, deadline_ptr)) ||
+       (!dev->binary && (ret = dev_read_line(dev, NULL, 0, deadline_ptr)))) {
+      break;
+    }
+
+    if(len) { *len = num; }
+    if(!dev->persistent) {
+      dc_powermon_priv_disconnect(dev);
+    }
+    return(DC_POWERMON_ERR_NONE);
+  }
+
+  dc_powermon_priv_disconnect(dev);
+  return(-ret);
+}
+
+static int scpi_exec_io(struct dc_powermon_t* dev, const char* cmd, struct dc_powermon_rsp_t* rsp, int timeout_ms) {
+  pthread_mutex_lock(&dev->lock);
+  int ret = scpi_exec_locked(dev, cmd, rsp, timeout_ms);
+  pthread_mutex_unlock(&dev->lock);
+  return(ret);
+}
+
+static struct dc_powermon_coalesce_t* coalesce_find(struct dc_powermon_t* dev, const char* cmd) {
+  for(int i = 0; i < DC_POWERMON_PRIV_COALESCE_MAX; i++) {
+    if((dev->coalesce[i].valid || dev->coalesce[i].in_flight) && (strcmp(dev->coalesce[i].cmd, cmd) == 0)) {
+      return(&dev->coalesce[i]);
+    }
+  }
+  return(NULL);
+}
+
+static struct dc_powermon_coalesce_t* coalesce_alloc(struct dc_powermon_t* dev, const char* cmd) {
+  // reuse the entry with the oldest result, the ones in flight have callers waiting on them
+  struct dc_powermon_coalesce_t* entry = NULL;
+  for(int i = 0; i < DC_POWERMON_PRIV_COALESCE_MAX; i++) {
+    struct dc_powermon_coalesce_t* e = &dev->coalesce[i];
+    if(e->in_flight) {
+      continue;
+    }
+    if(!e->valid) {
+      entry = e;
+      break;
+    }
+    if(!entry || (e->done.tv_sec < entry->done.tv_sec) || ((e->done.tv_sec == entry->done.tv_sec) && (e->done.tv_nsec < entry->done.tv_nsec))) {
+      entry = e;
+    }
+  }
+
+  if(entry) {
+    strcpy(entry->cmd, cmd);
+    entry->valid = false;
+  }
+  return(entry);
+}
+
+static long long coalesce_age_ms(const struct dc_powermon_coalesce_t* entry) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return((long long)(now.tv_sec - entry->done.tv_sec) * 1000LL + (now.tv_nsec - entry->done.tv_nsec) / 1000000L);
+}
+
+static bool coalesce_allowed(const char* cmd) {
+  // only queries that just read the latest values can be shared, others like ENERGY:STOP? have side effects
+  const char* queries[] = {
+    DC_POWERMON_CMD_READ_POWER, DC_POWERMON_CMD_READ_CURRENT, DC_POWERMON_CMD_READ_V_BUS,
+    DC_POWERMON_CMD_READ_V_SHUNT, DC_POWERMON_CMD_MEAS_ALL, DC_POWERMON_CMD_ID,
+  };
+  for(size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++) {
+    if(strcmp(cmd, queries[i]) == 0) {
+      return(true);
+    }
+  }
+  return(false);
+}
+
+static int scpi_exec(struct dc_powermon_t* dev, const char* cmd, struct dc_powermon_rsp_t* rsp, int timeout_ms) {
+  if(!dev) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+
+  pthread_mutex_lock(&dev->coalesce_lock);
+  if((dev->coalesce_ms < 0) || !rsp || (strlen(cmd) >= sizeof(dev->coalesce[0].cmd)) || !coalesce_allowed(cmd)) {
+    pthread_mutex_unlock(&dev->coalesce_lock);
+    return(scpi_exec_io(dev, cmd, rsp, timeout_ms));
+  }
+
+  // if the same query is already on its way, wait for it and take its result
+  bool waited = false;
+  struct dc_powermon_coalesce_t* entry = NULL;
+  while((entry = coalesce_find(dev, cmd)) && entry->in_flight) {
+    pthread_cond_wait(&dev->coalesce_cond, &dev->coalesce_lock);
+    waited = true;
+  }
+
+  // otherwise, a recent successful result is just as good
+  if(entry && (waited || ((entry->ret == DC_POWERMON_ERR_NONE) && (coalesce_age_ms(entry) < dev->coalesce_ms)))) {
+    int ret = entry->ret;
+    memcpy(rsp, &entry->rsp, sizeof(struct dc_powermon_rsp_t));
+    pthread_mutex_unlock(&dev->coalesce_lock);
+    return(ret);
+  }
+
+  if(!entry && !(entry = coalesce_alloc(dev, cmd))) {
+    // too many different queries in flight at once
+    pthread_mutex_unlock(&dev->coalesce_lock);
+    return(scpi_exec_io(dev, cmd, rsp, timeout_ms));
+  }
+  entry->in_flight = true;
+  entry->valid = false;
+  pthread_mutex_unlock(&dev->coalesce_lock);
+
+  // nobody else touches the entry while it is in flight
+  int ret = scpi_exec_io(dev, cmd, &entry->rsp, timeout_ms);
+
+  pthread_mutex_lock(&dev->coalesce_lock);
+  entry->ret = ret;
+  clock_gettime(CLOCK_MONOTONIC, &entry->done);
+  entry->in_flight = false;
+  entry->valid = true;
+  memcpy(rsp, &entry->rsp, sizeof(struct dc_powermon_rsp_t));
+  pthread_cond_broadcast(&dev->coalesce_cond);
+  pthread_mutex_unlock(&dev->coalesce_lock);
+  return(ret);
+}
+
+static int scpi_exec_block(struct dc_powermon_t* dev, const char* cmd, uint8_t type, void* buff, size_t max, size_t* len) {
+  if(!dev) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+
+  pthread_mutex_lock(&dev->lock);
+  int ret = scpi_exec_block_locked(dev, cmd, type, buff, max, len);
+  pthread_mutex_unlock(&dev->lock);
+  return(ret);
+}
+
+static struct dc_powermon_t* dev_alloc() {
+  struct dc_powermon_t* dev = calloc(1, sizeof(struct dc_powermon_t));
+  if(!dev) {
+    return(NULL);
+  }
+  pthread_mutex_init(&dev->lock, NULL);
+  pthread_mutex_init(&dev->coalesce_lock, NULL);
+  pthread_cond_init(&dev->coalesce_cond, NULL);
+  dev->fd = -1;
+  dev->timeout_ms = DC_POWERMON_TIMEOUT_DEFAULT;
+  dev->coalesce_ms = -1;
+  return(dev);
+}
+
+static void dev_free(struct dc_powermon_t* dev) {
+  pthread_mutex_destroy(&dev->lock);
+  pthread_mutex_destroy(&dev->coalesce_lock);
+  pthread_cond_destroy(&dev->coalesce_cond);
+  free(dev->local_rsp);
+  free(dev);
+}
+
+static struct dc_powermon_t* dev_open(struct dc_powermon_t* dev) {
+  // connecting now is just to fail early, if it doesn't work now it will be retried on the first query
+  struct timespec deadline;
+  dc_powermon_priv_deadline(&deadline, dev->timeout_ms);
+  (void)dc_powermon_priv_connect(dev, &deadline);
+  return(dev);
+}
+
+struct dc_powermon_t* dc_powermon_open(const char* hostname, int port) {
+  struct dc_powermon_t* dev = dev_alloc();
+  if(!dev) {
+    return(NULL);
+  }
+
+  if(dc_powermon_priv_transport_tcp(dev, hostname, port)) {
+    dev_free(dev);
+    return(NULL);
+  }
+
+  return(dev_open(dev));
+}
+
+struct dc_powermon_t* dc_powermon_open_uri(const char* uri) {
+  if(!uri) {
+    return(NULL);
+  }
+
+  struct dc_powermon_t* dev = dev_alloc();
+  if(!dev) {
+    return(NULL);
+  }
+
+  // without a scheme, it is a TCP host with an optional port
+  int ret = EXIT_FAILURE;
+  if(strncmp(uri, DC_POWERMON_URI_UNIX, strlen(DC_POWERMON_URI_UNIX)) == 0) {
+    ret = dc_powermon_priv_transport_unix(dev, uri + strlen(DC_POWERMON_URI_UNIX));
+
+  } else if(strncmp(uri, DC_POWERMON_URI_SHM, strlen(DC_POWERMON_URI_SHM)) == 0) {
+    ret = dc_powermon_priv_transport_shm(dev, uri + strlen(DC_POWERMON_URI_SHM));
+
+  } else {
+    if(strncmp(uri, DC_POWERMON_URI_TCP, strlen(DC_POWERMON_URI_TCP)) == 0) {
+      uri += strlen(DC_POWERMON_URI_TCP);
+    }
+
+    // IPv6 addresses are enclosed in brackets, e.g. [::1]:41123
+    char hostname[256];
+    int port = DC_POWERMON_PORT_DEFAULT;
+    bool bracket = (uri[0] == '[');
+    if(bracket) {
+      uri++;
+    }
+    size_t len = strcspn(uri, bracket ? "]" : ":/");
+    if((len > 0) && (len < sizeof(hostname)) && (!bracket || (uri[len] == ']'))) {
+      memcpy(hostname, uri, len);
+      hostname[len] = '\0';
+      if(bracket) {
+        len++;
+      }
+      if(uri[len] == ':') {
+        port = atoi(&uri[len + 1]);
+      }
+      ret = dc_powermon_priv_transport_tcp(dev, hostname, port);
+    }
+
+  }
+
+  if(ret) {
+    dev_free(dev);
+    return(NULL);
+  }
+
+  return(dev_open(dev));
+}
+
+void dc_powermon_dev_set_timeout(struct dc_powermon_t* dev, int timeout_ms) {
+  if(dev) {
+    pthread_mutex_lock(&dev->lock);
+    dev->timeout_ms = timeout_ms;
+    pthread_mutex_unlock(&dev->lock);
+  }
+}
+
+void dc_powermon_dev_set_coalesce(struct dc_powermon_t* dev, int window_ms) {
+  if(dev) {
+    pthread_mutex_lock(&dev->coalesce_lock);
+    dev->coalesce_ms = window_ms;
+    for(int i = 0; i < DC_POWERMON_PRIV_COALESCE_MAX; i++) {
+      dev->coalesce[i].valid = false;
+    }
+    pthread_mutex_unlock(&dev->coalesce_lock);
   }
-  cmd_buff[len] = '\0';
+}
 
-  // strip trailing newline if present
-  if((strlen(cmd_buff) > 1) && (cmd_buff[strlen(cmd_buff) - 1] == '\n')) {
-    cmd_buff[strlen(cmd_buff) - 1] = '\0';
+static void meas_from_record(struct dc_powermon_meas_t* meas, const struct dc_powermon_rec_meas_t* rec) {
+  meas->timestamp.tv_sec = rec->timestamp / 1000000000ULL;
+  meas->timestamp.tv_nsec = rec->timestamp % 1000000000ULL;
+  meas->count = rec->count;
+  for(int i = 0; i < DC_POWERMON_NUM_CHANNELS; i++) {
+    meas->ch[i].avg = rec->avg[i];
+    meas->ch[i].min = rec->min[i];
+    meas->ch[i].max = rec->max[i];
   }
+}
 
+int dc_powermon_priv_format_meas(char* buff, const struct dc_powermon_meas_t* meas) {
+  // same format as the server's MEAS:ALL? response
+  int len = sprintf(buff, "%lld.%09ld,%lu", (long long)meas->timestamp.tv_sec, meas->timestamp.tv_nsec, meas->count);
+  for(int i = 0; i < DC_POWERMON_NUM_CHANNELS; i++) {
+    len += sprintf(&buff[len], ",%.6f,%.6f,%.6f", (double)meas->ch[i].avg, (double)meas->ch[i].min, (double)meas->ch[i].max);
+  }
   return(len);
 }
 
-static void socket_write(int socket, const char* data) {
-  (void)send(socket, data, strlen(data), 0);
+int dc_powermon_priv_format_rsp(char* buff, size_t size, uint8_t type, const void* data, size_t len) {
+  // text in the server's format, binary values have no unit
+  int ret = -1;
+  switch(type) {
+    case DC_POWERMON_REC_TEXT:
+      ret = snprintf(buff, size, "%.*s", (int)len, (const char*)data);
+      break;
+    case DC_POWERMON_REC_VALUE: {
+      float val = 0;
+      if(len == sizeof(val)) {
+        memcpy(&val, data, sizeof(val));
+        ret = snprintf(buff, size, "%g", (double)val);
+      }
+    } break;
+    case DC_POWERMON_REC_MEAS: {
+      struct dc_powermon_rec_meas_t rec;
+      struct dc_powermon_meas_t meas;
+      char text[512];
+      if(len == sizeof(rec)) {
+        memcpy(&rec, data, sizeof(rec));
+        meas_from_record(&meas, &rec);
+        dc_powermon_priv_format_meas(text, &meas);
+        ret = snprintf(buff, size, "%s", text);
+      }
+    } break;
+    case DC_POWERMON_REC_ENERGY: {
+      struct dc_powermon_energy_t res;
+      if(len == sizeof(res)) {
+        memcpy(&res, data, sizeof(res));
+        ret = snprintf(buff, size, "%.6f,%.9f,%.6f,%llu", res.energy, res.charge, res.duration, (unsigned long long)res.count);
+      }
+    } break;
+  }
+
+  // snprintf returns what it would have written
+  if((ret >= 0) && ((size_t)ret >= size)) {
+    ret = size ? size - 1 : 0;
+  }
+  return(ret);
+}
+
+static int rsp_value(const struct dc_powermon_rsp_t* rsp, float* val) {
+  if((rsp->type == DC_POWERMON_REC_VALUE) && (rsp->len == sizeof(float))) {
+    memcpy(val, rsp->data, sizeof(float));
+  } else if(rsp->type == DC_POWERMON_REC_TEXT) {
+    *val = strtof(rsp->data, NULL);
+  } else {
+    return(DC_POWERMON_ERR_RESPONSE);
+  }
+  return(DC_POWERMON_ERR_NONE);
 }
 
-static int scpi_exec(const char* cmd, char* rpl_buff) {
-  if(!cb_read || !cb_write || !cb_setup) {
-    return(EXIT_FAILURE);
+int dc_powermon_dev_query(struct dc_powermon_t* dev, const char* cmd, char* rsp, size_t size, int timeout_ms) {
+  // blocks are not text, in the ASCII format they could not even be told apart from the next response
+  if(!cmd || (strncmp(cmd, DC_POWERMON_CMD_FETCH_DATA, strlen(DC_POWERMON_CMD_FETCH_DATA)) == 0) ||
+     (strncmp(cmd, DC_POWERMON_CMD_FETCH_MARK, strlen(DC_POWERMON_CMD_FETCH_MARK)) == 0)) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+
+  struct dc_powermon_rsp_t rec;
+  int ret = scpi_exec(dev, cmd, rsp ? &rec : NULL, timeout_ms);
+  if((ret != DC_POWERMON_ERR_NONE) || !rsp) {
+    return(ret);
   }
 
-  int fd = cb_setup();
-  if(fd < 0) {
-    return(EXIT_FAILURE);
+  // the caller gets text in either format
+  if(dc_powermon_priv_format_rsp(rsp, size, rec.type, rec.data, rec.len) < 0) {
+    return(DC_POWERMON_ERR_RESPONSE);
   }
-  
-  cb_write(fd, cmd);
-  if(rpl_buff) {
-    (void)cb_read(fd, rpl_buff);
+  return(DC_POWERMON_ERR_NONE);
+}
+
+void dc_powermon_close(struct dc_powermon_t* dev) {
+  if(!dev) {
+    return;
+  }
+
+  // a completion callback that closes the handle would pull it away from under the dispatch that called it
+  dev->async_closing = true;
+  if(dev->async_depth) {
+    return;
   }
-  (void)close(fd);
-  return(EXIT_SUCCESS);
+
+  dc_powermon_priv_disconnect(dev);
+  dc_powermon_priv_async_free(dev);
+  dev_free(dev);
+}
+
+int dc_powermon_dev_read_power(struct dc_powermon_t* dev, float* val) {
+  struct dc_powermon_rsp_t rsp;
+  int ret = scpi_exec(dev, DC_POWERMON_CMD_READ_POWER, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV);
+  if(val && (ret == DC_POWERMON_ERR_NONE)) { ret = rsp_value(&rsp, val); }
+  return(ret);
+}
+
+int dc_powermon_dev_read_current(struct dc_powermon_t* dev, float* val) {
+  struct dc_powermon_rsp_t rsp;
+  int ret = scpi_exec(dev, DC_POWERMON_CMD_READ_CURRENT, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV);
+  if(val && (ret == DC_POWERMON_ERR_NONE)) { ret = rsp_value(&rsp, val); }
+  return(ret);
+}
+
+int dc_powermon_dev_read_vbus(struct dc_powermon_t* dev, float* val) {
+  struct dc_powermon_rsp_t rsp;
+  int ret = scpi_exec(dev, DC_POWERMON_CMD_READ_V_BUS, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV);
+  if(val && (ret == DC_POWERMON_ERR_NONE)) { ret = rsp_value(&rsp, val); }
+  return(ret);
+}
+
+int dc_powermon_dev_read_vshunt(struct dc_powermon_t* dev, float* val) {
+  struct dc_powermon_rsp_t rsp;
+  int ret = scpi_exec(dev, DC_POWERMON_CMD_READ_V_SHUNT, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV);
+  if(val && (ret == DC_POWERMON_ERR_NONE)) { ret = rsp_value(&rsp, val); }
+  return(ret);
+}
+
+int dc_powermon_parse_meas(const char* rsp, struct dc_powermon_meas_t* meas) {
+  if(!rsp || !meas) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+
+  // timestamp is sent as seconds with a fractional part in nanoseconds
+  char* ptr = (char*)rsp;
+  meas->timestamp.tv_sec = strtoll(ptr, &ptr, 10);
+  meas->timestamp.tv_nsec = (*ptr == '.') ? strtol(ptr + 1, &ptr, 10) : 0;
+  if(*ptr != ',') {
+    return(DC_POWERMON_ERR_RESPONSE);
+  }
+  meas->count = strtoul(ptr + 1, &ptr, 10);
+
+  for(int i = 0; i < DC_POWERMON_NUM_CHANNELS; i++) {
+    float* vals[] = { &meas->ch[i].avg, &meas->ch[i].min, &meas->ch[i].max };
+    for(int j = 0; j < 3; j++) {
+      if(*ptr != ',') {
+        return(DC_POWERMON_ERR_RESPONSE);
+      }
+      *vals[j] = strtof(ptr + 1, &ptr);
+    }
+  }
+
+  return(DC_POWERMON_ERR_NONE);
+}
+
+int dc_powermon_dev_read_all(struct dc_powermon_t* dev, struct dc_powermon_meas_t* meas) {
+  struct dc_powermon_rsp_t rsp;
+  int ret = scpi_exec(dev, DC_POWERMON_CMD_MEAS_ALL, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV);
+  if((ret != DC_POWERMON_ERR_NONE) || !meas) {
+    return(ret);
+  }
+  if((rsp.type == DC_POWERMON_REC_MEAS) && (rsp.len == sizeof(struct dc_powermon_rec_meas_t))) {
+    meas_from_record(meas, (const struct dc_powermon_rec_meas_t*)rsp.data);
+    return(DC_POWERMON_ERR_NONE);
+  }
+  return((rsp.type == DC_POWERMON_REC_TEXT) ? dc_powermon_parse_meas(rsp.data, meas) : DC_POWERMON_ERR_RESPONSE);
+}
+
+int dc_powermon_dev_fetch_data(struct dc_powermon_t* dev, uint64_t start, uint64_t stop, struct dc_powermon_sample_t* buff, size_t max, size_t* num) {
+  char cmd[64];
+  sprintf(cmd, DC_POWERMON_CMD_FETCH_DATA " %llu,%llu" DC_POWERMON_CMD_LINEFEED, (unsigned long long)start, (unsigned long long)stop);
+
+  size_t len = 0;
+  int ret = scpi_exec_block(dev, cmd, DC_POWERMON_REC_SAMPLES, buff, max * sizeof(struct dc_powermon_sample_t), &len);
+  if(num) { *num = len / sizeof(struct dc_powermon_sample_t); }
+  return(ret);
+}
+
+static uint64_t parse_timestamp(char* str, char** end) {
+  // seconds with a fractional part in nanoseconds
+  uint64_t sec = strtoull(str, end, 10);
+  uint64_t nsec = (**end == '.') ? strtoull(*end + 1, end, 10) : 0;
+  return(sec * 1000000000ULL + nsec);
+}
+
+int dc_powermon_dev_mark(struct dc_powermon_t* dev, const char* label, uint64_t* timestamp) {
+  // the label is sent in quotes, so it can't contain any
+  char cmd[DC_POWERMON_MARKER_LABEL_LEN + 16];
+  if(!label || (strlen(label) >= DC_POWERMON_MARKER_LABEL_LEN) || strpbrk(label, "\"\r\n")) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+  sprintf(cmd, DC_POWERMON_CMD_MARK " \"%s\"" DC_POWERMON_CMD_LINEFEED, label);
+
+  struct dc_powermon_rsp_t rsp;
+  int ret = scpi_exec(dev, cmd, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV);
+  if((ret != DC_POWERMON_ERR_NONE) || !timestamp) {
+    return(ret);
+  }
+  if(rsp.type != DC_POWERMON_REC_TEXT) {
+    return(DC_POWERMON_ERR_RESPONSE);
+  }
+
+  char* ptr = rsp.data;
+  *timestamp = parse_timestamp(ptr, &ptr);
+  return((ptr == rsp.data) ? DC_POWERMON_ERR_RESPONSE : DC_POWERMON_ERR_NONE);
+}
+
+int dc_powermon_dev_fetch_markers(struct dc_powermon_t* dev, uint64_t start, uint64_t stop, struct dc_powermon_marker_t* buff, size_t max, size_t* num) {
+  char cmd[64];
+  sprintf(cmd, DC_POWERMON_CMD_FETCH_MARK " %llu,%llu" DC_POWERMON_CMD_LINEFEED, (unsigned long long)start, (unsigned long long)stop);
+
+  size_t len = 0;
+  int ret = scpi_exec_block(dev, cmd, DC_POWERMON_REC_MARKERS, buff, max * sizeof(struct dc_powermon_marker_t), &len);
+  if(num) { *num = len / sizeof(struct dc_powermon_marker_t); }
+  return(ret);
+}
+
+static int rsp_energy(const struct dc_powermon_rsp_t* rsp, struct dc_powermon_energy_t* res) {
+  if((rsp->type == DC_POWERMON_REC_ENERGY) && (rsp->len == sizeof(struct dc_powermon_energy_t))) {
+    memcpy(res, rsp->data, sizeof(struct dc_powermon_energy_t));
+    return(DC_POWERMON_ERR_NONE);
+  }
+  if((rsp->type != DC_POWERMON_REC_TEXT) || (strcmp(rsp->data, "ERR") == 0)) {
+    return(DC_POWERMON_ERR_RESPONSE);
+  }
+
+  unsigned long long count = 0;
+  if(sscanf(rsp->data, "%lf,%lf,%lf,%llu", &res->energy, &res->charge, &res->duration, &count) != 4) {
+    return(DC_POWERMON_ERR_RESPONSE);
+  }
+  res->count = count;
+  return(DC_POWERMON_ERR_NONE);
+}
+
+int dc_powermon_dev_energy_start(struct dc_powermon_t* dev) {
+  struct dc_powermon_rsp_t rsp;
+  int ret = scpi_exec(dev, DC_POWERMON_CMD_ENERGY_START, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV);
+  if(ret != DC_POWERMON_ERR_NONE) {
+    return(ret);
+  }
+  return(((rsp.type == DC_POWERMON_REC_TEXT) && (strcmp(rsp.data, "OK") == 0)) ? DC_POWERMON_ERR_NONE : DC_POWERMON_ERR_RESPONSE);
+}
+
+int dc_powermon_dev_energy_stop(struct dc_powermon_t* dev, struct dc_powermon_energy_t* res) {
+  struct dc_powermon_rsp_t rsp;
+  int ret = scpi_exec(dev, DC_POWERMON_CMD_ENERGY_STOP, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV);
+  if((ret != DC_POWERMON_ERR_NONE) || !res) {
+    return(ret);
+  }
+  return(rsp_energy(&rsp, res));
+}
+
+int dc_powermon_dev_energy_marks(struct dc_powermon_t* dev, const char* from, const char* to, struct dc_powermon_energy_t* res) {
+  char cmd[2 * DC_POWERMON_MARKER_LABEL_LEN + 32];
+  if(!from || (strlen(from) >= DC_POWERMON_MARKER_LABEL_LEN) || strpbrk(from, "\"\r\n") ||
+     (to && ((strlen(to) >= DC_POWERMON_MARKER_LABEL_LEN) || strpbrk(to, "\"\r\n")))) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+  int len = sprintf(cmd, DC_POWERMON_CMD_ENERGY_MARK " \"%s\"", from);
+  if(to) {
+    len += sprintf(&cmd[len], ",\"%s\"", to);
+  }
+  sprintf(&cmd[len], DC_POWERMON_CMD_LINEFEED);
+
+  struct dc_powermon_rsp_t rsp;
+  int ret = scpi_exec(dev, cmd, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV);
+  if((ret != DC_POWERMON_ERR_NONE) || !res) {
+    return(ret);
+  }
+  return(rsp_energy(&rsp, res));
+}
+
+int dc_powermon_dev_energy_total(struct dc_powermon_t* dev, struct dc_powermon_energy_t* res) {
+  struct dc_powermon_rsp_t rsp;
+  int ret = scpi_exec(dev, DC_POWERMON_CMD_ENERGY_TOTAL, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV);
+  if((ret != DC_POWERMON_ERR_NONE) || !res) {
+    return(ret);
+  }
+  return(rsp_energy(&rsp, res));
+}
+
+int dc_powermon_dev_session(struct dc_powermon_t* dev, struct dc_powermon_session_t* session) {
+  struct dc_powermon_rsp_t rsp;
+  int ret = scpi_exec(dev, DC_POWERMON_CMD_SESSION, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV);
+  if((ret != DC_POWERMON_ERR_NONE) || !session) {
+    return(ret);
+  }
+  if(rsp.type != DC_POWERMON_REC_TEXT) {
+    return(DC_POWERMON_ERR_RESPONSE);
+  }
+
+  char* ptr = rsp.data;
+  session->id = strtoull(ptr, &ptr, 16);
+  if(*ptr != ',') {
+    return(DC_POWERMON_ERR_RESPONSE);
+  }
+  uint64_t started = parse_timestamp(ptr + 1, &ptr);
+  if(*ptr != ',') {
+    return(DC_POWERMON_ERR_RESPONSE);
+  }
+  session->started.tv_sec = started / 1000000000ULL;
+  session->started.tv_nsec = started % 1000000000ULL;
+  session->restores = strtoul(ptr + 1, NULL, 10);
+  return(DC_POWERMON_ERR_NONE);
+}
+
+int dc_powermon_dev_exit(struct dc_powermon_t* dev) {
+  struct dc_powermon_rsp_t rsp;
+  return(scpi_exec(dev, DC_POWERMON_CMD_SYSTEM_EXIT, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV));
+}
+
+int dc_powermon_dev_reset(struct dc_powermon_t* dev) {
+  struct dc_powermon_rsp_t rsp;
+  return(scpi_exec(dev, DC_POWERMON_CMD_RESET, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV));
+}
+
+int dc_powermon_dev_id(struct dc_powermon_t* dev, char* buff) {
+  struct dc_powermon_rsp_t rsp;
+  int ret = scpi_exec(dev, DC_POWERMON_CMD_ID, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV);
+  if(buff && (ret == DC_POWERMON_ERR_NONE)) {
+    snprintf(buff, 256, "%.255s", rsp.data);
+  }
+  return(ret);
+}
+
+int dc_powermon_dev_clock_offset(struct dc_powermon_t* dev, int64_t* offset) {
+  struct dc_powermon_rsp_t rsp;
+  int ret = scpi_exec(dev, DC_POWERMON_CMD_TIME, &rsp, DC_POWERMON_PRIV_TIMEOUT_DEV);
+  if((ret != DC_POWERMON_ERR_NONE) || !offset) {
+    return(ret);
+  }
+  if(rsp.type != DC_POWERMON_REC_TEXT) {
+    return(DC_POWERMON_ERR_RESPONSE);
+  }
+
+  char* ptr = rsp.data;
+  uint64_t raw = parse_timestamp(ptr, &ptr);
+  if(*ptr != ',') {
+    return(DC_POWERMON_ERR_RESPONSE);
+  }
+  uint64_t real = parse_timestamp(ptr + 1, &ptr);
+  *offset = (int64_t)(real - raw);
+  return(DC_POWERMON_ERR_NONE);
 }
 
 int dc_powermon_init_socket(const char* hostname, int port) {
-  struct hostent* hostnm = gethostbyname(hostname);
-  if(!hostnm) {
-    return(EXIT_FAILURE);
+  pthread_rwlock_wrlock(&dev_default_lock);
+
+  // initializing again with the same server keeps the resolved address and the connection
+  int ret = DC_POWERMON_ERR_NONE;
+  if(!dev_default || !hostname || strcmp(dev_default->hostname, hostname) || (dev_default->port != port)) {
+    dc_powermon_close(dev_default);
+    dev_default = dc_powermon_open(hostname, port);
+    ret = dev_default ? DC_POWERMON_ERR_NONE : DC_POWERMON_ERR_CONNECT;
   }
 
-  memcpy(&server.sin_addr, hostnm->h_addr_list[0], hostnm->h_length);
-  server.sin_port = htons(port);
-  cb_read = socket_read;
-  cb_write = socket_write;
-  cb_setup = socket_setup;
-  return(EXIT_SUCCESS);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
+}
+
+void dc_powermon_set_timeout(int timeout_ms) {
+  pthread_rwlock_rdlock(&dev_default_lock);
+  dc_powermon_dev_set_timeout(dev_default, timeout_ms);
+  pthread_rwlock_unlock(&dev_default_lock);
+}
+
+void dc_powermon_set_coalesce(int window_ms) {
+  pthread_rwlock_rdlock(&dev_default_lock);
+  dc_powermon_dev_set_coalesce(dev_default, window_ms);
+  pthread_rwlock_unlock(&dev_default_lock);
 }
 
 int dc_powermon_read_power(float* val) {
-  char rpl_buff[256];
-  int ret = scpi_exec(DC_POWERMON_CMD_READ_POWER, rpl_buff);
-  if(val) { *val = strtof(rpl_buff, NULL); }
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_read_power(dev_default, val);
+  pthread_rwlock_unlock(&dev_default_lock);
   return(ret);
 }
 
 int dc_powermon_read_current(float* val) {
-  char rpl_buff[256];
-  int ret = scpi_exec(DC_POWERMON_CMD_READ_CURRENT, rpl_buff);
-  if(val) { *val = strtof(rpl_buff, NULL); }
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_read_current(dev_default, val);
+  pthread_rwlock_unlock(&dev_default_lock);
   return(ret);
 }
 
 int dc_powermon_read_vbus(float* val) {
-  char rpl_buff[256];
-  int ret = scpi_exec(DC_POWERMON_CMD_READ_V_BUS, rpl_buff);
-  if(val) { *val = strtof(rpl_buff, NULL); }
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_read_vbus(dev_default, val);
+  pthread_rwlock_unlock(&dev_default_lock);
   return(ret);
 }
 
 int dc_powermon_read_vshunt(float* val) {
-  char rpl_buff[256];
-  int ret = scpi_exec(DC_POWERMON_CMD_READ_V_SHUNT, rpl_buff);
-  if(val) { *val = strtof(rpl_buff, NULL); }
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_read_vshunt(dev_default, val);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
+}
+
+int dc_powermon_read_all(struct dc_powermon_meas_t* meas) {
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_read_all(dev_default, meas);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
+}
+
+int dc_powermon_fetch_data(uint64_t start, uint64_t stop, struct dc_powermon_sample_t* buff, size_t max, size_t* num) {
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_fetch_data(dev_default, start, stop, buff, max, num);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
+}
+
+int dc_powermon_mark(const char* label, uint64_t* timestamp) {
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_mark(dev_default, label, timestamp);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
+}
+
+int dc_powermon_fetch_markers(uint64_t start, uint64_t stop, struct dc_powermon_marker_t* buff, size_t max, size_t* num) {
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_fetch_markers(dev_default, start, stop, buff, max, num);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
+}
+
+int dc_powermon_energy_start() {
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_energy_start(dev_default);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
+}
+
+int dc_powermon_energy_stop(struct dc_powermon_energy_t* res) {
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_energy_stop(dev_default, res);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
+}
+
+int dc_powermon_energy_marks(const char* from, const char* to, struct dc_powermon_energy_t* res) {
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_energy_marks(dev_default, from, to, res);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
+}
+
+int dc_powermon_energy_total(struct dc_powermon_energy_t* res) {
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_energy_total(dev_default, res);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
+}
+
+int dc_powermon_session(struct dc_powermon_session_t* session) {
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_session(dev_default, session);
+  pthread_rwlock_unlock(&dev_default_lock);
   return(ret);
 }
 
 int dc_powermon_exit() {
-  return(scpi_exec(DC_POWERMON_CMD_SYSTEM_EXIT, NULL));
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_exit(dev_default);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
 }
 
 int dc_powermon_reset() {
-  return(scpi_exec(DC_POWERMON_CMD_RESET, NULL));
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_reset(dev_default);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
 }
 
 int dc_powermon_id(char* buff) {
-  return(scpi_exec(DC_POWERMON_CMD_ID, buff));
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_id(dev_default, buff);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
+}
+
+int dc_powermon_clock_offset(int64_t* offset) {
+  pthread_rwlock_rdlock(&dev_default_lock);
+  int ret = dc_powermon_dev_clock_offset(dev_default, offset);
+  pthread_rwlock_unlock(&dev_default_lock);
+  return(ret);
 }
@@ -1,18 +1,235 @@
 #ifndef DC_POWERMON_CLIENT_H
 #define DC_POWERMON_CLIENT_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "dc_powermon_cmds.h"
+#include "dc_powermon_shm.h"
+
 #ifdef __cplusplus
 extern "C"{
 #endif 
 
+// channel indexes, in the order the server reports them
+enum dc_powermon_channel_e {
+  DC_POWERMON_CH_V_BUS = 0,
+  DC_POWERMON_CH_V_SHUNT,
+  DC_POWERMON_CH_I_SHUNT,
+  DC_POWERMON_CH_P_SHUNT,
+  DC_POWERMON_NUM_CHANNELS,
+};
+
+// default deadline for a single query, including (re)connecting
+#define DC_POWERMON_TIMEOUT_DEFAULT       2000
+
+// default TCP port of the SCPI control interface
+#define DC_POWERMON_PORT_DEFAULT          41123
+
+// URI schemes accepted by dc_powermon_open_uri
+// tcp://host[:port] (IPv6 addresses in brackets, e.g. tcp://[::1]:41123), unix:///path/to/socket or shm://name (the daemon's --shm_name)
+// a URI without a scheme is taken as a TCP host
+#define DC_POWERMON_URI_TCP               "tcp://"
+#define DC_POWERMON_URI_UNIX              "unix://"
+#define DC_POWERMON_URI_SHM               "shm://"
+
+// return codes of all functions, anything other than zero is an error
+enum dc_powermon_err_e {
+  DC_POWERMON_ERR_NONE = 0,
+  DC_POWERMON_ERR_FAILED,       // generic failure, e.g. invalid arguments
+  DC_POWERMON_ERR_TIMEOUT,      // the server did not respond before the deadline
+  DC_POWERMON_ERR_CONNECT,      // failed to connect to the server
+  DC_POWERMON_ERR_CLOSED,       // the server closed the connection
+  DC_POWERMON_ERR_RESPONSE,     // the response could not be parsed
+};
+
+// maximum number of asynchronous requests in flight on a single handle
+#define DC_POWERMON_ASYNC_MAX             64
+
+// connection to a single server, opaque to the user
+struct dc_powermon_t;
+
+// completion of an asynchronous request
+// err is one of dc_powermon_err_e, rsp is the response line without CR/LF (NUL-terminated),
+// or the data of a binary block, only valid until the callback returns
+typedef void (*dc_powermon_cb_t)(struct dc_powermon_t* dev, int err, const char* rsp, size_t len, void* user);
+
+// statistics of a single channel
+struct dc_powermon_stat_t {
+  float avg;
+  float min;
+  float max;
+};
+
+// snapshot of all channels taken from the same server state
+struct dc_powermon_meas_t {
+  struct timespec timestamp;
+  unsigned long count;
+  struct dc_powermon_stat_t ch[DC_POWERMON_NUM_CHANNELS];
+};
+
+// measurement session of the daemon, see SYST:SESS?
+struct dc_powermon_session_t {
+  uint64_t id;
+  struct timespec started;  // CLOCK_REALTIME of the daemon's machine
+  unsigned long restores;   // how often the daemon restarted and carried on with this session
+};
+
+// receiver state for samples published over UDP multicast or broadcast
+struct dc_powermon_mcast_t {
+  int fd;
+  bool started;
+  uint32_t next_seq;
+  uint32_t gap;         // frames missing right before the last one received
+  uint64_t lost;        // frames missing in total
+  uint64_t frames;      // frames received in total
+  uint32_t dropped;     // samples the publisher failed to send
+  bool marked;          // the last frame received was a marker, it is in marker instead of the samples
+  struct dc_powermon_marker_t marker;
+};
+
+// number of samples buffered between the stream reader thread and the consumer, must be a power of 2
+#define DC_POWERMON_STREAM_RING_SIZE      65536
+
+// same for markers
+#define DC_POWERMON_STREAM_MARKER_SIZE    256
+
+// sample stream received in a background thread
+struct dc_powermon_stream_t;
+
+// delivers a contiguous block of samples, channels that were not requested are NaN
+typedef void (*dc_powermon_stream_cb_t)(const struct dc_powermon_sample_t* samples, size_t num, void* user);
+
+struct dc_powermon_stream_stats_t {
+  uint64_t frames;          // frames received
+  uint64_t samples;         // samples received
+  uint64_t lost_frames;     // gaps in frame sequence numbers
+  uint32_t server_dropped;  // samples and markers the server dropped because the stream was too slow
+  uint64_t client_dropped;  // samples dropped because the consumer did not keep up
+  uint64_t markers;         // markers received
+  int error;                // set when the stream ended, one of dc_powermon_err_e
+};
+
+// reader of the shared memory segment published by the daemon
+struct dc_powermon_shm_reader_t {
+  const struct dc_powermon_shm_t* shm;
+  uint64_t pos;         // index of the next sample to read
+  uint64_t lost;        // samples overwritten before they could be read
+  uint64_t marker_pos;  // index of the next marker to read
+  uint64_t generation;  // of the segment when it was opened
+};
+
+// explicit handles, each one keeps its own connection open across calls and reconnects when needed
+// the server name is resolved only once when opening, all its IPv4 and IPv6 addresses are tried when connecting
+// synchronous calls may be made from any number of threads, on the same handle they are serialized
+// timeouts are in ms and apply to the whole query, negative timeout means wait forever
+// the shared memory transport answers queries directly from the segment published by the daemon started with --shm
+// it only supports the measurement queries, *IDN?, FETCH:DATA? and FETCH:MARK?, it can't be used asynchronously or for streaming
+// connections switch to the binary format (SYST:FORM BIN) when the server supports it, values are then not rounded
+// dc_powermon_dev_query still returns text: binary values without their unit, MEAS:ALL? in the usual CSV format
+// FETCH:DATA? and FETCH:MARK? can't be sent by dc_powermon_dev_query, use dc_powermon_dev_fetch_data and dc_powermon_dev_fetch_markers
+struct dc_powermon_t* dc_powermon_open(const char* hostname, int port);
+struct dc_powermon_t* dc_powermon_open_uri(const char* uri);
+void dc_powermon_close(struct dc_powermon_t* dev);
+void dc_powermon_dev_set_timeout(struct dc_powermon_t* dev, int timeout_ms);
+int dc_powermon_dev_query(struct dc_powermon_t* dev, const char* cmd, char* rsp, size_t size, int timeout_ms);
+
+// coalescing of identical read-only queries (measurement queries, MEAS:ALL? and *IDN?) from concurrent threads, disabled by default
+// callers asking while the same query is in flight get its result instead of sending their own,
+// results younger than window_ms are reused as well, negative window_ms disables coalescing again
+void dc_powermon_dev_set_coalesce(struct dc_powermon_t* dev, int window_ms);
+int dc_powermon_dev_read_power(struct dc_powermon_t* dev, float* val);
+int dc_powermon_dev_read_current(struct dc_powermon_t* dev, float* val);
+int dc_powermon_dev_read_vbus(struct dc_powermon_t* dev, float* val);
+int dc_powermon_dev_read_vshunt(struct dc_powermon_t* dev, float* val);
+int dc_powermon_dev_read_all(struct dc_powermon_t* dev, struct dc_powermon_meas_t* meas);
+int dc_powermon_dev_fetch_data(struct dc_powermon_t* dev, uint64_t start, uint64_t stop, struct dc_powermon_sample_t* buff, size_t max, size_t* num);
+
+// event markers, stored by the daemon and published in order with the samples
+// the label may not contain quotes or line breaks, timestamp (may be NULL) is when the daemon received the marker
+int dc_powermon_dev_mark(struct dc_powermon_t* dev, const char* label, uint64_t* timestamp);
+int dc_powermon_dev_fetch_markers(struct dc_powermon_t* dev, uint64_t start, uint64_t stop, struct dc_powermon_marker_t* buff, size_t max, size_t* num);
+
+// energy and charge integrated by the daemon over every sample, see ENERGY:START, ENERGY:STOP? and ENERGY:MARK?
+// marks returns the interval from the latest marker labelled from to the next one labelled to (NULL for any label)
+// total returns everything since the session started
+int dc_powermon_dev_energy_start(struct dc_powermon_t* dev);
+int dc_powermon_dev_energy_stop(struct dc_powermon_t* dev, struct dc_powermon_energy_t* res);
+int dc_powermon_dev_energy_marks(struct dc_powermon_t* dev, const char* from, const char* to, struct dc_powermon_energy_t* res);
+int dc_powermon_dev_energy_total(struct dc_powermon_t* dev, struct dc_powermon_energy_t* res);
+int dc_powermon_dev_session(struct dc_powermon_t* dev, struct dc_powermon_session_t* session);
+int dc_powermon_dev_exit(struct dc_powermon_t* dev);
+int dc_powermon_dev_reset(struct dc_powermon_t* dev);
+int dc_powermon_dev_id(struct dc_powermon_t* dev, char* buff);
+
+// sample timestamps are CLOCK_MONOTONIC_RAW of the daemon's machine in ns
+// adding this offset maps them to its CLOCK_REALTIME, it changes slowly as the wall clock is adjusted
+int dc_powermon_dev_clock_offset(struct dc_powermon_t* dev, int64_t* offset);
+
+// parse the response to MEAS:ALL?
+int dc_powermon_parse_meas(const char* rsp, struct dc_powermon_meas_t* meas);
+
+// asynchronous API, the caller polls the file descriptor in its own loop
+// and calls dc_powermon_async_process when it is ready for the events from dc_powermon_async_events
+// requests are sent in order on a single connection and completed in the same order
+// the file descriptor may change after an error, in which case all pending requests fail
+// synchronous calls on the same handle fail while asynchronous requests are pending
+// a handle is driven by a single thread at a time, the event loop owns it while requests are pending
+// each request is a single command terminated by a linefeed, SYST:FORM and SYS:EXIT can only be sent synchronously
+// callbacks may submit, cancel or close the handle, a handle closed by a callback is freed once the call that ran it returns
+int dc_powermon_async_fd(struct dc_powermon_t* dev);
+short dc_powermon_async_events(struct dc_powermon_t* dev);
+size_t dc_powermon_async_pending(struct dc_powermon_t* dev);
+int dc_powermon_async_submit(struct dc_powermon_t* dev, const char* cmd, dc_powermon_cb_t cb, void* user);
+int dc_powermon_async_process(struct dc_powermon_t* dev);
+void dc_powermon_async_cancel(struct dc_powermon_t* dev);
+
+// push stream of samples, the handle's connection is used for the stream until it is stopped
+// with a callback, samples are delivered from a separate thread, otherwise they must be read by dc_powermon_stream_read
+// markers are always read by dc_powermon_stream_read_markers, their timestamps place them between the samples
+struct dc_powermon_stream_t* dc_powermon_stream_start(struct dc_powermon_t* dev, double rate, uint8_t channels, dc_powermon_stream_cb_t cb, void* user);
+size_t dc_powermon_stream_read(struct dc_powermon_stream_t* st, struct dc_powermon_sample_t* buff, size_t max);
+size_t dc_powermon_stream_read_markers(struct dc_powermon_stream_t* st, struct dc_powermon_marker_t* buff, size_t max);
+void dc_powermon_stream_get_stats(struct dc_powermon_stream_t* st, struct dc_powermon_stream_stats_t* stats);
+void dc_powermon_stream_stop(struct dc_powermon_stream_t* st);
+
+// same as above, using a default handle set up by dc_powermon_init_socket
 int dc_powermon_init_socket(const char* hostname, int port);
+void dc_powermon_set_timeout(int timeout_ms);
+void dc_powermon_set_coalesce(int window_ms);
 int dc_powermon_read_power(float* val);
 int dc_powermon_read_current(float* val);
 int dc_powermon_read_vbus(float* val);
 int dc_powermon_read_vshunt(float* val);
+int dc_powermon_read_all(struct dc_powermon_meas_t* meas);
+int dc_powermon_fetch_data(uint64_t start, uint64_t stop, struct dc_powermon_sample_t* buff, size_t max, size_t* num);
+int dc_powermon_mark(const char* label, uint64_t* timestamp);
+int dc_powermon_fetch_markers(uint64_t start, uint64_t stop, struct dc_powermon_marker_t* buff, size_t max, size_t* num);
+int dc_powermon_energy_start();
+int dc_powermon_energy_stop(struct dc_powermon_energy_t* res);
+int dc_powermon_energy_marks(const char* from, const char* to, struct dc_powermon_energy_t* res);
+int dc_powermon_energy_total(struct dc_powermon_energy_t* res);
+int dc_powermon_session(struct dc_powermon_session_t* session);
 int dc_powermon_exit();
 int dc_powermon_reset();
 int dc_powermon_id(char* buff);
+int dc_powermon_clock_offset(int64_t* offset);
+
+int dc_powermon_mcast_open(struct dc_powermon_mcast_t* rx, const char* addr, int port, const char* iface);
+int dc_powermon_mcast_recv(struct dc_powermon_mcast_t* rx, struct dc_powermon_sample_t* buff, size_t max, size_t* num);
+void dc_powermon_mcast_close(struct dc_powermon_mcast_t* rx);
+
+// reads return nothing once the daemon shut down or restarted, dc_powermon_shm_alive then returns false and the segment has to be opened again
+// dc_powermon_shm_read_stats and dc_powermon_shm_read_all return one of dc_powermon_err_e, DC_POWERMON_ERR_CLOSED in that case
+int dc_powermon_shm_open(struct dc_powermon_shm_reader_t* rd, const char* name);
+bool dc_powermon_shm_alive(const struct dc_powermon_shm_reader_t* rd);
+size_t dc_powermon_shm_read(struct dc_powermon_shm_reader_t* rd, struct dc_powermon_sample_t* buff, size_t max);
+size_t dc_powermon_shm_read_markers(struct dc_powermon_shm_reader_t* rd, struct dc_powermon_marker_t* buff, size_t max);
+int dc_powermon_shm_read_stats(struct dc_powermon_shm_reader_t* rd, struct dc_powermon_shm_stats_t* stats);
+int dc_powermon_shm_read_all(struct dc_powermon_shm_reader_t* rd, struct dc_powermon_meas_t* meas);
+void dc_powermon_shm_close(struct dc_powermon_shm_reader_t* rd);
 
 #ifdef __cplusplus
 }
@@ -1,16 +1,158 @@
 #ifndef DC_POWERMON_CMDS_H
 #define DC_POWERMON_CMDS_H
 
+#include <stdint.h>
+
 #define DC_POWERMON_CMD_LINEFEED          "\n"
 #define DC_POWERMON_RSP_LINEFEED          "\r\n"
+#define DC_POWERMON_RSP_OK                "OK" DC_POWERMON_RSP_LINEFEED
+#define DC_POWERMON_RSP_ERR               "ERR" DC_POWERMON_RSP_LINEFEED
 
+// every command gets exactly one response, OK for commands that have no result of their own
 #define DC_POWERMON_CMD_SYSTEM_EXIT       "SYS:EXIT" DC_POWERMON_CMD_LINEFEED
 #define DC_POWERMON_CMD_RESET             "*RST" DC_POWERMON_CMD_LINEFEED
 #define DC_POWERMON_CMD_ID                "*IDN?" DC_POWERMON_CMD_LINEFEED
 
+// by default the server closes the connection after the first command, unless asked to keep it open
+#define DC_POWERMON_CMD_KEEP_ON           "SYST:KEEP ON" DC_POWERMON_CMD_LINEFEED
+#define DC_POWERMON_CMD_KEEP_OFF          "SYST:KEEP OFF" DC_POWERMON_CMD_LINEFEED
+
+// response format of this connection, replies to these two are always an ASCII line
+// in binary format, every response is a struct dc_powermon_rec_hdr_t followed by its payload
+#define DC_POWERMON_CMD_FORM_BIN          "SYST:FORM BIN" DC_POWERMON_CMD_LINEFEED
+#define DC_POWERMON_CMD_FORM_ASC          "SYST:FORM ASC" DC_POWERMON_CMD_LINEFEED
+
+// clocks of the daemon's machine read at the same instant, response is "<monotonic raw>,<realtime>"
+// sample timestamps are CLOCK_MONOTONIC_RAW, adding the difference of the two maps them to wall-clock time
+#define DC_POWERMON_CMD_TIME              "SYST:TIME?" DC_POWERMON_CMD_LINEFEED
+
+// measurement session, which carries on across restarts of a daemon started with --state
+// response is "<id>,<started>,<restores>", the ID in hex, when it started in CLOCK_REALTIME
+// and how often it was restored
+#define DC_POWERMON_CMD_SESSION           "SYST:SESS?" DC_POWERMON_CMD_LINEFEED
+
 #define DC_POWERMON_CMD_READ_POWER        "POWER:READ?" DC_POWERMON_CMD_LINEFEED
 #define DC_POWERMON_CMD_READ_CURRENT      "CURR:READ?" DC_POWERMON_CMD_LINEFEED
 #define DC_POWERMON_CMD_READ_V_BUS        "VOLT:BUS:READ?" DC_POWERMON_CMD_LINEFEED
 #define DC_POWERMON_CMD_READ_V_SHUNT      "VOLT:SHUNT:READ?" DC_POWERMON_CMD_LINEFEED
 
+// timing of the acquisition loop, response is comma-separated:
+// <phase>=<avg>/<max> in us for read, stats, publish, console and control, missed=<missed deadlines>
+// and hist=<n0>/<n1>/... where bucket n counts intervals between samples of 2^n us and up
+#define DC_POWERMON_CMD_PERF              "SYST:PERF?" DC_POWERMON_CMD_LINEFEED
+
+// number of samples skipped because acquisition at the rate set by --rate fell behind
+#define DC_POWERMON_CMD_OVERRUNS          "ACQ:OVERRUN?" DC_POWERMON_CMD_LINEFEED
+
+// how late samples at the rate set by --rate were taken relative to their deadlines
+// response is "<samples>,<min>,<avg>,<max>,<std>" in us
+#define DC_POWERMON_CMD_JITTER            "ACQ:JITTER?" DC_POWERMON_CMD_LINEFEED
+
+// snapshot of all channels, response is comma-separated:
+// <timestamp>,<count>,<avg>,<min>,<max> for V_bus, V_shunt, I_shunt and P_shunt
+#define DC_POWERMON_CMD_MEAS_ALL          "MEAS:ALL?" DC_POWERMON_CMD_LINEFEED
+
+// raw sample history, optionally followed by " <start>,<stop>" sample timestamps in ns
+// response is an IEEE 488.2 definite-length block of struct dc_powermon_sample_t
+#define DC_POWERMON_CMD_FETCH_DATA        "FETCH:DATA?"
+
+// event marker, argument is the label in double quotes, e.g. MARK "tx start"
+// the marker is timestamped when the daemon receives it, the response is that timestamp
+// labels longer than DC_POWERMON_MARKER_LABEL_LEN - 1 characters are truncated
+#define DC_POWERMON_CMD_MARK              "MARK"
+
+// markers received so far, optionally followed by " <start>,<stop>" timestamps in ns
+// response is an IEEE 488.2 definite-length block of struct dc_powermon_marker_t
+#define DC_POWERMON_CMD_FETCH_MARK        "FETCH:MARK?"
+
+// energy and charge integrated over every sample, response is "<energy>,<charge>,<duration>,<count>"
+// in mJ, mAh, s and number of samples integrated
+// ENERGY:START starts a new interval, ENERGY:STOP? ends it and returns the result
+// ENERGY:MARK? "<from>"[,"<to>"] returns the interval from the latest marker labelled from
+// to the first marker after it labelled to (or with any label), up to now if there is none yet
+// ENERGY:TOTAL? returns the totals of the session up to now
+#define DC_POWERMON_CMD_ENERGY_START      "ENERGY:START" DC_POWERMON_CMD_LINEFEED
+#define DC_POWERMON_CMD_ENERGY_STOP       "ENERGY:STOP?" DC_POWERMON_CMD_LINEFEED
+#define DC_POWERMON_CMD_ENERGY_MARK       "ENERGY:MARK?"
+#define DC_POWERMON_CMD_ENERGY_TOTAL      "ENERGY:TOTAL?" DC_POWERMON_CMD_LINEFEED
+
+// push stream of samples, arguments are "<rate>,<channels>[,<format>[,<policy>]]"
+// rate is in Hz (0 for every sample), channels is a mask of (1 << channel index)
+// server replies OK (a TEXT record on a binary connection) and then keeps sending frames until the connection is closed
+// or STREAM:STOP is received
+// markers are sent in between the samples, as marker frames or CSV lines <timestamp>,MARK,"<label>"
+#define DC_POWERMON_CMD_STREAM_START      "STREAM:START"
+#define DC_POWERMON_CMD_STREAM_STOP       "STREAM:STOP" DC_POWERMON_CMD_LINEFEED
+#define DC_POWERMON_STREAM_FMT_CSV        "CSV"
+#define DC_POWERMON_STREAM_FMT_BIN        "BIN"
+#define DC_POWERMON_STREAM_POLICY_DROP    "DROP"
+#define DC_POWERMON_STREAM_POLICY_DISC    "DISC"
+
+#define DC_POWERMON_SAMPLE_NUM_VALS       4
+
+// single raw sample as sent in binary blocks, in host byte order
+struct __attribute__((packed)) dc_powermon_sample_t {
+  uint64_t timestamp;   // CLOCK_MONOTONIC_RAW of the daemon's machine in ns, see SYST:TIME?
+  float val[DC_POWERMON_SAMPLE_NUM_VALS]; // V_bus [V], V_shunt [mV], I_shunt [mA], P_shunt [mW]
+};
+
+// event marker set by a client
+#define DC_POWERMON_MARKER_LABEL_LEN      32
+
+struct __attribute__((packed)) dc_powermon_marker_t {
+  uint64_t timestamp;   // same clock as the sample timestamps
+  char label[DC_POWERMON_MARKER_LABEL_LEN]; // NUL-terminated
+};
+
+// binary format records, all fields are little-endian (the host byte order of all supported platforms)
+#define DC_POWERMON_REC_MAGIC             0xDB
+#define DC_POWERMON_REC_TEXT              0x01  // ASCII response without the linefeed, e.g. *IDN?, OK or ERR
+#define DC_POWERMON_REC_VALUE             0x02  // single float in the unit of the text response
+#define DC_POWERMON_REC_MEAS              0x03  // struct dc_powermon_rec_meas_t
+#define DC_POWERMON_REC_SAMPLES           0x04  // any number of struct dc_powermon_sample_t
+#define DC_POWERMON_REC_MARKERS           0x05  // any number of struct dc_powermon_marker_t
+#define DC_POWERMON_REC_ENERGY            0x06  // struct dc_powermon_energy_t
+
+struct __attribute__((packed)) dc_powermon_rec_hdr_t {
+  uint8_t magic;
+  uint8_t type;
+  uint16_t reserved;
+  uint32_t len;         // payload length in bytes
+};
+
+// MEAS:ALL? response
+struct __attribute__((packed)) dc_powermon_rec_meas_t {
+  uint64_t timestamp;   // CLOCK_REALTIME in ns
+  uint64_t count;
+  float avg[DC_POWERMON_SAMPLE_NUM_VALS];
+  float min[DC_POWERMON_SAMPLE_NUM_VALS];
+  float max[DC_POWERMON_SAMPLE_NUM_VALS];
+};
+
+// ENERGY:STOP?, ENERGY:MARK? and ENERGY:TOTAL? response
+struct __attribute__((packed)) dc_powermon_energy_t {
+  double energy;        // mJ
+  double charge;        // mAh
+  double duration;      // s
+  uint64_t count;       // number of samples in the interval
+};
+
+// binary frames start with this header, followed by num records
+// in sample frames, each record is a uint64_t timestamp and one float for each channel in the mask
+// marker frames are sent as soon as a marker is set, each record is a struct dc_powermon_marker_t
+#define DC_POWERMON_FRAME_MAGIC           0xDC
+#define DC_POWERMON_FRAME_SAMPLES         0x01
+#define DC_POWERMON_FRAME_MARKER          0x02
+
+struct __attribute__((packed)) dc_powermon_frame_hdr_t {
+  uint8_t magic;
+  uint8_t type;
+  uint8_t channels;
+  uint8_t reserved;
+  uint32_t seq;         // incremented for every frame, gaps mean lost frames
+  uint32_t dropped;     // total number of samples and markers dropped by the sender
+  uint16_t num;
+  uint16_t len;         // length of the records following the header in bytes
+};
+
 #endif
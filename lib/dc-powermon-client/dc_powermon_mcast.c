@@ -0,0 +1,113 @@
+#include "dc_powermon_client.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+int dc_powermon_mcast_open(struct dc_powermon_mcast_t* rx, const char* addr, int port, const char* iface) {
+  if(!rx || !addr) {
+    return(EXIT_FAILURE);
+  }
+  memset(rx, 0, sizeof(struct dc_powermon_mcast_t));
+
+  struct in_addr group = { 0 };
+  struct in_addr if_addr = { .s_addr = htonl(INADDR_ANY) };
+  if((inet_pton(AF_INET, addr, &group) != 1) || (iface && (inet_pton(AF_INET, iface, &if_addr) != 1))) {
+    return(EXIT_FAILURE);
+  }
+
+  rx->fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if(rx->fd < 0) {
+    return(EXIT_FAILURE);
+  }
+
+  // allow any number of listeners on the same host
+  int yes = 1;
+  setsockopt(rx->fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+  struct sockaddr_in local = {
+    .sin_family = AF_INET,
+    .sin_addr = { .s_addr = htonl(INADDR_ANY), },
+    .sin_port = htons(port),
+    .sin_zero = { 0 },
+  };
+  if(bind(rx->fd, (struct sockaddr*)&local, sizeof(local)) != 0) {
+    goto fail;
+  }
+
+  // broadcast just needs the bound socket, multicast needs to join the group
+  if(IN_MULTICAST(ntohl(group.s_addr))) {
+    struct ip_mreq mreq = { .imr_multiaddr = group, .imr_interface = if_addr };
+    if(setsockopt(rx->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+      goto fail;
+    }
+  }
+
+  return(EXIT_SUCCESS);
+
+fail:
+  (void)close(rx->fd);
+  rx->fd = -1;
+  return(EXIT_FAILURE);
+}
+
+int dc_powermon_mcast_recv(struct dc_powermon_mcast_t* rx, struct dc_powermon_sample_t* buff, size_t max, size_t* num) {
+  if(!rx || (rx->fd < 0) || !buff) {
+    return(EXIT_FAILURE);
+  }
+
+  struct {
+    struct dc_powermon_frame_hdr_t hdr;
+    char data[65536];
+  } frame;
+
+  // skip anything that isn't a sample or marker frame
+  ssize_t len = 0;
+  do {
+    len = recv(rx->fd, &frame, sizeof(frame), 0);
+    if(len < 0) {
+      return(EXIT_FAILURE);
+    }
+  } while(((size_t)len < sizeof(struct dc_powermon_frame_hdr_t)) || (frame.hdr.magic != DC_POWERMON_FRAME_MAGIC) ||
+          ((frame.hdr.type != DC_POWERMON_FRAME_SAMPLES) && (frame.hdr.type != DC_POWERMON_FRAME_MARKER)) ||
+          (frame.hdr.len + sizeof(struct dc_powermon_frame_hdr_t) != (size_t)len));
+
+  // sequence numbers are consecutive, anything missing was lost on the way
+  rx->gap = rx->started ? frame.hdr.seq - rx->next_seq : 0;
+  rx->lost += rx->gap;
+  rx->next_seq = frame.hdr.seq + 1;
+  rx->started = true;
+  rx->dropped = frame.hdr.dropped;
+  rx->frames++;
+
+  // markers come in frames of their own
+  rx->marked = (frame.hdr.type == DC_POWERMON_FRAME_MARKER);
+  if(rx->marked) {
+    if(frame.hdr.len < sizeof(struct dc_powermon_marker_t)) {
+      return(EXIT_FAILURE);
+    }
+    memcpy(&rx->marker, frame.data, sizeof(struct dc_powermon_marker_t));
+    rx->marker.label[DC_POWERMON_MARKER_LABEL_LEN - 1] = '\0';
+    if(num) { *num = 0; }
+    return(EXIT_SUCCESS);
+  }
+
+  size_t cnt = frame.hdr.len / sizeof(struct dc_powermon_sample_t);
+  if(cnt > max) {
+    cnt = max;
+  }
+  memcpy(buff, frame.data, cnt * sizeof(struct dc_powermon_sample_t));
+  if(num) { *num = cnt; }
+  return(EXIT_SUCCESS);
+}
+
+void dc_powermon_mcast_close(struct dc_powermon_mcast_t* rx) {
+  if(rx && (rx->fd >= 0)) {
+    (void)close(rx->fd);
+    rx->fd = -1;
+  }
+}
@@ -0,0 +1,133 @@
+#ifndef DC_POWERMON_PRIV_H
+#define DC_POWERMON_PRIV_H
+
+// internals shared between the client library sources, not part of the public API
+
+#include <stdbool.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "dc_powermon_client.h"
+
+// maximum number of resolved server addresses kept per handle
+#define DC_POWERMON_PRIV_ADDR_MAX         8
+
+// maximum number of distinct queries tracked for coalescing per handle
+#define DC_POWERMON_PRIV_COALESCE_MAX     16
+
+// timeout for internal queries that use the handle's own, which is read once the handle is locked
+#define DC_POWERMON_PRIV_TIMEOUT_DEV      INT_MIN
+
+typedef int (*cb_setup_t)(struct dc_powermon_t*, const struct timespec*);
+typedef void (*cb_close_t)(struct dc_powermon_t*);
+typedef int (*cb_read_t)(struct dc_powermon_t*, char*, size_t, const struct timespec*);
+typedef int (*cb_write_t)(struct dc_powermon_t*, const char*, size_t, const struct timespec*);
+
+// asynchronous request waiting for its response
+struct dc_powermon_async_req_t {
+  dc_powermon_cb_t cb;
+  void* user;
+};
+
+// response to a single query, a line of text (NUL-terminated, without CR/LF) or the payload of a binary record
+struct dc_powermon_rsp_t {
+  uint8_t type;
+  size_t len;
+  char data[512];
+};
+
+// result of a query shared between concurrent callers
+struct dc_powermon_coalesce_t {
+  char cmd[64];
+  struct dc_powermon_rsp_t rsp;
+  int ret;
+  bool valid;
+  bool in_flight;
+  struct timespec done;
+};
+
+// state of a single connection to the server
+// synchronous queries hold the lock, so a handle can be shared between threads
+struct dc_powermon_t {
+  pthread_mutex_t lock;
+  int fd;
+  bool persistent;
+  bool binary;
+  bool streaming;
+  int timeout_ms;
+
+  // transport, all of these return negative error codes on failure
+  // local transports answer queries within the client, so there is no socket to poll or stream from
+  cb_setup_t cb_setup;
+  cb_close_t cb_close;
+  cb_read_t cb_read;
+  cb_write_t cb_write;
+  bool local;
+
+  // server addresses of the socket transports, resolved once when the handle is opened
+  // connecting tries them in order, starting with the one that worked last time
+  char hostname[256];
+  int port;
+  struct sockaddr_storage server[DC_POWERMON_PRIV_ADDR_MAX];
+  socklen_t server_len[DC_POWERMON_PRIV_ADDR_MAX];
+  size_t server_num;
+  size_t server_idx;
+
+  // shared memory transport, responses are generated on write and wait here to be read
+  char shm_name[256];
+  struct dc_powermon_shm_reader_t shm;
+  char* local_rsp;
+  size_t local_rsp_len;
+  size_t local_rsp_pos;
+  size_t local_rsp_size;
+
+  // received data that was not consumed yet
+  char rx_buff[512];
+  size_t rx_len;
+
+  // asynchronous requests in flight, oldest first
+  struct dc_powermon_async_req_t async_reqs[DC_POWERMON_ASYNC_MAX];
+  size_t async_head;
+  size_t async_num;
+
+  // asynchronous requests not sent yet, and responses not complete yet
+  char* async_tx;
+  size_t async_tx_len;
+  size_t async_tx_size;
+  char* async_rx;
+  size_t async_rx_len;
+  size_t async_rx_size;
+
+  // completion callbacks running right now, a handle closed by one of them is freed once they all returned
+  int async_depth;
+  bool async_closing;
+
+  // coalescing of identical queries, negative window means disabled
+  pthread_mutex_t coalesce_lock;
+  pthread_cond_t coalesce_cond;
+  int coalesce_ms;
+  struct dc_powermon_coalesce_t coalesce[DC_POWERMON_PRIV_COALESCE_MAX];
+};
+
+int dc_powermon_priv_reserve(char** buff, size_t* size, size_t len);
+void dc_powermon_priv_deadline(struct timespec* deadline, int timeout_ms);
+int dc_powermon_priv_wait(int fd, short events, const struct timespec* deadline);
+int dc_powermon_priv_connect(struct dc_powermon_t* dev, const struct timespec* deadline);
+int dc_powermon_priv_set_binary(struct dc_powermon_t* dev, bool binary, const struct timespec* deadline);
+int dc_powermon_priv_format_meas(char* buff, const struct dc_powermon_meas_t* meas);
+int dc_powermon_priv_format_rsp(char* buff, size_t size, uint8_t type, const void* data, size_t len);
+void dc_powermon_priv_disconnect(struct dc_powermon_t* dev);
+void dc_powermon_priv_async_fail(struct dc_powermon_t* dev, int err);
+int dc_powermon_priv_async_finish(struct dc_powermon_t* dev, int ret);
+void dc_powermon_priv_async_free(struct dc_powermon_t* dev);
+
+// transports, these set up the handle for the given endpoint without connecting yet
+int dc_powermon_priv_transport_tcp(struct dc_powermon_t* dev, const char* hostname, int port);
+int dc_powermon_priv_transport_unix(struct dc_powermon_t* dev, const char* path);
+int dc_powermon_priv_transport_shm(struct dc_powermon_t* dev, const char* name);
+
+#endif
@@ -0,0 +1,190 @@
+#include "dc_powermon_client.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+int dc_powermon_shm_open(struct dc_powermon_shm_reader_t* rd, const char* name) {
+  if(!rd) {
+    return(EXIT_FAILURE);
+  }
+  memset(rd, 0, sizeof(struct dc_powermon_shm_reader_t));
+
+  char shm_name[256];
+  if(!name) { name = DC_POWERMON_SHM_NAME; }
+  snprintf(shm_name, sizeof(shm_name), "%s%s", (name[0] == '/') ? "" : "/", name);
+
+  int fd = shm_open(shm_name, O_RDONLY, 0);
+  if(fd < 0) {
+    return(EXIT_FAILURE);
+  }
+
+  struct stat st;
+  if((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(struct dc_powermon_shm_t))) {
+    (void)close(fd);
+    return(EXIT_FAILURE);
+  }
+
+  void* ptr = mmap(NULL, sizeof(struct dc_powermon_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+  (void)close(fd);
+  if(ptr == MAP_FAILED) {
+    return(EXIT_FAILURE);
+  }
+
+  const struct dc_powermon_shm_t* shm = ptr;
+  if((__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != DC_POWERMON_SHM_MAGIC) || (shm->version != DC_POWERMON_SHM_VERSION) ||
+     (shm->ring_size != DC_POWERMON_SHM_RING_SIZE) || (shm->sample_size != sizeof(struct dc_powermon_sample_t))) {
+    (void)munmap(ptr, sizeof(struct dc_powermon_shm_t));
+    return(EXIT_FAILURE);
+  }
+
+  // only samples published from now on will be read
+  rd->shm = shm;
+  rd->generation = shm->generation;
+  rd->pos = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+  rd->marker_pos = __atomic_load_n(&shm->marker_head, __ATOMIC_ACQUIRE);
+  return(EXIT_SUCCESS);
+}
+
+static bool shm_valid(const struct dc_powermon_shm_reader_t* rd) {
+  // the daemon that published the segment shut down, or it was replaced by a new one
+  return((__atomic_load_n(&rd->shm->magic, __ATOMIC_ACQUIRE) == DC_POWERMON_SHM_MAGIC) &&
+         (__atomic_load_n(&rd->shm->generation, __ATOMIC_RELAXED) == rd->generation));
+}
+
+bool dc_powermon_shm_alive(const struct dc_powermon_shm_reader_t* rd) {
+  if(!rd || !rd->shm || !shm_valid(rd)) {
+    return(false);
+  }
+
+  // a crashed daemon never got to clear the segment, EPERM means it runs as a different user
+  pid_t pid = __atomic_load_n(&rd->shm->pid, __ATOMIC_RELAXED);
+  return((pid > 0) && ((kill(pid, 0) == 0) || (errno == EPERM)));
+}
+
+size_t dc_powermon_shm_read(struct dc_powermon_shm_reader_t* rd, struct dc_powermon_sample_t* buff, size_t max) {
+  if(!rd || !rd->shm || !buff || !shm_valid(rd)) {
+    return(0);
+  }
+
+  // skip whatever was already overwritten
+  uint64_t head = __atomic_load_n(&rd->shm->head, __ATOMIC_ACQUIRE);
+  if(head - rd->pos > DC_POWERMON_SHM_RING_SIZE) {
+    rd->lost += head - rd->pos - DC_POWERMON_SHM_RING_SIZE;
+    rd->pos = head - DC_POWERMON_SHM_RING_SIZE;
+  }
+
+  size_t num = head - rd->pos;
+  if(num > max) {
+    num = max;
+  }
+  for(size_t i = 0; i < num; i++) {
+    memcpy(&buff[i], &rd->shm->ring[(rd->pos + i) & (DC_POWERMON_SHM_RING_SIZE - 1)], sizeof(struct dc_powermon_sample_t));
+  }
+
+  // the writer may have lapped us while copying, the slot it is writing to is invalid as well
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  uint64_t head_after = __atomic_load_n(&rd->shm->head, __ATOMIC_RELAXED);
+  uint64_t valid_from = (head_after >= DC_POWERMON_SHM_RING_SIZE) ? head_after - DC_POWERMON_SHM_RING_SIZE + 1 : 0;
+  size_t skip = 0;
+  if(valid_from > rd->pos) {
+    skip = (valid_from - rd->pos < num) ? valid_from - rd->pos : num;
+    memmove(buff, &buff[skip], (num - skip) * sizeof(struct dc_powermon_sample_t));
+    rd->lost += skip;
+  }
+
+  rd->pos += num;
+  return(num - skip);
+}
+
+size_t dc_powermon_shm_read_markers(struct dc_powermon_shm_reader_t* rd, struct dc_powermon_marker_t* buff, size_t max) {
+  if(!rd || !rd->shm || !buff || !shm_valid(rd)) {
+    return(0);
+  }
+
+  // same as for the samples, markers are just far less frequent
+  uint64_t head = __atomic_load_n(&rd->shm->marker_head, __ATOMIC_ACQUIRE);
+  if(head - rd->marker_pos > DC_POWERMON_SHM_MARKER_SIZE) {
+    rd->marker_pos = head - DC_POWERMON_SHM_MARKER_SIZE;
+  }
+
+  size_t num = head - rd->marker_pos;
+  if(num > max) {
+    num = max;
+  }
+  for(size_t i = 0; i < num; i++) {
+    memcpy(&buff[i], &rd->shm->markers[(rd->marker_pos + i) & (DC_POWERMON_SHM_MARKER_SIZE - 1)], sizeof(struct dc_powermon_marker_t));
+  }
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  uint64_t head_after = __atomic_load_n(&rd->shm->marker_head, __ATOMIC_RELAXED);
+  uint64_t valid_from = (head_after >= DC_POWERMON_SHM_MARKER_SIZE) ? head_after - DC_POWERMON_SHM_MARKER_SIZE + 1 : 0;
+  size_t skip = 0;
+  if(valid_from > rd->marker_pos) {
+    skip = (valid_from - rd->marker_pos < num) ? valid_from - rd->marker_pos : num;
+    memmove(buff, &buff[skip], (num - skip) * sizeof(struct dc_powermon_marker_t));
+  }
+
+  rd->marker_pos += num;
+  return(num - skip);
+}
+
+int dc_powermon_shm_read_stats(struct dc_powermon_shm_reader_t* rd, struct dc_powermon_shm_stats_t* stats) {
+  if(!rd || !rd->shm || !stats) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+
+  // retry until the writer was not updating the statistics while we copied them,
+  // a writer that never finishes the update is gone
+  for(int i = 0; i < DC_POWERMON_SHM_RETRY_MAX; i++) {
+    if(!shm_valid(rd)) {
+      break;
+    }
+    uint64_t seq_before = __atomic_load_n(&rd->shm->stats_seq, __ATOMIC_ACQUIRE);
+    memcpy(stats, &rd->shm->stats, sizeof(struct dc_powermon_shm_stats_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t seq_after = __atomic_load_n(&rd->shm->stats_seq, __ATOMIC_RELAXED);
+    if(!(seq_before & 1) && (seq_before == seq_after)) {
+      return(DC_POWERMON_ERR_NONE);
+    }
+    sched_yield();
+  }
+  return(DC_POWERMON_ERR_CLOSED);
+}
+
+int dc_powermon_shm_read_all(struct dc_powermon_shm_reader_t* rd, struct dc_powermon_meas_t* meas) {
+  if(!meas) {
+    return(DC_POWERMON_ERR_FAILED);
+  }
+
+  struct dc_powermon_shm_stats_t stats;
+  int ret = dc_powermon_shm_read_stats(rd, &stats);
+  if(ret) {
+    return(ret);
+  }
+
+  meas->timestamp.tv_sec = stats.timestamp / 1000000000ULL;
+  meas->timestamp.tv_nsec = stats.timestamp % 1000000000ULL;
+  meas->count = stats.count;
+  for(int i = 0; i < DC_POWERMON_NUM_CHANNELS; i++) {
+    meas->ch[i].avg = stats.avg[i];
+    meas->ch[i].min = stats.min[i];
+    meas->ch[i].max = stats.max[i];
+  }
+  return(DC_POWERMON_ERR_NONE);
+}
+
+void dc_powermon_shm_close(struct dc_powermon_shm_reader_t* rd) {
+  if(rd && rd->shm) {
+    (void)munmap((void*)rd->shm, sizeof(struct dc_powermon_shm_t));
+    rd->shm = NULL;
+  }
+}
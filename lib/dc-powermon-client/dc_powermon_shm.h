@@ -0,0 +1,64 @@
+#ifndef DC_POWERMON_SHM_H
+#define DC_POWERMON_SHM_H
+
+#include <stdint.h>
+
+#include "dc_powermon_cmds.h"
+
+// default name of the shared memory segment, ends up as /dev/shm/dc-powermon
+#define DC_POWERMON_SHM_NAME              "dc-powermon"
+
+#define DC_POWERMON_SHM_MAGIC             0x4D504344UL  // "DCPM"
+#define DC_POWERMON_SHM_VERSION           3
+
+// number of samples in the ring, must be a power of 2
+#define DC_POWERMON_SHM_RING_SIZE         65536
+
+// number of markers in the marker ring, must be a power of 2
+#define DC_POWERMON_SHM_MARKER_SIZE       256
+
+// how many times a reader retries the statistics before it assumes the writer died in the middle of an update
+#define DC_POWERMON_SHM_RETRY_MAX         1000
+
+// the segment has a single writer (the daemon) and any number of readers, none of which take locks
+// all fields marked as atomic must be accessed using __atomic builtins
+
+// latest statistics, same content as the MEAS:ALL? response
+struct dc_powermon_shm_stats_t {
+  uint64_t timestamp;
+  uint64_t count;
+  float avg[DC_POWERMON_SAMPLE_NUM_VALS];
+  float min[DC_POWERMON_SAMPLE_NUM_VALS];
+  float max[DC_POWERMON_SAMPLE_NUM_VALS];
+};
+
+struct dc_powermon_shm_t {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ring_size;
+  uint32_t sample_size;
+
+  // changes every time the daemon starts, a reader mapping a segment of an earlier one must open it again
+  uint64_t generation;
+
+  // process ID of the daemon, 0 once it shut down (atomic)
+  // the magic is cleared as well, a daemon that crashed leaves both behind
+  int32_t pid;
+  uint32_t reserved;
+
+  // seqlock protecting stats, odd while the writer is updating it (atomic)
+  uint64_t stats_seq;
+  struct dc_powermon_shm_stats_t stats;
+
+  // total number of samples written so far, sample n is at ring[n % ring_size] (atomic)
+  // a reader that copied samples must check head again, the writer may have overwritten them meanwhile
+  uint64_t head;
+  struct dc_powermon_sample_t ring[DC_POWERMON_SHM_RING_SIZE];
+
+  // total number of markers set so far, marker n is at markers[n % DC_POWERMON_SHM_MARKER_SIZE] (atomic)
+  // same rules as for the sample ring apply
+  uint64_t marker_head;
+  struct dc_powermon_marker_t markers[DC_POWERMON_SHM_MARKER_SIZE];
+};
+
+#endif
@@ -0,0 +1,336 @@
+#include "dc_powermon_client.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <pthread.h>
+
+#include "dc_powermon_priv.h"
+
+// how often the reader thread checks whether it should stop
+#define STREAM_POLL_MS            100
+
+struct dc_powermon_stream_t {
+  struct dc_powermon_t* dev;
+  uint8_t channels;
+  dc_powermon_stream_cb_t cb;
+  void* user;
+
+  pthread_t reader;
+  pthread_t dispatcher;
+  bool running;
+  bool dispatching;
+
+  // single-producer single-consumer ring, head is written by the reader thread only,
+  // tail by the consumer only (atomic)
+  struct dc_powermon_sample_t* ring;
+  uint64_t head;
+  uint64_t tail;
+
+  // markers, same rules as for the samples
+  struct dc_powermon_marker_t markers[DC_POWERMON_STREAM_MARKER_SIZE];
+  uint64_t marker_head;
+  uint64_t marker_tail;
+
+  // wakes up the dispatcher, only used for signalling, the ring itself is lock-free
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  // frame being reassembled from the byte stream
+  char frame[sizeof(struct dc_powermon_frame_hdr_t) + 65536];
+  size_t frame_len;
+
+  // counters (atomic)
+  struct dc_powermon_stream_stats_t stats;
+  bool started;
+  uint32_t next_seq;
+};
+
+static size_t stream_record_len(uint8_t channels) {
+  size_t len = sizeof(uint64_t);
+  for(int i = 0; i < DC_POWERMON_SAMPLE_NUM_VALS; i++) {
+    if(channels & (1UL << i)) {
+      len += sizeof(float);
+    }
+  }
+  return(len);
+}
+
+static void stream_count(struct dc_powermon_stream_t* st, const struct dc_powermon_frame_hdr_t* hdr) {
+  // samples and markers share the sequence numbers
+  if(st->started && (hdr->seq != st->next_seq)) {
+    __atomic_fetch_add(&st->stats.lost_frames, hdr->seq - st->next_seq, __ATOMIC_RELAXED);
+  }
+  st->started = true;
+  st->next_seq = hdr->seq + 1;
+  __atomic_store_n(&st->stats.server_dropped, hdr->dropped, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&st->stats.frames, 1, __ATOMIC_RELAXED);
+}
+
+static void stream_decode_markers(struct dc_powermon_stream_t* st, const struct dc_powermon_frame_hdr_t* hdr, const char* data) {
+  stream_count(st, hdr);
+
+  uint64_t head = __atomic_load_n(&st->marker_head, __ATOMIC_RELAXED);
+  uint64_t tail = __atomic_load_n(&st->marker_tail, __ATOMIC_ACQUIRE);
+  for(uint16_t n = 0; (n < hdr->num) && ((n + 1) * sizeof(struct dc_powermon_marker_t) <= hdr->len); n++) {
+    if(head - tail >= DC_POWERMON_STREAM_MARKER_SIZE) {
+      break;
+    }
+    memcpy(&st->markers[head & (DC_POWERMON_STREAM_MARKER_SIZE - 1)], &data[n * sizeof(struct dc_powermon_marker_t)], sizeof(struct dc_powermon_marker_t));
+    st->markers[head & (DC_POWERMON_STREAM_MARKER_SIZE - 1)].label[DC_POWERMON_MARKER_LABEL_LEN - 1] = '\0';
+    head++;
+  }
+  __atomic_fetch_add(&st->stats.markers, head - __atomic_load_n(&st->marker_head, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  __atomic_store_n(&st->marker_head, head, __ATOMIC_RELEASE);
+}
+
+static void stream_decode(struct dc_powermon_stream_t* st, const struct dc_powermon_frame_hdr_t* hdr, const char* data) {
+  stream_count(st, hdr);
+
+  size_t rec_len = stream_record_len(hdr->channels);
+  uint64_t head = __atomic_load_n(&st->head, __ATOMIC_RELAXED);
+  uint64_t tail = __atomic_load_n(&st->tail, __ATOMIC_ACQUIRE);
+  for(uint16_t n = 0; n < hdr->num; n++) {
+    if(head - tail >= DC_POWERMON_STREAM_RING_SIZE) {
+      // consumer is not keeping up
+      __atomic_fetch_add(&st->stats.client_dropped, hdr->num - n, __ATOMIC_RELAXED);
+      break;
+    }
+
+    // channels that were not requested are NaN
+    struct dc_powermon_sample_t* sample = &st->ring[head & (DC_POWERMON_STREAM_RING_SIZE - 1)];
+    const char* ptr = &data[n * rec_len];
+    memcpy(&sample->timestamp, ptr, sizeof(sample->timestamp));
+    ptr += sizeof(sample->timestamp);
+    for(int i = 0; i < DC_POWERMON_SAMPLE_NUM_VALS; i++) {
+      if(hdr->channels & (1UL << i)) {
+        memcpy(&sample->val[i], ptr, sizeof(float));
+        ptr += sizeof(float);
+      } else {
+        sample->val[i] = NAN;
+      }
+    }
+    head++;
+  }
+  __atomic_fetch_add(&st->stats.samples, head - __atomic_load_n(&st->head, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  __atomic_store_n(&st->head, head, __ATOMIC_RELEASE);
+}
+
+static void* stream_reader(void* arg) {
+  struct dc_powermon_stream_t* st = arg;
+  struct dc_powermon_t* dev = st->dev;
+
+  // whatever came in together with the response to STREAM:START
+  memcpy(st->frame, dev->rx_buff, dev->rx_len);
+  st->frame_len = dev->rx_len;
+  dev->rx_len = 0;
+
+  while(__atomic_load_n(&st->running, __ATOMIC_ACQUIRE)) {
+    // decode all complete frames
+    size_t pos = 0;
+    while(st->frame_len - pos >= sizeof(struct dc_powermon_frame_hdr_t)) {
+      struct dc_powermon_frame_hdr_t hdr;
+      memcpy(&hdr, &st->frame[pos], sizeof(hdr));
+      if(hdr.magic != DC_POWERMON_FRAME_MAGIC) {
+        // lost track of the frames, nothing to do but give up
+        __atomic_store_n(&st->stats.error, DC_POWERMON_ERR_RESPONSE, __ATOMIC_RELAXED);
+        goto exit;
+      }
+      if(st->frame_len - pos < sizeof(hdr) + hdr.len) {
+        break;
+      }
+      if(hdr.type == DC_POWERMON_FRAME_SAMPLES) {
+        stream_decode(st, &hdr, &st->frame[pos + sizeof(hdr)]);
+      } else if(hdr.type == DC_POWERMON_FRAME_MARKER) {
+        stream_decode_markers(st, &hdr, &st->frame[pos + sizeof(hdr)]);
+      }
+      pos += sizeof(hdr) + hdr.len;
+    }
+    st->frame_len -= pos;
+    memmove(st->frame, &st->frame[pos], st->frame_len);
+    if(pos) {
+      pthread_mutex_lock(&st->lock);
+      pthread_cond_signal(&st->cond);
+      pthread_mutex_unlock(&st->lock);
+    }
+
+    // wait for more, but not forever so that a stop request is noticed
+    struct timespec deadline;
+    dc_powermon_priv_deadline(&deadline, STREAM_POLL_MS);
+    int len = dev->cb_read(dev, &st->frame[st->frame_len], sizeof(st->frame) - st->frame_len, &deadline);
+    if(len == -DC_POWERMON_ERR_TIMEOUT) {
+      continue;
+    } else if(len <= 0) {
+      __atomic_store_n(&st->stats.error, DC_POWERMON_ERR_CLOSED, __ATOMIC_RELAXED);
+      break;
+    }
+    st->frame_len += len;
+  }
+
+exit:
+  // let the dispatcher deliver what is left and finish
+  __atomic_store_n(&st->running, false, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&st->lock);
+  pthread_cond_signal(&st->cond);
+  pthread_mutex_unlock(&st->lock);
+  return(NULL);
+}
+
+static size_t stream_deliver(struct dc_powermon_stream_t* st) {
+  // hand out contiguous blocks straight from the ring
+  uint64_t tail = __atomic_load_n(&st->tail, __ATOMIC_RELAXED);
+  uint64_t head = __atomic_load_n(&st->head, __ATOMIC_ACQUIRE);
+  size_t delivered = 0;
+  while(tail != head) {
+    size_t idx = tail & (DC_POWERMON_STREAM_RING_SIZE - 1);
+    size_t num = head - tail;
+    if(num > DC_POWERMON_STREAM_RING_SIZE - idx) {
+      num = DC_POWERMON_STREAM_RING_SIZE - idx;
+    }
+    st->cb(&st->ring[idx], num, st->user);
+    tail += num;
+    delivered += num;
+    __atomic_store_n(&st->tail, tail, __ATOMIC_RELEASE);
+  }
+  return(delivered);
+}
+
+static void* stream_dispatcher(void* arg) {
+  struct dc_powermon_stream_t* st = arg;
+  for(;;) {
+    bool running = __atomic_load_n(&st->running, __ATOMIC_ACQUIRE);
+    if(!stream_deliver(st)) {
+      if(!running) {
+        break;
+      }
+      pthread_mutex_lock(&st->lock);
+      if((__atomic_load_n(&st->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&st->tail, __ATOMIC_RELAXED)) && __atomic_load_n(&st->running, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&st->cond, &st->lock);
+      }
+      pthread_mutex_unlock(&st->lock);
+    }
+  }
+  return(NULL);
+}
+
+struct dc_powermon_stream_t* dc_powermon_stream_start(struct dc_powermon_t* dev, double rate, uint8_t channels, dc_powermon_stream_cb_t cb, void* user) {
+  // samples can only be pushed over a socket
+  if(!dev || !channels || dev->local) {
+    return(NULL);
+  }
+
+  struct dc_powermon_stream_t* st = calloc(1, sizeof(struct dc_powermon_stream_t));
+  if(!st) {
+    return(NULL);
+  }
+  st->ring = calloc(DC_POWERMON_STREAM_RING_SIZE, sizeof(struct dc_powermon_sample_t));
+  if(!st->ring) {
+    free(st);
+    return(NULL);
+  }
+  st->dev = dev;
+  st->channels = channels;
+  st->cb = cb;
+  st->user = user;
+  pthread_mutex_init(&st->lock, NULL);
+  pthread_cond_init(&st->cond, NULL);
+
+  // from now on, the connection belongs to the stream
+  // the response to starting it comes in the format of the connection, the stream sends its own frames after it
+  char cmd[128];
+  char rsp[64];
+  sprintf(cmd, DC_POWERMON_CMD_STREAM_START " %g,%u," DC_POWERMON_STREAM_FMT_BIN "," DC_POWERMON_STREAM_POLICY_DROP DC_POWERMON_CMD_LINEFEED, rate, channels);
+  if(dc_powermon_dev_query(dev, cmd, rsp, sizeof(rsp), dev->timeout_ms) || strcmp(rsp, "OK")) {
+    goto fail;
+  }
+
+  dev->streaming = true;
+  st->running = true;
+  if(pthread_create(&st->reader, NULL, stream_reader, st)) {
+    goto fail;
+  }
+  st->dispatching = (cb != NULL);
+  if(st->dispatching && pthread_create(&st->dispatcher, NULL, stream_dispatcher, st)) {
+    __atomic_store_n(&st->running, false, __ATOMIC_RELEASE);
+    pthread_join(st->reader, NULL);
+    goto fail;
+  }
+
+  return(st);
+
+fail:
+  dev->streaming = false;
+  dc_powermon_priv_disconnect(dev);
+  pthread_cond_destroy(&st->cond);
+  pthread_mutex_destroy(&st->lock);
+  free(st->ring);
+  free(st);
+  return(NULL);
+}
+
+size_t dc_powermon_stream_read(struct dc_powermon_stream_t* st, struct dc_powermon_sample_t* buff, size_t max) {
+  if(!st || st->dispatching || !buff) {
+    return(0);
+  }
+
+  uint64_t tail = __atomic_load_n(&st->tail, __ATOMIC_RELAXED);
+  uint64_t head = __atomic_load_n(&st->head, __ATOMIC_ACQUIRE);
+  size_t num = 0;
+  for(; (tail != head) && (num < max); tail++, num++) {
+    buff[num] = st->ring[tail & (DC_POWERMON_STREAM_RING_SIZE - 1)];
+  }
+  __atomic_store_n(&st->tail, tail, __ATOMIC_RELEASE);
+  return(num);
+}
+
+size_t dc_powermon_stream_read_markers(struct dc_powermon_stream_t* st, struct dc_powermon_marker_t* buff, size_t max) {
+  if(!st || !buff) {
+    return(0);
+  }
+
+  uint64_t tail = __atomic_load_n(&st->marker_tail, __ATOMIC_RELAXED);
+  uint64_t head = __atomic_load_n(&st->marker_head, __ATOMIC_ACQUIRE);
+  size_t num = 0;
+  for(; (tail != head) && (num < max); tail++, num++) {
+    buff[num] = st->markers[tail & (DC_POWERMON_STREAM_MARKER_SIZE - 1)];
+  }
+  __atomic_store_n(&st->marker_tail, tail, __ATOMIC_RELEASE);
+  return(num);
+}
+
+void dc_powermon_stream_get_stats(struct dc_powermon_stream_t* st, struct dc_powermon_stream_stats_t* stats) {
+  if(!st || !stats) {
+    return;
+  }
+
+  stats->frames = __atomic_load_n(&st->stats.frames, __ATOMIC_RELAXED);
+  stats->samples = __atomic_load_n(&st->stats.samples, __ATOMIC_RELAXED);
+  stats->lost_frames = __atomic_load_n(&st->stats.lost_frames, __ATOMIC_RELAXED);
+  stats->server_dropped = __atomic_load_n(&st->stats.server_dropped, __ATOMIC_RELAXED);
+  stats->client_dropped = __atomic_load_n(&st->stats.client_dropped, __ATOMIC_RELAXED);
+  stats->markers = __atomic_load_n(&st->stats.markers, __ATOMIC_RELAXED);
+  stats->error = __atomic_load_n(&st->stats.error, __ATOMIC_RELAXED);
+}
+
+void dc_powermon_stream_stop(struct dc_powermon_stream_t* st) {
+  if(!st) {
+    return;
+  }
+
+  __atomic_store_n(&st->running, false, __ATOMIC_RELEASE);
+  pthread_join(st->reader, NULL);
+  if(st->dispatching) {
+    pthread_join(st->dispatcher, NULL);
+  }
+
+  // the server ends the stream once the connection is gone
+  st->dev->streaming = false;
+  dc_powermon_priv_disconnect(st->dev);
+
+  pthread_cond_destroy(&st->cond);
+  pthread_mutex_destroy(&st->lock);
+  free(st->ring);
+  free(st);
+}
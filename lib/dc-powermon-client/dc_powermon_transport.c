@@ -0,0 +1,454 @@
+#include "dc_powermon_client.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "dc_powermon_cmds.h"
+#include "dc_powermon_priv.h"
+
+static int socket_connect(const struct sockaddr_storage* addr, socklen_t addr_len, const struct timespec* deadline) {
+  int fd = socket(addr->ss_family, SOCK_STREAM, 0);
+  if(fd < 0) {
+    return(-DC_POWERMON_ERR_CONNECT);
+  }
+
+  // the socket stays non-blocking, every read and write waits in poll instead
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  int ret = connect(fd, (const struct sockaddr*)addr, addr_len);
+  if(ret && (errno == EINPROGRESS)) {
+    ret = dc_powermon_priv_wait(fd, POLLOUT, deadline);
+    if(ret == DC_POWERMON_ERR_NONE) {
+      socklen_t len = sizeof(ret);
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &ret, &len);
+    }
+  }
+  if(ret) {
+    (void)close(fd);
+    return((ret == -DC_POWERMON_ERR_TIMEOUT) ? ret : -DC_POWERMON_ERR_CONNECT);
+  }
+
+  return(fd);
+}
+
+static int socket_setup(struct dc_powermon_t* dev, const struct timespec* deadline) {
+  // e.g. localhost may resolve to both ::1 and 127.0.0.1, while the server only listens on one of them
+  int ret = -DC_POWERMON_ERR_CONNECT;
+  for(size_t i = 0; i < dev->server_num; i++) {
+    size_t idx = (dev->server_idx + i) % dev->server_num;
+    ret = socket_connect(&dev->server[idx], dev->server_len[idx], deadline);
+    if(ret >= 0) {
+      dev->server_idx = idx;
+      return(ret);
+    } else if(ret == -DC_POWERMON_ERR_TIMEOUT) {
+      break;
+    }
+  }
+  return(ret);
+}
+
+static void socket_close(struct dc_powermon_t* dev) {
+  (void)close(dev->fd);
+}
+
+static int socket_read(struct dc_powermon_t* dev, char* buff, size_t size, const struct timespec* deadline) {
+  // returns as soon as anything arrived, 0 means the server closed the connection
+  for(;;) {
+    int ret = dc_powermon_priv_wait(dev->fd, POLLIN, deadline);
+    if(ret) {
+      return(ret);
+    }
+
+    ssize_t len = recv(dev->fd, buff, size, MSG_DONTWAIT);
+    if(len >= 0) {
+      return(len);
+    } else if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+      return(-DC_POWERMON_ERR_CLOSED);
+    }
+  }
+}
+
+static int socket_write(struct dc_powermon_t* dev, const char* data, size_t len, const struct timespec* deadline) {
+  while(len > 0) {
+    ssize_t sent = send(dev->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(sent < 0) {
+      if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        int ret = dc_powermon_priv_wait(dev->fd, POLLOUT, deadline);
+        if(ret) {
+          return(ret);
+        }
+        continue;
+      } else if(errno == EINTR) {
+        continue;
+      }
+      return(-DC_POWERMON_ERR_CLOSED);
+    }
+    data += sent;
+    len -= sent;
+  }
+  return(DC_POWERMON_ERR_NONE);
+}
+
+int dc_powermon_priv_transport_tcp(struct dc_powermon_t* dev, const char* hostname, int port) {
+  if(!hostname || (strlen(hostname) >= sizeof(dev->hostname))) {
+    return(EXIT_FAILURE);
+  }
+
+  char port_str[16];
+  sprintf(port_str, "%d", port);
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+  struct addrinfo* res = NULL;
+  if(getaddrinfo(hostname, port_str, &hints, &res) != 0) {
+    return(EXIT_FAILURE);
+  }
+
+  dev->server_num = 0;
+  dev->server_idx = 0;
+  for(struct addrinfo* ai = res; ai && (dev->server_num < DC_POWERMON_PRIV_ADDR_MAX); ai = ai->ai_next) {
+    memcpy(&dev->server[dev->server_num], ai->ai_addr, ai->ai_addrlen);
+    dev->server_len[dev->server_num] = ai->ai_addrlen;
+    dev->server_num++;
+  }
+  freeaddrinfo(res);
+  if(!dev->server_num) {
+    return(EXIT_FAILURE);
+  }
+  strcpy(dev->hostname, hostname);
+  dev->port = port;
+
+  dev->cb_setup = socket_setup;
+  dev->cb_close = socket_close;
+  dev->cb_read = socket_read;
+  dev->cb_write = socket_write;
+  dev->local = false;
+  return(EXIT_SUCCESS);
+}
+
+int dc_powermon_priv_transport_unix(struct dc_powermon_t* dev, const char* path) {
+  struct sockaddr_un* addr = (struct sockaddr_un*)&dev->server[0];
+  if(!path || !path[0] || (strlen(path) >= sizeof(addr->sun_path))) {
+    return(EXIT_FAILURE);
+  }
+
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  dev->server_len[0] = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+  dev->server_num = 1;
+  dev->server_idx = 0;
+
+  // the daemon speaks the same protocol on Unix sockets, only the address is different
+  dev->cb_setup = socket_setup;
+  dev->cb_close = socket_close;
+  dev->cb_read = socket_read;
+  dev->cb_write = socket_write;
+  dev->local = false;
+  return(EXIT_SUCCESS);
+}
+
+static int shm_setup(struct dc_powermon_t* dev, const struct timespec* deadline) {
+  (void)deadline;
+
+  // the descriptor is kept open only to stand in for a connection
+  char shm_name[sizeof(dev->shm_name) + 1];
+  snprintf(shm_name, sizeof(shm_name), "%s%s", (dev->shm_name[0] == '/') ? "" : "/", dev->shm_name);
+  int fd = shm_open(shm_name, O_RDONLY, 0);
+  if(fd < 0) {
+    return(-DC_POWERMON_ERR_CONNECT);
+  }
+
+  if(dc_powermon_shm_open(&dev->shm, dev->shm_name)) {
+    (void)close(fd);
+    return(-DC_POWERMON_ERR_CONNECT);
+  }
+
+  // a daemon that crashed leaves a segment behind which looks valid, but will never be updated
+  if(!dc_powermon_shm_alive(&dev->shm)) {
+    dc_powermon_shm_close(&dev->shm);
+    (void)close(fd);
+    return(-DC_POWERMON_ERR_CONNECT);
+  }
+
+  dev->local_rsp_len = 0;
+  dev->local_rsp_pos = 0;
+  return(fd);
+}
+
+static void shm_close(struct dc_powermon_t* dev) {
+  dc_powermon_shm_close(&dev->shm);
+  (void)close(dev->fd);
+}
+
+static int shm_append(struct dc_powermon_t* dev, const void* data, size_t len) {
+  if(dc_powermon_priv_reserve(&dev->local_rsp, &dev->local_rsp_size, dev->local_rsp_len + len) < 0) {
+    return(-DC_POWERMON_ERR_FAILED);
+  }
+  memcpy(&dev->local_rsp[dev->local_rsp_len], data, len);
+  dev->local_rsp_len += len;
+  return(DC_POWERMON_ERR_NONE);
+}
+
+static int shm_append_header(struct dc_powermon_t* dev, uint8_t type, size_t len) {
+  // record header or IEEE 488.2 definite-length block header, same as the daemon sends
+  char header[32];
+  int header_len = 0;
+  if(dev->binary) {
+    struct dc_powermon_rec_hdr_t hdr = { .magic = DC_POWERMON_REC_MAGIC, .type = type, .reserved = 0, .len = len };
+    memcpy(header, &hdr, sizeof(hdr));
+    header_len = sizeof(hdr);
+  } else {
+    char len_str[24];
+    int len_digits = sprintf(len_str, "%zu", len);
+    header_len = sprintf(header, "#%d%s", len_digits, len_str);
+  }
+  return(shm_append(dev, header, header_len));
+}
+
+static int shm_append_record(struct dc_powermon_t* dev, uint8_t type, const void* data, size_t len) {
+  int ret = shm_append_header(dev, type, len);
+  if(ret == DC_POWERMON_ERR_NONE) {
+    ret = shm_append(dev, data, len);
+  }
+  if((ret == DC_POWERMON_ERR_NONE) && !dev->binary) {
+    ret = shm_append(dev, DC_POWERMON_RSP_LINEFEED, strlen(DC_POWERMON_RSP_LINEFEED));
+  }
+  return(ret);
+}
+
+static int shm_append_text(struct dc_powermon_t* dev, const char* text) {
+  if(dev->binary) {
+    return(shm_append_record(dev, DC_POWERMON_REC_TEXT, text, strlen(text)));
+  }
+  int ret = shm_append(dev, text, strlen(text));
+  if(ret == DC_POWERMON_ERR_NONE) {
+    ret = shm_append(dev, DC_POWERMON_RSP_LINEFEED, strlen(DC_POWERMON_RSP_LINEFEED));
+  }
+  return(ret);
+}
+
+static int shm_append_value(struct dc_powermon_t* dev, float val, const char* unit) {
+  if(dev->binary) {
+    return(shm_append_record(dev, DC_POWERMON_REC_VALUE, &val, sizeof(val)));
+  }
+  char buff[64];
+  sprintf(buff, "%.2f%s", (double)val, unit);
+  return(shm_append_text(dev, buff));
+}
+
+static void shm_range(const char* args, uint64_t* start, uint64_t* stop) {
+  // optional time range, stop of 0 means up to the latest entry
+  *start = 0;
+  *stop = 0;
+  if(args) {
+    char* ptr = NULL;
+    *start = strtoull(args, &ptr, 10);
+    if(*ptr == ',') {
+      *stop = strtoull(ptr + 1, NULL, 10);
+    }
+  }
+}
+
+static int shm_fetch(struct dc_powermon_t* dev, const char* args) {
+  uint64_t start, stop;
+  shm_range(args, &start, &stop);
+
+  // the samples are copied straight into the response buffer, behind the space the header may need
+  // the buffer is kept between queries, so this only allocates for the first one
+  const size_t header_max = 32;
+  size_t data_pos = dev->local_rsp_len + header_max;
+  if(dc_powermon_priv_reserve(&dev->local_rsp, &dev->local_rsp_size, data_pos + DC_POWERMON_SHM_RING_SIZE * sizeof(struct dc_powermon_sample_t)) < 0) {
+    return(-DC_POWERMON_ERR_FAILED);
+  }
+
+  // take everything the ring holds, the reader drops whatever gets overwritten while copying
+  struct dc_powermon_sample_t* samples = (struct dc_powermon_sample_t*)&dev->local_rsp[data_pos];
+  struct dc_powermon_shm_reader_t rd = dev->shm;
+  uint64_t head = __atomic_load_n(&rd.shm->head, __ATOMIC_ACQUIRE);
+  rd.pos = (head > DC_POWERMON_SHM_RING_SIZE) ? head - DC_POWERMON_SHM_RING_SIZE : 0;
+  size_t num = dc_powermon_shm_read(&rd, samples, DC_POWERMON_SHM_RING_SIZE);
+
+  // samples are in time order, so the range is contiguous
+  size_t first = 0;
+  while((first < num) && (samples[first].timestamp < start)) {
+    first++;
+  }
+  size_t last = first;
+  while((last < num) && (!stop || (samples[last].timestamp <= stop))) {
+    last++;
+  }
+
+  // then the range is moved right behind the header
+  size_t len = (last - first) * sizeof(struct dc_powermon_sample_t);
+  int ret = shm_append_header(dev, DC_POWERMON_REC_SAMPLES, len);
+  if(ret) {
+    return(ret);
+  }
+  memmove(&dev->local_rsp[dev->local_rsp_len], &dev->local_rsp[data_pos + first * sizeof(struct dc_powermon_sample_t)], len);
+  dev->local_rsp_len += len;
+  if(!dev->binary) {
+    ret = shm_append(dev, DC_POWERMON_RSP_LINEFEED, strlen(DC_POWERMON_RSP_LINEFEED));
+  }
+  return(ret);
+}
+
+static int shm_fetch_markers(struct dc_powermon_t* dev, const char* args) {
+  uint64_t start, stop;
+  shm_range(args, &start, &stop);
+
+  struct dc_powermon_marker_t markers[DC_POWERMON_SHM_MARKER_SIZE];
+  struct dc_powermon_shm_reader_t rd = dev->shm;
+  uint64_t head = __atomic_load_n(&rd.shm->marker_head, __ATOMIC_ACQUIRE);
+  rd.marker_pos = (head > DC_POWERMON_SHM_MARKER_SIZE) ? head - DC_POWERMON_SHM_MARKER_SIZE : 0;
+  size_t num = dc_powermon_shm_read_markers(&rd, markers, DC_POWERMON_SHM_MARKER_SIZE);
+
+  size_t first = 0;
+  while((first < num) && (markers[first].timestamp < start)) {
+    first++;
+  }
+  size_t last = first;
+  while((last < num) && (!stop || (markers[last].timestamp <= stop))) {
+    last++;
+  }
+  return(shm_append_record(dev, DC_POWERMON_REC_MARKERS, &markers[first], (last - first) * sizeof(struct dc_powermon_marker_t)));
+}
+
+static int shm_exec(struct dc_powermon_t* dev, const char* cmd) {
+  // a daemon that went away since the connection check has nothing left to answer with
+  struct dc_powermon_shm_stats_t stats;
+  int ret = dc_powermon_shm_read_stats(&dev->shm, &stats);
+  if(ret) {
+    return(-ret);
+  }
+
+  // responses are formatted exactly like the daemon does, so the parsing is shared
+  char buff[128];
+  if(strstr(cmd, DC_POWERMON_CMD_READ_POWER) == cmd) {
+    return(shm_append_value(dev, stats.avg[DC_POWERMON_CH_P_SHUNT], "mW"));
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_READ_CURRENT) == cmd) {
+    return(shm_append_value(dev, stats.avg[DC_POWERMON_CH_I_SHUNT], "mA"));
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_READ_V_BUS) == cmd) {
+    return(shm_append_value(dev, stats.avg[DC_POWERMON_CH_V_BUS], "V"));
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_READ_V_SHUNT) == cmd) {
+    return(shm_append_value(dev, stats.avg[DC_POWERMON_CH_V_SHUNT], "mV"));
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_MEAS_ALL) == cmd) {
+    // the segment holds the same values as the binary record
+    struct dc_powermon_rec_meas_t rec;
+    rec.timestamp = stats.timestamp;
+    rec.count = stats.count;
+    memcpy(rec.avg, stats.avg, sizeof(rec.avg));
+    memcpy(rec.min, stats.min, sizeof(rec.min));
+    memcpy(rec.max, stats.max, sizeof(rec.max));
+    if(dev->binary) {
+      return(shm_append_record(dev, DC_POWERMON_REC_MEAS, &rec, sizeof(rec)));
+    }
+    char text[512];
+    dc_powermon_priv_format_rsp(text, sizeof(text), DC_POWERMON_REC_MEAS, &rec, sizeof(rec));
+    return(shm_append_text(dev, text));
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_FETCH_DATA) == cmd) {
+    const char* args = cmd + strlen(DC_POWERMON_CMD_FETCH_DATA);
+    return(shm_fetch(dev, (*args == ' ') ? args + 1 : NULL));
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_FETCH_MARK) == cmd) {
+    const char* args = cmd + strlen(DC_POWERMON_CMD_FETCH_MARK);
+    return(shm_fetch_markers(dev, (*args == ' ') ? args + 1 : NULL));
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_TIME) == cmd) {
+    // the daemon runs on this machine, so these are the same clocks
+    struct timespec raw, real;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &raw);
+    clock_gettime(CLOCK_REALTIME, &real);
+    sprintf(buff, "%lld.%09ld,%lld.%09ld", (long long)raw.tv_sec, raw.tv_nsec, (long long)real.tv_sec, real.tv_nsec);
+    return(shm_append_text(dev, buff));
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_ID) == cmd) {
+    return(shm_append_text(dev, "radiolib-org,DCpowerMon,shm"));
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_KEEP_ON) == cmd) {
+    return(shm_append_text(dev, "OK"));
+
+  } else if((strcmp(cmd, DC_POWERMON_CMD_FORM_BIN) == 0) || (strcmp(cmd, DC_POWERMON_CMD_FORM_ASC) == 0)) {
+    // the reply is ASCII in either format, the client switches once it read it
+    return(shm_append(dev, DC_POWERMON_RSP_OK, strlen(DC_POWERMON_RSP_OK)));
+
+  }
+
+  // anything that would change the daemon's state needs the control interface
+  return(-DC_POWERMON_ERR_FAILED);
+}
+
+static int shm_read(struct dc_powermon_t* dev, char* buff, size_t size, const struct timespec* deadline) {
+  (void)deadline;
+
+  // responses are generated on write, so waiting for more would never end
+  size_t len = dev->local_rsp_len - dev->local_rsp_pos;
+  if(len == 0) {
+    return(-DC_POWERMON_ERR_RESPONSE);
+  }
+  if(len > size) {
+    len = size;
+  }
+  memcpy(buff, &dev->local_rsp[dev->local_rsp_pos], len);
+  dev->local_rsp_pos += len;
+  if(dev->local_rsp_pos == dev->local_rsp_len) {
+    dev->local_rsp_pos = 0;
+    dev->local_rsp_len = 0;
+  }
+  return(len);
+}
+
+static int shm_write(struct dc_powermon_t* dev, const char* data, size_t len, const struct timespec* deadline) {
+  (void)deadline;
+
+  // execute every complete line
+  while(len > 0) {
+    const char* end = memchr(data, '\n', len);
+    size_t line_len = end ? (size_t)(end - data + 1) : len;
+
+    char cmd[256];
+    if(line_len >= sizeof(cmd)) {
+      return(-DC_POWERMON_ERR_FAILED);
+    }
+    memcpy(cmd, data, line_len);
+    cmd[line_len] = '\0';
+    int ret = shm_exec(dev, cmd);
+    if(ret) {
+      return(ret);
+    }
+
+    data += line_len;
+    len -= line_len;
+  }
+  return(DC_POWERMON_ERR_NONE);
+}
+
+int dc_powermon_priv_transport_shm(struct dc_powermon_t* dev, const char* name) {
+  if(!name || !name[0]) {
+    name = DC_POWERMON_SHM_NAME;
+  }
+  if(strlen(name) >= sizeof(dev->shm_name)) {
+    return(EXIT_FAILURE);
+  }
+  strcpy(dev->shm_name, name);
+
+  dev->cb_setup = shm_setup;
+  dev->cb_close = shm_close;
+  dev->cb_read = shm_read;
+  dev->cb_write = shm_write;
+  dev->local = true;
+  return(EXIT_SUCCESS);
+}
@@ -1,6 +1,9 @@
 #include "ina219.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <linux/i2c.h>
@@ -36,7 +39,42 @@ static int fd = -1;
 // calcualte current LSB value
 static double current_lsb = 1;
 
+// simulated sensor, used when the device path is INA219_SIM_PATH
+static bool sim = false;
+
+static int ina219_sim_register(uint8_t addr) {
+  // emulate the duration of an I2C register read at 400 kHz
+  struct timespec delay = { .tv_sec = 0, .tv_nsec = 60000 };
+  nanosleep(&delay, NULL);
+
+  // 10 mA idle current with a 120 mA burst for 50 ms every 500 ms,
+  // roughly what a radio module looks like while transmitting
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double t = (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+  double current = 10.0 + ((fmod(t, 0.5) < 0.05) ? 120.0 : 0.0);
+  current += 0.5 * sin(t * 2.0 * M_PI * 50.0);
+  double v_bus = 3.3 - current * 0.0005;
+
+  switch(addr) {
+    case INA219_REG_SHUNT_VOLTAGE:
+      // assumes the default 100 mOhm shunt, LSB is 10 uV
+      return((uint16_t)(int16_t)(current * 0.1 / 0.01));
+    case INA219_REG_BUS_VOLTAGE:
+      // LSB is 4 mV, value is left-aligned by 3 bits
+      return((uint16_t)(v_bus / 0.004) << 3);
+    case INA219_REG_CURRENT:
+      return((uint16_t)(int16_t)(current / (current_lsb * 1000.0)));
+    default:
+      return(0);
+  }
+}
+
 static int ina219_read_register(uint8_t addr) {
+  if(sim) {
+    return(ina219_sim_register(addr));
+  }
+
   // write address to access
   if(write(fd, &addr, sizeof(addr)) != sizeof(addr)) {
     return(-1);
@@ -52,6 +90,10 @@ static int ina219_read_register(uint8_t addr) {
 }
 
 static int ina219_write_register(uint8_t addr, uint16_t val) {
+  if(sim) {
+    return(0);
+  }
+
   uint8_t buff[] = { addr, val >> 8, val & 0xff };
   if(write(fd, buff, sizeof(buff)) != sizeof(buff)) {
     return(-1);
@@ -60,6 +102,11 @@ static int ina219_write_register(uint8_t addr, uint16_t val) {
 }
 
 int ina219_begin(const char* i2c_path, int addr) {
+  if(strcmp(i2c_path, INA219_SIM_PATH) == 0) {
+    sim = true;
+    return(0);
+  }
+
   fd = open(i2c_path, O_RDWR);
   if(fd < 0) {
     return(-1);
@@ -74,6 +121,10 @@ int ina219_begin(const char* i2c_path, int addr) {
 }
 
 int ina219_end() {
+  if(sim) {
+    return(0);
+  }
+
   return(close(fd));
 }
 
@@ -4,6 +4,9 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// pass this as the device path to ina219_begin to use a simulated sensor
+#define INA219_SIM_PATH   "sim"
+
 enum ina219_pga_gain_e {
   INA219_PGA_GAIN_1 = 0,
   INA219_PGA_GAIN_DIV_2,
@@ -1,65 +1,377 @@
+#define _GNU_SOURCE
 #include "socket.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <errno.h>
-#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 int socket_setup(int port) {
-  // set up the ingest socket
-  int control_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-  struct sockaddr_in srv_addr = {
-    .sin_family = AF_INET,
-    .sin_addr = { .s_addr = htonl(INADDR_ANY), },
-    .sin_port = htons(port),
-    .sin_zero = { 0 },
-  };
-
-  if(bind(control_socket_fd, (struct sockaddr*)&srv_addr, sizeof(srv_addr)) != 0) {
+  // set up the ingest socket, dual-stack so that both IPv4 and IPv6 clients can connect
+  struct sockaddr_storage srv_addr = { 0 };
+  socklen_t srv_addr_len = sizeof(struct sockaddr_in6);
+  int control_socket_fd = socket(AF_INET6, SOCK_STREAM, 0);
+  if(control_socket_fd >= 0) {
+    int no = 0;
+    setsockopt(control_socket_fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(int));
+    struct sockaddr_in6* addr = (struct sockaddr_in6*)&srv_addr;
+    addr->sin6_family = AF_INET6;
+    addr->sin6_addr = in6addr_any;
+    addr->sin6_port = htons(port);
+
+  } else {
+    // kernel without IPv6
+    control_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in* addr = (struct sockaddr_in*)&srv_addr;
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_ANY);
+    addr->sin_port = htons(port);
+    srv_addr_len = sizeof(struct sockaddr_in);
+
+  }
+
+  // must be set before binding, otherwise a restart fails while old connections linger
+  int yes = 1;
+  setsockopt(control_socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+  if(bind(control_socket_fd, (struct sockaddr*)&srv_addr, srv_addr_len) != 0) {
     fprintf(stderr, "Failed to bind command ingest socket, errno %d.\n", errno);
+    close(control_socket_fd);
     return(-1);
   }
   
   // make the socket non-blocking
   fcntl(control_socket_fd, F_SETFL, fcntl(control_socket_fd, F_GETFL, 0) | O_NONBLOCK);
-  
-  int yes = 1;
-  setsockopt(control_socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
 
   // start listening
   if(listen(control_socket_fd, 10) != 0) {
     fprintf(stderr, "Failed to start listening for commands, errno %d.\n", errno);
+    close(control_socket_fd);
+    return(-1);
+  }
+
+  return(control_socket_fd);
+}
+
+static bool socket_unix_stale(const struct sockaddr_un* addr, int type) {
+  // only a socket file that nobody listens on anymore may be replaced
+  struct stat st;
+  if(lstat(addr->sun_path, &st) != 0) {
+    if(errno == ENOENT) {
+      return(true);
+    }
+    fprintf(stderr, "Failed to check %s, errno %d.\n", addr->sun_path, errno);
+    return(false);
+  }
+  if(!S_ISSOCK(st.st_mode)) {
+    fprintf(stderr, "%s exists and is not a socket.\n", addr->sun_path);
+    return(false);
+  }
+
+  int probe_fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+  if(probe_fd < 0) {
+    fprintf(stderr, "Failed to create probe socket, errno %d.\n", errno);
+    return(false);
+  }
+  int ret = connect(probe_fd, (const struct sockaddr*)addr, sizeof(struct sockaddr_un));
+  int err = errno;
+  close(probe_fd);
+  if(ret == 0) {
+    fprintf(stderr, "%s is in use by another process.\n", addr->sun_path);
+    return(false);
+  }
+  if(err != ECONNREFUSED) {
+    fprintf(stderr, "Failed to probe %s, errno %d.\n", addr->sun_path, err);
+    return(false);
+  }
+  if((unlink(addr->sun_path) != 0) && (errno != ENOENT)) {
+    fprintf(stderr, "Failed to remove stale socket %s, errno %d.\n", addr->sun_path, errno);
+    return(false);
+  }
+  return(true);
+}
+
+int socket_setup_unix(const char* path, bool seqpacket, int mode, ino_t* ino) {
+  struct sockaddr_un srv_addr = { .sun_family = AF_UNIX };
+  if(strlen(path) >= sizeof(srv_addr.sun_path)) {
+    fprintf(stderr, "Control socket path %s is too long.\n", path);
+    return(-1);
+  }
+  strcpy(srv_addr.sun_path, path);
+
+  int type = seqpacket ? SOCK_SEQPACKET : SOCK_STREAM;
+  int control_socket_fd = socket(AF_UNIX, type, 0);
+  if(control_socket_fd < 0) {
+    fprintf(stderr, "Failed to create command ingest socket, errno %d.\n", errno);
+    return(-1);
+  }
+
+  // a socket file left behind by a previous run is removed, anything else is left alone
+  if(!socket_unix_stale(&srv_addr, type)) {
+    close(control_socket_fd);
+    return(-1);
+  }
+
+  // access control is done by the file permissions, which must be in place before anyone can connect
+  mode_t mask = umask(~mode & 0777);
+  int ret = bind(control_socket_fd, (struct sockaddr*)&srv_addr, sizeof(srv_addr));
+  int err = errno;
+  umask(mask);
+  if(ret != 0) {
+    fprintf(stderr, "Failed to bind command ingest socket %s, errno %d.\n", path, err);
+    close(control_socket_fd);
+    return(-1);
+  }
+
+  struct stat st;
+  if((chmod(path, mode) != 0) || (lstat(path, &st) != 0) || ((st.st_mode & 0777) != (mode_t)(mode & 0777))) {
+    fprintf(stderr, "Failed to set permissions of %s, errno %d.\n", path, errno);
+    (void)unlink(path);
+    close(control_socket_fd);
+    return(-1);
+  }
+  *ino = st.st_ino;
+
+  fcntl(control_socket_fd, F_SETFL, fcntl(control_socket_fd, F_GETFL, 0) | O_NONBLOCK);
+
+  if(listen(control_socket_fd, 10) != 0) {
+    fprintf(stderr, "Failed to start listening for commands, errno %d.\n", errno);
+    (void)unlink(path);
+    close(control_socket_fd);
     return(-1);
   }
 
   return(control_socket_fd);
 }
 
-int socket_read(int listen_fd, char* cmd_buff) {
-  int cmd_conn_fd = accept(listen_fd, (struct sockaddr*)NULL, NULL);
+void socket_remove_unix(const char* path, ino_t ino) {
+  // the file may have been replaced since, only the one created by socket_setup_unix is removed
+  struct stat st;
+  if((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode) && (st.st_ino == ino)) {
+    (void)unlink(path);
+  }
+}
+
+// open control connections
+static struct socket_conn_t* conns = NULL;
+static int conns_max = 0;
+static const char* conns_refused = NULL;
+
+int socket_set_max(int max, const char* refused) {
+  struct socket_conn_t* buff = calloc(max, sizeof(struct socket_conn_t));
+  if(!buff) {
+    fprintf(stderr, "Failed to allocate control connections, errno %d.\n", errno);
+    return(-1);
+  }
+  free(conns);
+  conns = buff;
+  conns_max = max;
+  conns_refused = refused;
+  return(0);
+}
+
+int socket_accept(int listen_fd) {
+  // non-blocking, so that a client that does not read its responses can't stall the caller
+  int cmd_conn_fd = accept4(listen_fd, (struct sockaddr*)NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
   if(cmd_conn_fd < 0) {
     // nothing to do
     return(0);
   }
 
-  int len = 0;
-  do {
-    ioctl(cmd_conn_fd, FIONREAD, &len);
-  } while(!len);
-  len = recv(cmd_conn_fd, cmd_buff, len, 0);
-  if(len < 0) {
-    // something went wrong
+  if(!conns && (socket_set_max(SOCKET_MAX_CONNS, NULL) < 0)) {
+    close(cmd_conn_fd);
     return(0);
   }
-  cmd_buff[len] = '\0';
 
-  return(cmd_conn_fd);
+  for(int i = 0; i < conns_max; i++) {
+    if(!conns[i].active) {
+      // the queue is kept for the next connection in this slot
+      struct socket_conn_t* conn = &conns[i];
+      char* queue = conn->queue;
+      size_t queue_size = conn->queue_size;
+      memset(conn, 0, sizeof(struct socket_conn_t));
+      conn->queue = queue;
+      conn->queue_size = queue_size;
+      conn->active = true;
+      conn->fd = cmd_conn_fd;
+      return(cmd_conn_fd);
+    }
+  }
+
+  // tell the client why, instead of just hanging up on it
+  fprintf(stderr, "Too many control connections, rejecting.\n");
+  if(conns_refused) {
+    (void)send(cmd_conn_fd, conns_refused, strlen(conns_refused), MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+  close(cmd_conn_fd);
+  return(0);
+}
+
+static void socket_flush(struct socket_conn_t* conn) {
+  // send as much as the socket takes without blocking
+  while(conn->queue_pos < conn->queue_len) {
+    ssize_t sent = send(conn->fd, &conn->queue[conn->queue_pos], conn->queue_len - conn->queue_pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(sent < 0) {
+      if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+        return;
+      }
+      conn->failed = true;
+      break;
+    }
+    conn->queue_pos += sent;
+  }
+  conn->queue_pos = 0;
+  conn->queue_len = 0;
+}
+
+struct socket_conn_t* socket_read(char* cmd_buff, size_t size) {
+  // go round-robin, so that one busy connection does not starve the others
+  static int next = 0;
+  for(int n = 0; n < conns_max; n++) {
+    struct socket_conn_t* conn = &conns[(next + n) % conns_max];
+    if(!conn->active) {
+      continue;
+    }
+
+    // the previous response has to be out before the next command is processed
+    socket_flush(conn);
+    if(conn->failed || (conn->closing && !conn->queue_len)) {
+      socket_close(conn);
+      continue;
+    }
+    if(conn->queue_len || conn->closing) {
+      continue;
+    }
+
+    // only read more when there is no complete command buffered yet
+    char* end = memchr(conn->buff, '\n', conn->len);
+    if(!end) {
+      ssize_t len = recv(conn->fd, &conn->buff[conn->len], sizeof(conn->buff) - conn->len, MSG_DONTWAIT);
+      if((len == 0) || ((len < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))) {
+        // peer is gone
+        socket_close(conn);
+        continue;
+      }
+      if(len > 0) {
+        conn->len += len;
+      }
+
+      end = memchr(conn->buff, '\n', conn->len);
+      if(!end) {
+        if(conn->len == sizeof(conn->buff)) {
+          fprintf(stderr, "Control command too long, closing connection.\n");
+          socket_close(conn);
+        }
+        continue;
+      }
+    }
+
+    // hand over a single command, including its linefeed
+    size_t cmd_len = end - conn->buff + 1;
+    if(cmd_len >= size) {
+      cmd_len = size - 1;
+    }
+    memcpy(cmd_buff, conn->buff, cmd_len);
+    cmd_buff[cmd_len] = '\0';
+    conn->len -= end - conn->buff + 1;
+    memmove(conn->buff, end + 1, conn->len);
+    next = (next + n + 1) % conns_max;
+    return(conn);
+  }
+
+  return(NULL);
 }
 
-void socket_write(int socket, char* data) {
-  send(socket, data, strlen(data), 0);
+int socket_poll_fds(struct pollfd* fds, int max) {
+  // all open connections, for callers that sleep until there is something to do
+  // while a response is queued, only the socket becoming writable matters
+  int num = 0;
+  for(int i = 0; (i < conns_max) && (num < max); i++) {
+    if(conns[i].active) {
+      fds[num].fd = conns[i].fd;
+      fds[num].events = conns[i].queue_len ? POLLOUT : POLLIN;
+      fds[num].revents = 0;
+      num++;
+    }
+  }
+  return(num);
+}
+
+void socket_close(struct socket_conn_t* conn) {
+  close(conn->fd);
+  conn->active = false;
+  conn->queue_pos = 0;
+  conn->queue_len = 0;
+}
+
+void socket_done(struct socket_conn_t* conn) {
+  // a one-shot connection stays open until its response is out
+  if(conn->failed || !conn->queue_len) {
+    socket_close(conn);
+    return;
+  }
+  conn->closing = true;
+}
+
+void socket_release(struct socket_conn_t* conn) {
+  conn->active = false;
+}
+
+void socket_write(struct socket_conn_t* conn, const char* data) {
+  (void)socket_write_buff(conn, data, strlen(data));
+}
+
+int socket_write_buff(struct socket_conn_t* conn, const void* data, size_t len) {
+  if(conn->failed) {
+    return(-1);
+  }
+
+  // straight to the socket if nothing is queued, so that small responses are not copied
+  const char* ptr = data;
+  while(!conn->queue_len && (len > 0)) {
+    ssize_t sent = send(conn->fd, ptr, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(sent < 0) {
+      if(errno == EINTR) {
+        continue;
+      } else if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        break;
+      }
+      conn->failed = true;
+      return(-1);
+    }
+    ptr += sent;
+    len -= sent;
+  }
+  if(!len) {
+    return(0);
+  }
+
+  // the rest waits for the client to read
+  if(conn->queue_len + len > SOCKET_QUEUE_MAX) {
+    fprintf(stderr, "Control connection not reading its responses, closing it.\n");
+    conn->failed = true;
+    return(-1);
+  }
+  if(conn->queue_len + len > conn->queue_size) {
+    size_t new_size = conn->queue_size ? conn->queue_size : 4096;
+    while(new_size < conn->queue_len + len) {
+      new_size *= 2;
+    }
+    char* queue = realloc(conn->queue, new_size);
+    if(!queue) {
+      conn->failed = true;
+      return(-1);
+    }
+    conn->queue = queue;
+    conn->queue_size = new_size;
+  }
+  memcpy(&conn->queue[conn->queue_len], ptr, len);
+  conn->queue_len += len;
+  return(0);
 }
@@ -1,8 +1,52 @@
 #ifndef POWERMON_SOCKET_H
 #define POWERMON_SOCKET_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <poll.h>
+#include <sys/types.h>
+
+// default maximum number of simultaneously open control connections, see socket_set_max
+#define SOCKET_MAX_CONNS          64
+
+// maximum amount of response data queued for a single connection, e.g. a full FETCH:DATA? block
+#define SOCKET_QUEUE_MAX          (2 * 1024 * 1024)
+
+// control connection, buffers incoming data until a complete command was received
+// connections are non-blocking, whatever the socket does not take right away is queued and sent by socket_read
+struct socket_conn_t {
+  bool active;
+  int fd;
+  bool keep;            // keep the connection open after the command was processed
+  unsigned int flags;   // free for use by the command handler
+  char buff[256];
+  size_t len;
+
+  // responses waiting to be sent, no further commands are read from the connection until they are out
+  char* queue;
+  size_t queue_size;
+  size_t queue_pos;
+  size_t queue_len;
+  bool closing;         // close once the queue is empty
+  bool failed;          // sending failed, the connection is closed as soon as possible
+};
+
+// limit the number of open connections, before the first one is accepted
+// connections over the limit get the refused message (if any) and are closed right away
+int socket_set_max(int max, const char* refused);
 int socket_setup(int port);
-int socket_read(int listen_fd, char* cmd_buff);
-void socket_write(int socket, char* data);
+// a file already at path is only replaced when it is a socket nobody listens on
+// the inode of the created socket file is stored in ino, for socket_remove_unix
+int socket_setup_unix(const char* path, bool seqpacket, int mode, ino_t* ino);
+void socket_remove_unix(const char* path, ino_t ino);
+int socket_accept(int listen_fd);
+struct socket_conn_t* socket_read(char* cmd_buff, size_t size);
+int socket_poll_fds(struct pollfd* fds, int max);
+void socket_close(struct socket_conn_t* conn);
+void socket_done(struct socket_conn_t* conn);
+void socket_release(struct socket_conn_t* conn);
+void socket_write(struct socket_conn_t* conn, const char* data);
+int socket_write_buff(struct socket_conn_t* conn, const void* data, size_t len);
 
 #endif
@@ -0,0 +1,254 @@
+#include "console.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+// dashboard size in terminal cells
+#define DASH_ROWS                 10
+#define DASH_COLS                 80
+
+// average current in each sparkline column, the ring holds the column being filled and the complete ones
+#define SPARK_SLOTS               (CONSOLE_SPARK_COLUMNS + 1)
+
+struct spark_t {
+  uint64_t column;
+  double sum;
+  unsigned long count;
+};
+
+// latest statistics and the sparkline, guarded by a seqlock so that the acquisition loop never waits for the renderer
+static struct console_stats_t snapshot = { 0 };
+static struct spark_t spark[SPARK_SLOTS] = { 0 };
+static unsigned long snapshot_seq = 0;
+
+static pthread_t renderer;
+static bool running = false;
+static bool dashboard = false;
+static bool stopping = false;
+
+// what is on the screen and what should be, each cell is a single UTF-8 character
+static char shown[DASH_ROWS][DASH_COLS][4];
+static char frame[DASH_ROWS][DASH_COLS][4];
+
+static void console_read(struct console_stats_t* stats, struct spark_t* columns) {
+  // retry until the writer was not updating the statistics while we copied them
+  unsigned long seq_before = 0;
+  unsigned long seq_after = 0;
+  do {
+    seq_before = __atomic_load_n(&snapshot_seq, __ATOMIC_ACQUIRE);
+    memcpy(stats, &snapshot, sizeof(struct console_stats_t));
+    memcpy(columns, spark, sizeof(spark));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    seq_after = __atomic_load_n(&snapshot_seq, __ATOMIC_RELAXED);
+  } while((seq_before & 1) || (seq_before != seq_after));
+}
+
+static void line_render(const struct console_stats_t* stats) {
+  fprintf(stdout, " %6.2f V  %6.2f mV %7.2f mA  %7.2f mW\r", stats->avg[0], stats->avg[1], stats->avg[2], stats->avg[3]);
+  fflush(stdout);
+}
+
+static void dash_print(int row, int col, const char* fmt, ...) {
+  char buff[DASH_COLS + 1];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buff, sizeof(buff), fmt, args);
+  va_end(args);
+
+  for(int i = 0; buff[i] && (col + i < DASH_COLS); i++) {
+    frame[row][col + i][0] = buff[i];
+    frame[row][col + i][1] = '\0';
+  }
+}
+
+static void dash_flush(void) {
+  // only cells that changed are written, so an idle dashboard costs almost nothing even over a slow link
+  char out[DASH_ROWS * DASH_COLS * 16];
+  size_t len = 0;
+  for(int row = 0; row < DASH_ROWS; row++) {
+    bool positioned = false;
+    for(int col = 0; col < DASH_COLS; col++) {
+      if(strcmp(frame[row][col], shown[row][col]) == 0) {
+        positioned = false;
+        continue;
+      }
+      if(!positioned) {
+        len += sprintf(&out[len], "\x1b[%d;%dH", row + 1, col + 1);
+        positioned = true;
+      }
+      len += sprintf(&out[len], "%s", frame[row][col]);
+      memcpy(shown[row][col], frame[row][col], sizeof(shown[row][col]));
+    }
+  }
+
+  if(len) {
+    fwrite(out, 1, len, stdout);
+    fflush(stdout);
+  }
+}
+
+static void dash_render(const struct console_stats_t* stats, const struct spark_t* columns, double rate) {
+  static const char* names[] = { "V_bus", "V_shunt", "I_shunt", "P_shunt" };
+  static const char* units[] = { "V", "mV", "mA", "mW" };
+  static const char* levels[] = { "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█" };
+
+  for(int row = 0; row < DASH_ROWS; row++) {
+    for(int col = 0; col < DASH_COLS; col++) {
+      strcpy(frame[row][col], " ");
+    }
+  }
+
+  dash_print(0, 0, "dc-powermon  %9.1f samples/s  overruns %lu  dropped %lu stream, %lu mcast",
+    rate, stats->overruns, stats->stream_dropped, stats->mcast_dropped);
+  dash_print(2, 0, "%-9s %13s %13s %13s %13s", "", "avg", "min", "max", "std");
+  for(int i = 0; i < DC_POWERMON_SAMPLE_NUM_VALS; i++) {
+    dash_print(3 + i, 0, "%-9s %10.3f %-2s %10.3f %-2s %10.3f %-2s %10.3f %-2s", names[i],
+      stats->avg[i], units[i], stats->min[i], units[i], stats->max[i], units[i], stats->std[i], units[i]);
+  }
+
+  // complete columns only, the current one is still being filled
+  uint64_t current = stats->timestamp / CONSOLE_SPARK_COLUMN_NS;
+  double vals[CONSOLE_SPARK_COLUMNS];
+  bool valid[CONSOLE_SPARK_COLUMNS];
+  double lo = 0, hi = 0;
+  bool any = false;
+  for(int i = 0; i < CONSOLE_SPARK_COLUMNS; i++) {
+    uint64_t column = current - CONSOLE_SPARK_COLUMNS + i;
+    const struct spark_t* sp = &columns[column % SPARK_SLOTS];
+    valid[i] = (sp->column == column) && sp->count;
+    if(!valid[i]) {
+      continue;
+    }
+    vals[i] = sp->sum / (double)sp->count;
+    if(!any || (vals[i] < lo)) { lo = vals[i]; }
+    if(!any || (vals[i] > hi)) { hi = vals[i]; }
+    any = true;
+  }
+
+  dash_print(8, 0, "I_shunt, last %llu s: %.2f to %.2f mA", (unsigned long long)(CONSOLE_SPARK_COLUMNS * CONSOLE_SPARK_COLUMN_NS / 1000000000ULL), lo, hi);
+  for(int i = 0; i < CONSOLE_SPARK_COLUMNS; i++) {
+    if(valid[i]) {
+      int level = (hi > lo) ? (int)((vals[i] - lo) / (hi - lo) * 7.0 + 0.5) : 0;
+      strcpy(frame[9][i], levels[level]);
+    }
+  }
+
+  dash_flush();
+}
+
+static void* console_render(void* arg) {
+  (void)arg;
+  if(dashboard) {
+    // clear the screen and hide the cursor, from now on only changes are drawn
+    fprintf(stdout, "\x1b[2J\x1b[?25l");
+    memset(shown, 0, sizeof(shown));
+  } else {
+    fprintf(stdout, "   V_bus     V_shunt    I_shunt     P_shunt\n");
+  }
+
+  // redraw at fixed times, however fast the samples come in
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  struct timespec rate_time = next;
+  unsigned long rate_count = 0;
+  unsigned long last_count = 0;
+  double rate = 0;
+  while(!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    next.tv_nsec += 1000000000L / CONSOLE_RATE_HZ;
+    if(next.tv_nsec >= 1000000000L) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+
+    struct console_stats_t stats;
+    struct spark_t columns[SPARK_SLOTS];
+    console_read(&stats, columns);
+
+    // sample rate is measured over a second, so that it does not flicker
+    // the count starts over when the statistics are reset, so the rate is then skipped for one second
+    double elapsed = (double)(next.tv_sec - rate_time.tv_sec) + (double)(next.tv_nsec - rate_time.tv_nsec) / 1e9;
+    if(elapsed >= 1.0) {
+      if(stats.count >= rate_count) {
+        rate = (double)(stats.count - rate_count) / elapsed;
+      }
+      rate_count = stats.count;
+      rate_time = next;
+    }
+
+    if(stats.count == last_count) {
+      continue;
+    }
+    last_count = stats.count;
+
+    if(dashboard) {
+      dash_render(&stats, columns, rate);
+    } else {
+      line_render(&stats);
+    }
+  }
+
+  return(NULL);
+}
+
+int console_setup(bool full) {
+  dashboard = full;
+
+  // SIGINT and SIGTERM must interrupt the acquisition loop, so the renderer inherits them blocked
+  sigset_t block, prev;
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &block, &prev);
+  int ret = pthread_create(&renderer, NULL, console_render, NULL);
+  pthread_sigmask(SIG_SETMASK, &prev, NULL);
+  if(ret != 0) {
+    fprintf(stderr, "Failed to start console renderer, error %d.\n", ret);
+    return(-1);
+  }
+  running = true;
+  return(0);
+}
+
+void console_end(void) {
+  if(!running) {
+    return;
+  }
+
+  // the renderer may be in the middle of a frame, which has to be out before the terminal is restored
+  __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+  pthread_join(renderer, NULL);
+  running = false;
+  if(dashboard) {
+    // move below the dashboard and show the cursor again
+    fprintf(stdout, "\x1b[%d;1H\x1b[?25h", DASH_ROWS + 1);
+  } else {
+    fprintf(stdout, "\n");
+  }
+  fflush(stdout);
+}
+
+void console_update(const struct console_stats_t* stats) {
+  unsigned long seq = __atomic_load_n(&snapshot_seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&snapshot_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&snapshot, stats, sizeof(struct console_stats_t));
+
+  // columns are aligned to sample timestamps, so the renderer knows which ones are complete
+  uint64_t column = stats->timestamp / CONSOLE_SPARK_COLUMN_NS;
+  struct spark_t* sp = &spark[column % SPARK_SLOTS];
+  if(sp->column != column) {
+    sp->column = column;
+    sp->sum = 0;
+    sp->count = 0;
+  }
+  sp->sum += stats->current;
+  sp->count++;
+
+  __atomic_store_n(&snapshot_seq, seq + 2, __ATOMIC_RELEASE);
+}
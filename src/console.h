@@ -0,0 +1,44 @@
+#ifndef POWERMON_CONSOLE_H
+#define POWERMON_CONSOLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dc-powermon-client/dc_powermon_cmds.h"
+
+// how often the console is redrawn
+#define CONSOLE_RATE_HZ           10
+
+// the dashboard shows the current over the last CONSOLE_SPARK_COLUMNS * CONSOLE_SPARK_COLUMN_NS
+#define CONSOLE_SPARK_COLUMNS     60
+#define CONSOLE_SPARK_COLUMN_NS   500000000ULL
+
+// what the console shows, published by the acquisition loop after every sample
+// values are in the order of struct dc_powermon_sample_t
+struct console_stats_t {
+  unsigned long count;
+  double avg[DC_POWERMON_SAMPLE_NUM_VALS];
+  double min[DC_POWERMON_SAMPLE_NUM_VALS];
+  double max[DC_POWERMON_SAMPLE_NUM_VALS];
+  double std[DC_POWERMON_SAMPLE_NUM_VALS];
+
+  // the latest sample, for the sparkline
+  uint64_t timestamp;
+  double current;
+
+  unsigned long overruns;
+  unsigned long stream_dropped;
+  unsigned long mcast_dropped;
+};
+
+// start the renderer thread, either a single line or a full-screen dashboard
+// it inherits the scheduling of the caller, so this must be called before switching to real-time priority
+int console_setup(bool dashboard);
+
+// stop the renderer and leave the terminal in a usable state
+void console_end(void);
+
+// publish new statistics, never blocks
+void console_update(const struct console_stats_t* stats);
+
+#endif
@@ -1,13 +1,29 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <math.h>
+#include <sched.h>
+#include <pthread.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
 
 #include "argtable3/argtable3.h"
 #include "ina219/ina219.h"
 #include "socket/socket.h"
+#include "stream.h"
+#include "mcast.h"
+#include "shm.h"
+#include "perf.h"
+#include "console.h"
+#include "energy.h"
+#include "state.h"
 #include "dc-powermon-client/dc_powermon_cmds.h"
 
 #ifndef GITREV
@@ -19,18 +35,45 @@
 
 // some default configuration values
 #define INA219_ADDR_DEFAULT       0x40  // default for unmodified RadioHAT Rev. C
+#define I2C_DEVICE_DEFAULT        "/dev/i2c-1"
 #define WINDOW_DEFAULT            128
 #define CONTROL_DEFAULT           41123
+#define CONTROL_MODE_DEFAULT      "0660"
+#define CONTROL_CONNS_MAX         4096
+#define RATE_MAX                  100000.0
+#define RT_PRIORITY_DEFAULT       50
+#define RT_STACK_PREFAULT         (256 * 1024)
+
+// control endpoints, either a TCP port or a Unix socket path with one of these prefixes
+#define CONTROL_MAX               4
+#define CONTROL_PREFIX_UNIX       "unix:"
+#define CONTROL_PREFIX_SEQPACKET  "seqpacket:"
+
+// per-connection flags kept in socket_conn_t
+#define CONN_FLAG_BIN             (1UL << 0)  // responses in binary format
 
 // buffer for commands from socket
 static char socket_buff[256] = { 0 };
 
 static struct conf_t {
   int window;
-  int socket_fd;
+  double rate;
+  bool quiet;
+  bool sensor_open;
+  int socket_fds[CONTROL_MAX];
+  const char* socket_paths[CONTROL_MAX];
+  ino_t socket_inos[CONTROL_MAX];
+  int num_sockets;
+  int max_conns;
 } conf = {
   .window = WINDOW_DEFAULT,
-  .socket_fd = -1,
+  .rate = 0,
+  .quiet = false,
+  .sensor_open = false,
+  .socket_fds = { -1, -1, -1, -1 },
+  .socket_paths = { NULL },
+  .num_sockets = 0,
+  .max_conns = SOCKET_MAX_CONNS,
 };
 
 enum sample_type_e {
@@ -42,8 +85,8 @@ enum sample_type_e {
 };
 
 // structure to save data about a single sample
-// TODO add timestamp
 struct sample_t {
+  uint64_t timestamp;   // CLOCK_MONOTONIC_RAW in ns, taken in the middle of the bus transactions
   double val[NUM_SAMPLE_TYPES];
 };
 
@@ -52,10 +95,16 @@ static struct stats_t {
   struct sample_t min;
   struct sample_t max;
   struct sample_t avg;
+  struct sample_t std;
+  unsigned long count;
+  struct timespec timestamp;
 } stats = {
   .min = { .val = {  99,  99,  9999,  9999 } },
   .max = { .val = { -99, -99, -9999, -9999 } },
   .avg = { .val = {   0,   0,     0,     0 } },
+  .std = { .val = {   0,   0,     0,     0 } },
+  .count = 0,
+  .timestamp = { 0 },
 };
 
 // averaging window
@@ -63,29 +112,203 @@ static struct stats_t {
 static struct sample_t avg_window[BUFF_SIZE] = { 0 };
 static struct sample_t* avg_ptr = avg_window;
 
+// history of raw samples, timestamps are stored as the difference to the previous sample
+// the full timestamp of the first sample in each block is kept as well, so any sample can be restored quickly
+// deltas too long for nanoseconds are stored in microseconds, marked by HISTORY_DELTA_US
+#define HISTORY_SIZE          65536
+#define HISTORY_BLOCK         64
+#define HISTORY_DELTA_US      (1UL << 31)
+struct __attribute__((packed)) history_t {
+  uint32_t delta;
+  float val[NUM_SAMPLE_TYPES];
+};
+static struct history_t history[HISTORY_SIZE] = { 0 };
+static uint64_t history_base[HISTORY_SIZE / HISTORY_BLOCK] = { 0 };
+static size_t history_head = 0;
+static size_t history_len = 0;
+
+// the latest sample in the format it is sent in
+static struct dc_powermon_sample_t history_latest = { 0 };
+
+// markers set by clients, in the order they were received
+#define MARKER_SIZE           1024
+static struct dc_powermon_marker_t markers[MARKER_SIZE] = { 0 };
+static struct energy_point_t marker_energy[MARKER_SIZE] = { 0 };
+static size_t marker_head = 0;
+static size_t marker_len = 0;
+
+// set by SIGINT, SIGTERM and SYS:EXIT, the acquisition loop then returns and the daemon shuts down from main
+static volatile sig_atomic_t exiting = 0;
+
+// paced acquisition, samples that were due while the previous one was still being processed are skipped
+static int acq_timer_fd = -1;
+static unsigned long acq_overruns = 0;
+static uint64_t acq_period = 0;
+static uint64_t acq_deadline = 0;
+
+// how late paced samples were taken relative to their deadline, in ns
+static struct jitter_t {
+  unsigned long count;
+  uint64_t min;
+  uint64_t max;
+  double mean;
+  double m2;            // sum of squared differences from the mean
+} jitter = {
+  .count = 0,
+  .min = UINT64_MAX,
+  .max = 0,
+  .mean = 0,
+  .m2 = 0,
+};
+
+// CLOCK_REALTIME - CLOCK_MONOTONIC_RAW in ns, the raw clock is not adjusted by NTP so this is measured again every second
+#define CLOCK_SYNC_NS         1000000000ULL
+static int64_t clock_offset = 0;
+static uint64_t clock_sync_next = 0;
+
+// session carried over across restarts with --state, checkpoints are handed to the state writer this often
+static struct state_t session = { 0 };
+static uint64_t state_next = 0;
+
 // argtable arguments
 static struct args_t {
+  struct arg_str* device;
   struct arg_int* addr;
   struct arg_dbl* max_current;
   struct arg_dbl* r_shunt;
   struct arg_int* window;
-  struct arg_int* control;
+  struct arg_dbl* rate;
+  struct arg_lit* realtime;
+  struct arg_int* rt_priority;
+  struct arg_int* rt_cpu;
+  struct arg_int* perf;
+  struct arg_lit* quiet;
+  struct arg_lit* dashboard;
+  struct arg_str* control;
+  struct arg_str* control_mode;
+  struct arg_int* control_max;
+  struct arg_str* mcast;
+  struct arg_str* mcast_if;
+  struct arg_lit* shm;
+  struct arg_str* shm_name;
+  struct arg_str* state;
   struct arg_lit* help;
   struct arg_end* end;
 } args;
 
+static void jitter_update(uint64_t late) {
+  if(late < jitter.min) { jitter.min = late; }
+  if(late > jitter.max) { jitter.max = late; }
+
+  // Welford's online algorithm, stable even after billions of samples
+  jitter.count++;
+  double delta = (double)late - jitter.mean;
+  jitter.mean += delta / (double)jitter.count;
+  jitter.m2 += delta * ((double)late - jitter.mean);
+}
+
+static int jitter_format(char* buff) {
+  // count, then min, avg, max and standard deviation in us
+  if(!jitter.count) {
+    return(sprintf(buff, "0,0,0,0,0"));
+  }
+  double std = (jitter.count > 1) ? sqrt(jitter.m2 / (double)(jitter.count - 1)) : 0;
+  return(sprintf(buff, "%lu,%.3f,%.3f,%.3f,%.3f", jitter.count, (double)jitter.min / 1e3, jitter.mean / 1e3, (double)jitter.max / 1e3, std / 1e3));
+}
+
+static void state_fill(struct state_t* state) {
+  state->count = stats.count;
+  for(int i = 0; i < NUM_SAMPLE_TYPES; i++) {
+    state->min[i] = stats.min.val[i];
+    state->max[i] = stats.max.val[i];
+  }
+  energy_save(&state->energy);
+}
+
+static void state_restore(const struct state_t* state) {
+  // the averaging window is not restored, it fills up again within a fraction of a second
+  stats.count = state->count;
+  for(int i = 0; i < NUM_SAMPLE_TYPES; i++) {
+    stats.min.val[i] = state->min[i];
+    stats.max.val[i] = state->max[i];
+  }
+  energy_restore(&state->energy);
+}
+
+static void state_checkpoint(uint64_t now) {
+  if(now < state_next) {
+    return;
+  }
+
+  state_fill(&session);
+  state_update(&session);
+  state_next = now + STATE_CHECKPOINT_NS;
+}
+
 static void sighandler(int signal) {
+  // only the flag is set here, the acquisition loop stops and the shutdown runs outside of signal context
   (void)signal;
-  exit(EXIT_SUCCESS);
+  exiting = 1;
 }
 
 static void exithandler(void) {
-  fprintf(stdout, "\n");
-  fflush(stdout);
-  int ret = ina219_end();
-  if(ret < 0) {
-    fprintf(stderr, "ERROR: Failed to close I2C port\n");
+  if(!conf.quiet) {
+    console_end();
+  }
+  // the exit handler also runs when the sensor could not be opened in the first place
+  if(conf.sensor_open) {
+    int ret = ina219_end();
+    if(ret < 0) {
+      fprintf(stderr, "ERROR: Failed to close I2C port\n");
+    }
   }
+
+  shm_end();
+  mcast_end();
+
+  // the final checkpoint is complete, unlike the periodic ones it includes everything up to the last sample
+  state_fill(&session);
+  state_end(&session);
+
+  if(acq_timer_fd >= 0) {
+    char buff[128];
+    jitter_format(buff);
+    fprintf(stdout, "Acquisition overruns: %lu\n", acq_overruns);
+    fprintf(stdout, "Acquisition jitter (samples,min,avg,max,std in us): %s\n", buff);
+    close(acq_timer_fd);
+  }
+
+  // Unix sockets leave their files behind
+  for(int i = 0; i < conf.num_sockets; i++) {
+    if(conf.socket_paths[i]) {
+      socket_remove_unix(conf.socket_paths[i], conf.socket_inos[i]);
+    }
+  }
+}
+
+static uint64_t clock_get_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static void clock_measure(uint64_t* raw, uint64_t* real) {
+  // the raw clock is read on both sides of the wall clock, to cancel out the time it takes
+  uint64_t before = clock_get_ns(CLOCK_MONOTONIC_RAW);
+  *real = clock_get_ns(CLOCK_REALTIME);
+  uint64_t after = clock_get_ns(CLOCK_MONOTONIC_RAW);
+  *raw = before + (after - before) / 2;
+}
+
+static void clock_sync(uint64_t now) {
+  if(now < clock_sync_next) {
+    return;
+  }
+
+  uint64_t raw, real;
+  clock_measure(&raw, &real);
+  clock_offset = (int64_t)(real - raw);
+  clock_sync_next = now + CLOCK_SYNC_NS;
 }
 
 static void stats_reset() {
@@ -95,6 +318,11 @@ static void stats_reset() {
   stats.max.val[I_SHUNT] = -9999; stats.max.val[P_SHUNT] = -9999;
   stats.avg.val[V_BUS] = 0; stats.avg.val[V_SHUNT] = 0;
   stats.avg.val[I_SHUNT] = 0; stats.avg.val[P_SHUNT] = 0;
+  stats.std.val[V_BUS] = 0; stats.std.val[V_SHUNT] = 0;
+  stats.std.val[I_SHUNT] = 0; stats.std.val[P_SHUNT] = 0;
+  stats.count = 0;
+  stats.timestamp.tv_sec = 0;
+  stats.timestamp.tv_nsec = 0;
 }
 
 static void stats_update(struct sample_t* sample) {
@@ -104,83 +332,682 @@ static void stats_update(struct sample_t* sample) {
     // update statistics
     if(sample->val[i] < stats.min.val[i]) {
       stats.min.val[i] = sample->val[i];
-    } else if(sample->val[i] > stats.max.val[i]) {
-      stats.max.val[i] = stats.min.val[i];
+    }
+    if(sample->val[i] > stats.max.val[i]) {
+      stats.max.val[i] = sample->val[i];
     }
     
-    // calculate the average
-    stats.avg.val[i] = 0;
+    // calculate the average and standard deviation over the window by Welford's algorithm, same as the jitter
+    // the sum of squares minus the squared mean cancels out when the values hardly change, and can even go negative
+    double mean = 0;
+    double m2 = 0;
     for(int j = 0; j < conf.window; j++) {
-      stats.avg.val[i] += (double)avg_window[j].val[i];
+      double delta = avg_window[j].val[i] - mean;
+      mean += delta / (double)(j + 1);
+      m2 += delta * (avg_window[j].val[i] - mean);
     }
-    stats.avg.val[i] /= conf.window;
+    stats.avg.val[i] = mean;
+    stats.std.val[i] = sqrt(m2 / conf.window);
   }
 
   avg_ptr++;
-  if((avg_ptr - avg_window) > conf.window) {
+  if((avg_ptr - avg_window) >= conf.window) {
     avg_ptr = avg_window;
   }
+
+  // statistics are timestamped in wall-clock time
+  stats.count++;
+  uint64_t real = sample->timestamp + clock_offset;
+  stats.timestamp.tv_sec = real / 1000000000ULL;
+  stats.timestamp.tv_nsec = real % 1000000000ULL;
+}
+
+static void stats_publish() {
+  struct dc_powermon_shm_stats_t shm_stats_buff = {
+    .timestamp = (uint64_t)stats.timestamp.tv_sec * 1000000000ULL + (uint64_t)stats.timestamp.tv_nsec,
+    .count = stats.count,
+  };
+  for(int i = 0; i < NUM_SAMPLE_TYPES; i++) {
+    shm_stats_buff.avg[i] = (float)stats.avg.val[i];
+    shm_stats_buff.min[i] = (float)stats.min.val[i];
+    shm_stats_buff.max[i] = (float)stats.max.val[i];
+  }
+  shm_stats(&shm_stats_buff);
+}
+
+static void stats_console(struct sample_t* sample) {
+  struct console_stats_t console_stats = {
+    .count = stats.count,
+    .timestamp = sample->timestamp,
+    .current = sample->val[I_SHUNT],
+    .overruns = acq_overruns,
+    .stream_dropped = stream_dropped(),
+    .mcast_dropped = mcast_dropped(),
+  };
+  for(int i = 0; i < NUM_SAMPLE_TYPES; i++) {
+    console_stats.avg[i] = stats.avg.val[i];
+    console_stats.min[i] = stats.min.val[i];
+    console_stats.max[i] = stats.max.val[i];
+    console_stats.std[i] = stats.std.val[i];
+  }
+  console_update(&console_stats);
+}
+
+static int stats_format_all(char* buff) {
+  // everything comes from the same stats state, so the snapshot is consistent
+  int len = sprintf(buff, "%lld.%09ld,%lu", (long long)stats.timestamp.tv_sec, stats.timestamp.tv_nsec, stats.count);
+  for(int i = 0; i < NUM_SAMPLE_TYPES; i++) {
+    len += sprintf(&buff[len], ",%.6f,%.6f,%.6f", stats.avg.val[i], stats.min.val[i], stats.max.val[i]);
+  }
+  len += sprintf(&buff[len], DC_POWERMON_RSP_LINEFEED);
+  return(len);
+}
+
+static void record_send(struct socket_conn_t* conn, uint8_t type, const void* data, size_t len) {
+  // header and payload go out in a single write, otherwise Nagle's algorithm holds back the payload
+  char buff[sizeof(struct dc_powermon_rec_hdr_t) + 512];
+  struct dc_powermon_rec_hdr_t hdr = {
+    .magic = DC_POWERMON_REC_MAGIC,
+    .type = type,
+    .reserved = 0,
+    .len = len,
+  };
+  if(len > sizeof(buff) - sizeof(hdr)) {
+    len = sizeof(buff) - sizeof(hdr);
+    hdr.len = len;
+  }
+  memcpy(buff, &hdr, sizeof(hdr));
+  memcpy(&buff[sizeof(hdr)], data, len);
+  socket_write_buff(conn, buff, sizeof(hdr) + len);
+}
+
+static void record_send_meas(struct socket_conn_t* conn) {
+  struct dc_powermon_rec_meas_t rec = {
+    .timestamp = (uint64_t)stats.timestamp.tv_sec * 1000000000ULL + (uint64_t)stats.timestamp.tv_nsec,
+    .count = stats.count,
+  };
+  for(int i = 0; i < NUM_SAMPLE_TYPES; i++) {
+    rec.avg[i] = stats.avg.val[i];
+    rec.min[i] = stats.min.val[i];
+    rec.max[i] = stats.max.val[i];
+  }
+  record_send(conn, DC_POWERMON_REC_MEAS, &rec, sizeof(rec));
+}
+
+static uint64_t history_delta(const struct history_t* entry) {
+  if(entry->delta & HISTORY_DELTA_US) {
+    return((uint64_t)(entry->delta & ~HISTORY_DELTA_US) * 1000ULL);
+  }
+  return(entry->delta);
+}
+
+static struct dc_powermon_sample_t* history_push(struct sample_t* sample) {
+  // the delta is taken from the restored timestamp of the previous sample, so that rounding errors don't add up
+  uint64_t delta = history_len ? sample->timestamp - history_latest.timestamp : 0;
+  struct history_t* entry = &history[history_head];
+  if(delta < HISTORY_DELTA_US) {
+    entry->delta = delta;
+  } else if(delta / 1000ULL < HISTORY_DELTA_US) {
+    entry->delta = (delta / 1000ULL) | HISTORY_DELTA_US;
+  } else {
+    // acquisition stalled for more than half an hour, the next block restores the correct time
+    entry->delta = UINT32_MAX;
+  }
+  if(history_head % HISTORY_BLOCK == 0) {
+    history_base[history_head / HISTORY_BLOCK] = sample->timestamp;
+    history_latest.timestamp = sample->timestamp;
+  } else {
+    history_latest.timestamp += history_delta(entry);
+  }
+  for(int i = 0; i < NUM_SAMPLE_TYPES; i++) {
+    entry->val[i] = (float)sample->val[i];
+    history_latest.val[i] = entry->val[i];
+  }
+
+  // the block the head is in cannot be restored anymore once its first sample was overwritten
+  history_head = (history_head + 1) % HISTORY_SIZE;
+  if(history_len < HISTORY_SIZE - HISTORY_BLOCK) {
+    history_len++;
+  }
+
+  return(&history_latest);
+}
+
+static size_t history_pos(size_t index) {
+  // index 0 is the oldest sample still in the history
+  return((history_head + HISTORY_SIZE - history_len + index) % HISTORY_SIZE);
+}
+
+static uint64_t history_timestamp(size_t pos) {
+  size_t start = pos - pos % HISTORY_BLOCK;
+  uint64_t timestamp = history_base[start / HISTORY_BLOCK];
+  for(size_t i = start + 1; i <= pos; i++) {
+    timestamp += history_delta(&history[i]);
+  }
+  return(timestamp);
+}
+
+static size_t history_find(uint64_t timestamp) {
+  // index of the first sample not older than timestamp, samples are in chronological order
+  size_t lo = 0;
+  size_t hi = history_len;
+  while(lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if(history_timestamp(history_pos(mid)) < timestamp) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return(lo);
+}
+
+static void range_parse(char* args, uint64_t* start, uint64_t* stop) {
+  // optional time range, stop of 0 means up to the latest entry
+  *start = 0;
+  *stop = 0;
+  if(args) {
+    *start = strtoull(args, &args, 10);
+    if(*args == ',') {
+      *stop = strtoull(args + 1, NULL, 10);
+    }
+  }
+}
+
+static int block_send_header(struct socket_conn_t* conn, uint8_t type, size_t len, bool bin) {
+  // IEEE 488.2 definite-length block header, or a record header in binary format
+  if(bin) {
+    struct dc_powermon_rec_hdr_t hdr = {
+      .magic = DC_POWERMON_REC_MAGIC,
+      .type = type,
+      .reserved = 0,
+      .len = len,
+    };
+    return(socket_write_buff(conn, &hdr, sizeof(hdr)));
+  }
+
+  char header[32];
+  char len_str[24];
+  int len_digits = sprintf(len_str, "%zu", len);
+  sprintf(header, "#%d%s", len_digits, len_str);
+  return(socket_write_buff(conn, header, strlen(header)));
+}
+
+static void history_send(struct socket_conn_t* conn, char* args, bool bin) {
+  uint64_t start, stop;
+  range_parse(args, &start, &stop);
+
+  size_t first = history_find(start);
+  size_t last = stop ? history_find(stop + 1) : history_len;
+  size_t num = (last > first) ? (last - first) : 0;
+  if(block_send_header(conn, DC_POWERMON_REC_SAMPLES, num * sizeof(struct dc_powermon_sample_t), bin) < 0) {
+    return;
+  }
+
+  // samples are restored into the format they are sent in a chunk at a time
+  struct dc_powermon_sample_t chunk[256];
+  size_t pos = history_pos(first);
+  uint64_t timestamp = num ? history_timestamp(pos) : 0;
+  while(num > 0) {
+    size_t chunk_len = (num < sizeof(chunk) / sizeof(chunk[0])) ? num : sizeof(chunk) / sizeof(chunk[0]);
+    for(size_t i = 0; i < chunk_len; i++) {
+      chunk[i].timestamp = timestamp;
+      memcpy(chunk[i].val, history[pos].val, sizeof(chunk[i].val));
+      pos = (pos + 1) % HISTORY_SIZE;
+      timestamp = (pos % HISTORY_BLOCK) ? timestamp + history_delta(&history[pos]) : history_base[pos / HISTORY_BLOCK];
+    }
+    if(socket_write_buff(conn, chunk, chunk_len * sizeof(struct dc_powermon_sample_t)) < 0) {
+      return;
+    }
+    num -= chunk_len;
+  }
+
+  if(!bin) {
+    socket_write_buff(conn, DC_POWERMON_RSP_LINEFEED, strlen(DC_POWERMON_RSP_LINEFEED));
+  }
+}
+
+static char* label_parse(char* args, char* label) {
+  // the label is everything between the quotes, or up to the next comma without them
+  memset(label, 0, DC_POWERMON_MARKER_LABEL_LEN);
+  while(*args == ' ') {
+    args++;
+  }
+  bool quoted = (*args == '"');
+  if(quoted) {
+    args++;
+  }
+  size_t len = strcspn(args, quoted ? "\"" : ",\r\n");
+  memcpy(label, args, (len < DC_POWERMON_MARKER_LABEL_LEN - 1) ? len : DC_POWERMON_MARKER_LABEL_LEN - 1);
+  args += len;
+  if(quoted && (*args == '"')) {
+    args++;
+  }
+  return(args);
+}
+
+static uint64_t marker_set(uint64_t timestamp, char* args) {
+  struct dc_powermon_marker_t* marker = &markers[marker_head];
+  marker->timestamp = timestamp;
+  label_parse(args, marker->label);
+
+  // the integrals up to the marker, so that the energy between any two markers is known
+  energy_point(&marker_energy[marker_head], timestamp, true);
+
+  marker_head = (marker_head + 1) % MARKER_SIZE;
+  if(marker_len < MARKER_SIZE) {
+    marker_len++;
+  }
+
+  // the samples before the marker were already published, so this keeps everything in order
+  stream_push_marker(marker);
+  mcast_push_marker(marker);
+  shm_push_marker(marker);
+  return(timestamp);
 }
 
-static void process_socket_cmd(int fd, char* cmd) {
-  char buff[64] = { 0 };
+static void marker_send(struct socket_conn_t* conn, char* args, bool bin) {
+  uint64_t start, stop;
+  range_parse(args, &start, &stop);
+
+  // markers are in chronological order, so the range is contiguous
+  size_t oldest = (marker_head + MARKER_SIZE - marker_len) % MARKER_SIZE;
+  size_t first = 0;
+  while((first < marker_len) && (markers[(oldest + first) % MARKER_SIZE].timestamp < start)) {
+    first++;
+  }
+  size_t last = first;
+  while((last < marker_len) && (!stop || (markers[(oldest + last) % MARKER_SIZE].timestamp <= stop))) {
+    last++;
+  }
+  if(block_send_header(conn, DC_POWERMON_REC_MARKERS, (last - first) * sizeof(struct dc_powermon_marker_t), bin) < 0) {
+    return;
+  }
+
+  // at most two pieces, the ring may wrap around in between
+  size_t pos = (oldest + first) % MARKER_SIZE;
+  size_t num = last - first;
+  while(num > 0) {
+    size_t chunk_len = (num < MARKER_SIZE - pos) ? num : MARKER_SIZE - pos;
+    if(socket_write_buff(conn, &markers[pos], chunk_len * sizeof(struct dc_powermon_marker_t)) < 0) {
+      return;
+    }
+    pos = (pos + chunk_len) % MARKER_SIZE;
+    num -= chunk_len;
+  }
+
+  if(!bin) {
+    socket_write_buff(conn, DC_POWERMON_RSP_LINEFEED, strlen(DC_POWERMON_RSP_LINEFEED));
+  }
+}
+
+static bool marker_energy_find(char* args, struct dc_powermon_energy_t* res) {
+  char from[DC_POWERMON_MARKER_LABEL_LEN];
+  char to[DC_POWERMON_MARKER_LABEL_LEN];
+  args = label_parse(args, from);
+  bool any = (*args != ',');
+  if(!any) {
+    label_parse(args + 1, to);
+  }
+
+  // the latest marker labelled from, then the first one after it that ends the interval
+  size_t oldest = (marker_head + MARKER_SIZE - marker_len) % MARKER_SIZE;
+  size_t start = marker_len;
+  while((start > 0) && strcmp(markers[(oldest + start - 1) % MARKER_SIZE].label, from)) {
+    start--;
+  }
+  if(start == 0) {
+    return(false);
+  }
+  start--;
+  size_t stop = start + 1;
+  while((stop < marker_len) && !any && strcmp(markers[(oldest + stop) % MARKER_SIZE].label, to)) {
+    stop++;
+  }
+
+  if(stop < marker_len) {
+    energy_interval(&marker_energy[(oldest + start) % MARKER_SIZE], &marker_energy[(oldest + stop) % MARKER_SIZE], res);
+  } else {
+    struct energy_point_t now;
+    energy_point(&now, perf_now(), false);
+    energy_interval(&marker_energy[(oldest + start) % MARKER_SIZE], &now, res);
+  }
+  return(true);
+}
+
+static bool cmd_match(char* cmd, const char* name, char** args) {
+  // commands with arguments must be followed by a space or the end of the line, so that e.g. MARKER is not taken for MARK
+  size_t len = strlen(name);
+  if((strncmp(cmd, name, len) != 0) || ((cmd[len] != ' ') && (cmd[len] != '\r') && (cmd[len] != '\n') && (cmd[len] != '\0'))) {
+    return(false);
+  }
+  *args = (cmd[len] == ' ') ? &cmd[len + 1] : NULL;
+  return(true);
+}
+
+static bool process_socket_cmd(struct socket_conn_t* conn, char* cmd) {
+  int fd = conn->fd;
+  bool bin = conn->flags & CONN_FLAG_BIN;
+  char buff[512] = { 0 };
+  char* args = NULL;
+  bool stop = false;
+
+  // single-value queries are formatted at the end, in whichever format the connection uses
+  static const char* units[] = { "V", "mV", "mA", "mW" };
+  int channel = -1;
   if(strstr(cmd, DC_POWERMON_CMD_READ_POWER) == cmd) {
-    sprintf(buff, "%.2fmW" DC_POWERMON_RSP_LINEFEED, (double)stats.avg.val[P_SHUNT]);
+    channel = P_SHUNT;
   
   } else if(strstr(cmd, DC_POWERMON_CMD_READ_CURRENT) == cmd) {
-    sprintf(buff, "%.2fmA" DC_POWERMON_RSP_LINEFEED, (double)stats.avg.val[I_SHUNT]);
+    channel = I_SHUNT;
   
   } else if(strstr(cmd, DC_POWERMON_CMD_READ_V_BUS) == cmd) {
-    sprintf(buff, "%.2fV" DC_POWERMON_RSP_LINEFEED, (double)stats.avg.val[V_BUS]);
+    channel = V_BUS;
   
   } else if(strstr(cmd, DC_POWERMON_CMD_READ_V_SHUNT) == cmd) {
-    sprintf(buff, "%.2fmV" DC_POWERMON_RSP_LINEFEED, (double)stats.avg.val[V_SHUNT]);
+    channel = V_SHUNT;
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_MEAS_ALL) == cmd) {
+    if(bin) {
+      record_send_meas(conn);
+      return(false);
+    }
+    stats_format_all(buff);
+
+  } else if(cmd_match(cmd, DC_POWERMON_CMD_FETCH_DATA, &args)) {
+    history_send(conn, args, bin);
+    return(false);
+
+  } else if(cmd_match(cmd, DC_POWERMON_CMD_FETCH_MARK, &args)) {
+    marker_send(conn, args, bin);
+    return(false);
+
+  } else if(cmd_match(cmd, DC_POWERMON_CMD_MARK, &args)) {
+    // timestamped right away, before anything else can delay it
+    uint64_t timestamp = marker_set(perf_now(), args ? args : "");
+    sprintf(buff, "%llu.%09llu" DC_POWERMON_RSP_LINEFEED, (unsigned long long)(timestamp / 1000000000ULL), (unsigned long long)(timestamp % 1000000000ULL));
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_ENERGY_START) == cmd) {
+    energy_start(perf_now());
+    sprintf(buff, DC_POWERMON_RSP_OK);
+
+  } else if((strstr(cmd, DC_POWERMON_CMD_ENERGY_STOP) == cmd) || cmd_match(cmd, DC_POWERMON_CMD_ENERGY_MARK, &args) ||
+            (strstr(cmd, DC_POWERMON_CMD_ENERGY_TOTAL) == cmd)) {
+    struct dc_powermon_energy_t res;
+    bool found = true;
+    if(strstr(cmd, DC_POWERMON_CMD_ENERGY_TOTAL) == cmd) {
+      energy_total(perf_now(), &res);
+    } else if(strstr(cmd, DC_POWERMON_CMD_ENERGY_STOP) == cmd) {
+      found = energy_stop(perf_now(), &res);
+    } else {
+      found = marker_energy_find(args ? args : "", &res);
+    }
+    if(found && bin) {
+      record_send(conn, DC_POWERMON_REC_ENERGY, &res, sizeof(res));
+      return(false);
+    } else if(found) {
+      int len = energy_format(buff, &res);
+      sprintf(&buff[len], DC_POWERMON_RSP_LINEFEED);
+    } else {
+      sprintf(buff, DC_POWERMON_RSP_ERR);
+    }
+
+  } else if(cmd_match(cmd, DC_POWERMON_CMD_STREAM_START, &args)) {
+    if(stream_start(fd, args, bin, conn->buff, conn->len)) {
+      // the connection now belongs to the stream
+      return(true);
+    }
+    sprintf(buff, DC_POWERMON_RSP_ERR);
 
   } else if(strstr(cmd, DC_POWERMON_CMD_RESET) == cmd) {
     stats_reset();
-    sprintf(buff, DC_POWERMON_RSP_LINEFEED);
+    sprintf(buff, DC_POWERMON_RSP_OK);
   
+  } else if(strstr(cmd, DC_POWERMON_CMD_SESSION) == cmd) {
+    sprintf(buff, "%016llx,%llu.%09llu,%llu" DC_POWERMON_RSP_LINEFEED, (unsigned long long)session.session,
+      (unsigned long long)(session.started / 1000000000ULL), (unsigned long long)(session.started % 1000000000ULL), (unsigned long long)session.restores);
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_TIME) == cmd) {
+    uint64_t raw, real;
+    clock_measure(&raw, &real);
+    sprintf(buff, "%llu.%09llu,%llu.%09llu" DC_POWERMON_RSP_LINEFEED, (unsigned long long)(raw / 1000000000ULL), (unsigned long long)(raw % 1000000000ULL),
+      (unsigned long long)(real / 1000000000ULL), (unsigned long long)(real % 1000000000ULL));
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_OVERRUNS) == cmd) {
+    sprintf(buff, "%lu" DC_POWERMON_RSP_LINEFEED, acq_overruns);
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_PERF) == cmd) {
+    int len = perf_format(buff, acq_overruns);
+    sprintf(&buff[len], DC_POWERMON_RSP_LINEFEED);
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_JITTER) == cmd) {
+    int len = jitter_format(buff);
+    sprintf(&buff[len], DC_POWERMON_RSP_LINEFEED);
+
   } else if(strstr(cmd, DC_POWERMON_CMD_ID) == cmd) {
     sprintf(buff, "radiolib-org,DCpowerMon," GITREV DC_POWERMON_RSP_LINEFEED);
 
+  } else if(strstr(cmd, DC_POWERMON_CMD_KEEP_ON) == cmd) {
+    conn->keep = true;
+    sprintf(buff, DC_POWERMON_RSP_OK);
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_KEEP_OFF) == cmd) {
+    conn->keep = false;
+    sprintf(buff, DC_POWERMON_RSP_OK);
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_FORM_BIN) == cmd) {
+    // the reply is still ASCII, so that clients can tell whether the server supports it
+    conn->flags |= CONN_FLAG_BIN;
+    socket_write(conn, DC_POWERMON_RSP_OK);
+    return(false);
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_FORM_ASC) == cmd) {
+    conn->flags &= ~CONN_FLAG_BIN;
+    socket_write(conn, DC_POWERMON_RSP_OK);
+    return(false);
+
   } else if(strstr(cmd, DC_POWERMON_CMD_SYSTEM_EXIT) == cmd) {
-    raise(SIGINT);
+    // acknowledged like everything else, the response goes out before the daemon stops
+    sprintf(buff, DC_POWERMON_RSP_OK);
+    stop = true;
 
   } else {
-    // TODO handle invalid commands?
+    // every command gets a response, so that clients on persistent connections stay in sync
     fprintf(stderr, "invalid socket cmd: %s\n", cmd);
+    sprintf(buff, DC_POWERMON_RSP_ERR);
+
+  }
+
+  if(channel >= 0) {
+    if(bin) {
+      float val = stats.avg.val[channel];
+      record_send(conn, DC_POWERMON_REC_VALUE, &val, sizeof(val));
+      return(false);
+    }
+    sprintf(buff, "%.2f%s" DC_POWERMON_RSP_LINEFEED, stats.avg.val[channel], units[channel]);
+  }
+
+  // text responses are sent without the linefeed in binary format
+  if(bin) {
+    record_send(conn, DC_POWERMON_REC_TEXT, buff, strcspn(buff, DC_POWERMON_RSP_LINEFEED));
+  } else {
+    socket_write(conn, buff);
+  }
+  if(stop) {
+    exiting = 1;
+  }
+  return(false);
+}
+
+static void control_process() {
+  // check if there are new connections or commands
+  uint64_t start = perf_now();
+  struct socket_conn_t* conn = NULL;
+  for(int i = 0; i < conf.num_sockets; i++) {
+    socket_accept(conf.socket_fds[i]);
+  }
+  while((conn = socket_read(socket_buff, sizeof(socket_buff)))) {
+    if(process_socket_cmd(conn, socket_buff)) {
+      // the connection was taken over
+      socket_release(conn);
+    } else if(!conn->keep) {
+      // one-shot connection, it is closed once the response is out
+      socket_done(conn);
+    }
+  }
+
+  // send out whatever is waiting for stream subscribers
+  stream_poll();
+  perf_phase(PERF_PHASE_CONTROL, start, perf_now());
+}
 
+static int acq_setup(double rate) {
+  acq_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if(acq_timer_fd < 0) {
+    fprintf(stderr, "Failed to create acquisition timer, errno %d.\n", errno);
+    return(-1);
   }
 
-  socket_write(fd, buff);
+  // absolute expiration times at a fixed period, so the sample times do not drift
+  acq_period = (uint64_t)(1e9 / rate);
+  acq_deadline = clock_get_ns(CLOCK_MONOTONIC) + acq_period;
+  struct itimerspec spec = {
+    .it_interval = { .tv_sec = acq_period / 1000000000ULL, .tv_nsec = acq_period % 1000000000ULL },
+    .it_value = { .tv_sec = acq_deadline / 1000000000ULL, .tv_nsec = acq_deadline % 1000000000ULL },
+  };
+  if(timerfd_settime(acq_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0) {
+    fprintf(stderr, "Failed to start acquisition timer, errno %d.\n", errno);
+    return(-1);
+  }
+  return(0);
+}
+
+static int acq_wait() {
+  // sleep until the next sample is due, control connections are handled meanwhile
+  while(!exiting) {
+    struct pollfd fds[1 + CONTROL_MAX + conf.max_conns];
+    fds[0].fd = acq_timer_fd;
+    fds[0].events = POLLIN;
+    int num = 1;
+    for(int i = 0; i < conf.num_sockets; i++) {
+      fds[num].fd = conf.socket_fds[i];
+      fds[num].events = POLLIN;
+      num++;
+    }
+    num += socket_poll_fds(&fds[num], conf.max_conns);
+
+    if(poll(fds, num, -1) < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to wait for the acquisition timer, errno %d.\n", errno);
+      return(-1);
+    }
+
+    if(fds[0].revents & POLLIN) {
+      // more than one expiration means the previous iteration took longer than the period
+      uint64_t now = clock_get_ns(CLOCK_MONOTONIC);
+      uint64_t expirations = 0;
+      if((read(acq_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) || !expirations) {
+        continue;
+      }
+      acq_overruns += expirations - 1;
+      acq_deadline += (expirations - 1) * acq_period;
+      jitter_update((now > acq_deadline) ? now - acq_deadline : 0);
+      acq_deadline += acq_period;
+      return(0);
+    }
+
+    control_process();
+  }
+
+  // the caller checks the flag too, no sample is taken on the way out
+  return(0);
+}
+
+static void rt_prefault_stack() {
+  // touch the stack, so that growing it later does not cause page faults
+  volatile char buff[RT_STACK_PREFAULT];
+  for(size_t i = 0; i < sizeof(buff); i += 4096) {
+    buff[i] = 0;
+  }
+}
+
+static int rt_setup(int priority, int cpu) {
+  // locking everything mapped so far also faults in the sample rings and the shared memory
+  if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    fprintf(stderr, "Failed to lock memory, errno %d.\n", errno);
+    return(-1);
+  }
+  rt_prefault_stack();
+
+  if(cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+      fprintf(stderr, "Failed to pin acquisition to CPU %d.\n", cpu);
+      return(-1);
+    }
+  }
+
+  struct sched_param param = { .sched_priority = priority };
+  int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if(ret != 0) {
+    fprintf(stderr, "Failed to set SCHED_FIFO priority %d, error %d.\n", priority, ret);
+    return(-1);
+  }
+  return(0);
 }
 
 static int run() {
   // start readout
-  fprintf(stdout, "   V_bus     V_shunt    I_shunt     P_shunt\n");
   struct sample_t sample;
-  int read_socket_fd = 0;
-  for(;;) {
+  while(!exiting) {
+    // without a rate, sample as fast as the bus allows
+    if((acq_timer_fd >= 0) && (acq_wait() < 0)) {
+      return(1);
+    }
+    if(exiting) {
+      break;
+    }
+
+    // the sample is timestamped between the register reads, which is as close as it gets to the actual conversion
+    uint64_t start = perf_now();
     sample.val[V_BUS] = ina219_read_bus_voltage();
     sample.val[V_SHUNT] = ina219_read_shunt_voltage();
     sample.val[I_SHUNT] = ina219_read_current();
+    uint64_t read_end = perf_now();
+    sample.timestamp = start + (read_end - start) / 2;
     sample.val[P_SHUNT] = sample.val[I_SHUNT] * sample.val[V_BUS]; // it is a lot faster to multiply than send it over the I2C bus
+    perf_phase(PERF_PHASE_READ, start, read_end);
+    perf_sample(sample.timestamp);
+    clock_sync(sample.timestamp);
 
     // update statistics
     stats_update(&sample);
+    energy_update(sample.timestamp, sample.val[I_SHUNT], sample.val[P_SHUNT]);
+    state_checkpoint(sample.timestamp);
+    struct dc_powermon_sample_t* entry = history_push(&sample);
+    uint64_t stats_end = perf_now();
+    perf_phase(PERF_PHASE_STATS, read_end, stats_end);
 
-    fprintf(stdout, " %6.2f V  %6.2f mV %7.2f mA  %7.2f mW\r", stats.avg.val[V_BUS], stats.avg.val[V_SHUNT], stats.avg.val[I_SHUNT], stats.avg.val[P_SHUNT]);
-    fflush(stdout);
+    stream_push(entry);
+    mcast_push(entry);
+    shm_push(entry);
+    stats_publish();
+    uint64_t publish_end = perf_now();
+    perf_phase(PERF_PHASE_PUBLISH, stats_end, publish_end);
 
-    // check if there is something to read from the socket
-    read_socket_fd = socket_read(conf.socket_fd, socket_buff);
-    if(read_socket_fd > 0) {
-      // got something, process it
-      process_socket_cmd(read_socket_fd, socket_buff);
-
-      // close the socket now, we're done with it
-      close(read_socket_fd);
+    // the console is drawn by its own thread, at a rate a terminal can keep up with
+    if(!conf.quiet) {
+      stats_console(&sample);
     }
+    uint64_t console_done = perf_now();
+    perf_phase(PERF_PHASE_CONSOLE, publish_end, console_done);
+
+    control_process();
+    perf_report(console_done, acq_overruns);
   }
 
   return(0);
@@ -188,11 +1015,26 @@ static int run() {
 
 int main(int argc, char** argv) {
   void *argtable[] = {
+    args.device = arg_str0("d", "device", "path", "I2C bus device, or " INA219_SIM_PATH " for a simulated sensor, defaults to " I2C_DEVICE_DEFAULT),
     args.addr = arg_int0("a", "addr", NULL, "I2C address of the INA219, defaults to " STR(INA219_ADDR_DEFAULT)),
     args.max_current = arg_dbl0("i", "max_current", "Amps", "Maximum current expected to flow through the shunt resistor, defaults to 1.0 A"),
     args.r_shunt = arg_dbl0("r", "r_shunt", "milliOhms", "Shunt resistor value, defaults to 100.0 mOhm"),
     args.window = arg_int0("w", "window", NULL, "Averaging window length, defaults to " STR(WINDOW_DEFAULT)),
-    args.control = arg_int0("c", "control", "port", "Control port for socket connection, defaults to " STR(CONTROL_DEFAULT)),
+    args.rate = arg_dbl0(NULL, "rate", "Hz", "Sampling rate, defaults to as fast as the I2C bus allows"),
+    args.realtime = arg_lit0(NULL, "realtime", "Run paced acquisition (--rate is required) with SCHED_FIFO priority and locked memory, needs CAP_SYS_NICE and CAP_IPC_LOCK"),
+    args.rt_priority = arg_int0(NULL, "rt_priority", NULL, "SCHED_FIFO priority with --realtime, defaults to " STR(RT_PRIORITY_DEFAULT)),
+    args.rt_cpu = arg_int0(NULL, "rt_cpu", "cpu", "Pin acquisition to this CPU with --realtime, ideally one isolated by isolcpus"),
+    args.perf = arg_int0(NULL, "perf", "seconds", "Print a summary of the loop timing to stderr this often, same as SYST:PERF?"),
+    args.quiet = arg_lit0("q", "quiet", "No console output, e.g. when running as a service"),
+    args.dashboard = arg_lit0(NULL, "dashboard", "Show a full-screen dashboard instead of a single line"),
+    args.control = arg_strn("c", "control", "endpoint", 0, CONTROL_MAX, "Control endpoint, can be repeated: TCP port, " CONTROL_PREFIX_UNIX "<path> or " CONTROL_PREFIX_SEQPACKET "<path>, defaults to " STR(CONTROL_DEFAULT)),
+    args.control_mode = arg_str0(NULL, "control_mode", "mode", "Permissions of Unix control sockets in octal, defaults to " CONTROL_MODE_DEFAULT),
+    args.control_max = arg_int0(NULL, "control_max", NULL, "Maximum number of open control connections, further ones get ERR and are closed, defaults to " STR(SOCKET_MAX_CONNS)),
+    args.mcast = arg_str0(NULL, "mcast", "addr:port", "Publish samples over UDP to this multicast group or broadcast address"),
+    args.mcast_if = arg_str0(NULL, "mcast_if", "addr", "Address of the interface to publish multicast from, e.g. 127.0.0.1 for loopback"),
+    args.shm = arg_lit0(NULL, "shm", "Publish samples and statistics in POSIX shared memory"),
+    args.shm_name = arg_str0(NULL, "shm_name", "name", "Name of the shared memory segment, defaults to " DC_POWERMON_SHM_NAME),
+    args.state = arg_str0(NULL, "state", "path", "Keep the statistics and energy totals in this file, so that a restarted daemon carries on with the same session"),
     args.help = arg_lit0(NULL, "help", "Display this help and exit"),
     args.end = arg_end(2),
   };
@@ -209,7 +1051,7 @@ int main(int argc, char** argv) {
     fprintf(stdout, "INA219 power monitor, gitrev " GITREV "\n");
     fprintf(stdout, "Usage: %s", argv[0]);
     arg_print_syntax(stdout, argtable, "\n");
-    fprintf(stdout, "After start, send SIGINT /Ctrl+C/ to stop\n");
+    fprintf(stdout, "After start, send SIGINT /Ctrl+C/ or SIGTERM to stop\n");
     arg_print_glossary(stdout, argtable,"  %-25s %s\n");
     exitcode = 0;
     goto exit;
@@ -223,7 +1065,11 @@ int main(int argc, char** argv) {
   }
 
   atexit(exithandler);
-  signal(SIGINT, sighandler);
+  struct sigaction sa = { 0 };
+  sa.sa_handler = sighandler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
 
   // parse arguments
   int addr = INA219_ADDR_DEFAULT;
@@ -233,17 +1079,88 @@ int main(int argc, char** argv) {
   double r_shunt = 100.0;
   if(args.r_shunt->count) { max_current = args.r_shunt->dval[0]; }
 
-  // set up the socket
-  int socket_port = CONTROL_DEFAULT;
-  if(args.control->count) { socket_port = args.control->ival[0]; };
-  conf.socket_fd = socket_setup(socket_port);
+  conf.quiet = (args.quiet->count > 0);
+  if(args.rate->count) {
+    conf.rate = args.rate->dval[0];
+    if((conf.rate <= 0) || (conf.rate > RATE_MAX)) {
+      fprintf(stderr, "Sampling rate must be above 0 and at most %.0f Hz\n", RATE_MAX);
+      exitcode = 1;
+      goto exit;
+    }
+  }
+
+  // jitter is measured against the deadlines of paced samples, and a free-running loop at real-time priority would starve its CPU
+  if(args.realtime->count && !args.rate->count) {
+    fprintf(stderr, "Real-time acquisition needs a fixed sampling rate, set by --rate\n");
+    exitcode = 1;
+    goto exit;
+  }
+
+  // set up the sockets
+  if(args.control_max->count) {
+    conf.max_conns = args.control_max->ival[0];
+    if((conf.max_conns < 1) || (conf.max_conns > CONTROL_CONNS_MAX)) {
+      fprintf(stderr, "Maximum number of control connections must be between 1 and %d\n", CONTROL_CONNS_MAX);
+      exitcode = 1;
+      goto exit;
+    }
+  }
+  if(socket_set_max(conf.max_conns, DC_POWERMON_RSP_ERR) < 0) {
+    exitcode = 1;
+    goto exit;
+  }
+  int socket_mode = strtol(args.control_mode->count ? args.control_mode->sval[0] : CONTROL_MODE_DEFAULT, NULL, 8);
+  if(!args.control->count) {
+    conf.socket_fds[conf.num_sockets] = socket_setup(CONTROL_DEFAULT);
+    if(conf.socket_fds[conf.num_sockets] < 0) {
+      exitcode = 1;
+      goto exit;
+    }
+    conf.num_sockets++;
+  }
+  for(int i = 0; i < args.control->count; i++) {
+    const char* endpoint = args.control->sval[i];
+    if(strstr(endpoint, CONTROL_PREFIX_UNIX) == endpoint) {
+      conf.socket_paths[conf.num_sockets] = endpoint + strlen(CONTROL_PREFIX_UNIX);
+      conf.socket_fds[conf.num_sockets] = socket_setup_unix(conf.socket_paths[conf.num_sockets], false, socket_mode, &conf.socket_inos[conf.num_sockets]);
+    } else if(strstr(endpoint, CONTROL_PREFIX_SEQPACKET) == endpoint) {
+      conf.socket_paths[conf.num_sockets] = endpoint + strlen(CONTROL_PREFIX_SEQPACKET);
+      conf.socket_fds[conf.num_sockets] = socket_setup_unix(conf.socket_paths[conf.num_sockets], true, socket_mode, &conf.socket_inos[conf.num_sockets]);
+    } else {
+      conf.socket_fds[conf.num_sockets] = socket_setup(atoi(endpoint));
+    }
+    if(conf.socket_fds[conf.num_sockets] < 0) {
+      // the path may belong to someone else, so it must not be removed on exit
+      conf.socket_paths[conf.num_sockets] = NULL;
+      exitcode = 1;
+      goto exit;
+    }
+    conf.num_sockets++;
+  }
+
+  // set up the optional UDP publisher
+  if(args.mcast->count) {
+    if(mcast_setup(args.mcast->sval[0], args.mcast_if->count ? args.mcast_if->sval[0] : NULL) < 0) {
+      exitcode = 1;
+      goto exit;
+    }
+  }
+
+  // set up the optional shared memory
+  if(args.shm->count) {
+    if(shm_setup(args.shm_name->count ? args.shm_name->sval[0] : DC_POWERMON_SHM_NAME) < 0) {
+      exitcode = 1;
+      goto exit;
+    }
+  }
 
   // start the power meter
-  int ret = ina219_begin("/dev/i2c-1", addr);
+  int ret = ina219_begin(args.device->count ? args.device->sval[0] : I2C_DEVICE_DEFAULT, addr);
   if(ret) {
     fprintf(stderr, "ERROR: Failed to open I2C port\n");
     return(ret);
   }
+  conf.sensor_open = true;
 
   // set the configuration and calibration
   struct ina219_cfg_t ina_cfg;
@@ -252,6 +1169,40 @@ int main(int argc, char** argv) {
   ina219_calibration_set(max_current, r_shunt);
   ina219_config_set(&ina_cfg);
 
+  // timing is always collected, printing it is optional
+  perf_setup(args.perf->count ? args.perf->ival[0] : 0);
+
+  // set up the optional paced acquisition
+  if((conf.rate > 0) && (acq_setup(conf.rate) < 0)) {
+    exitcode = 1;
+    goto exit;
+  }
+
+  // the state writer must be started before switching to real-time priority as well
+  int restored = state_setup(args.state->count ? args.state->sval[0] : NULL, &session);
+  if(restored < 0) {
+    exitcode = 1;
+    goto exit;
+  } else if(restored) {
+    state_restore(&session);
+    fprintf(stdout, "Restored session %016llx, %lu samples so far\n", (unsigned long long)session.session, stats.count);
+  }
+
+  // the console renderer must be started before switching to real-time priority, so that it does not inherit it
+  if(!conf.quiet && (console_setup(args.dashboard->count > 0) < 0)) {
+    exitcode = 1;
+    goto exit;
+  }
+
+  // real-time mode comes last, so that everything it locks is already mapped
+  if(args.realtime->count) {
+    int priority = args.rt_priority->count ? args.rt_priority->ival[0] : RT_PRIORITY_DEFAULT;
+    if(rt_setup(priority, args.rt_cpu->count ? args.rt_cpu->ival[0] : -1) < 0) {
+      exitcode = 1;
+      goto exit;
+    }
+  }
+
   exitcode = run();
 
 exit:
@@ -0,0 +1,119 @@
+#include "energy.h"
+
+#include <stdio.h>
+
+// points waiting for the next sample, so that they can be interpolated
+#define ENERGY_PENDING_MAX        16
+
+// integrals since start, and the latest sample they end at
+static struct energy_point_t total = { 0 };
+static double last_current = 0;
+static double last_power = 0;
+static bool last_valid = false;
+
+static struct energy_point_t* pending[ENERGY_PENDING_MAX] = { NULL };
+static int pending_num = 0;
+
+static struct energy_point_t interval_start = { 0 };
+static bool interval_started = false;
+
+static void energy_add(struct energy_sum_t* acc, double val) {
+  // the small trapezoids of a long run would otherwise be lost in the rounding of the total
+  double y = val - acc->comp;
+  double t = acc->sum + y;
+  acc->comp = (t - acc->sum) - y;
+  acc->sum = t;
+}
+
+static double energy_diff(const struct energy_sum_t* start, const struct energy_sum_t* stop) {
+  return((stop->sum - start->sum) - (stop->comp - start->comp));
+}
+
+static void energy_extend(struct energy_point_t* point, uint64_t timestamp, double current, double power) {
+  // trapezoid from the latest sample to the given values at timestamp
+  uint64_t dt_ns = (last_valid && (timestamp > total.timestamp)) ? timestamp - total.timestamp : 0;
+  double dt = (double)dt_ns / 1e9;
+  *point = total;
+  point->timestamp = timestamp;
+  point->elapsed += dt_ns;
+  if(dt_ns) {
+    energy_add(&point->energy, (last_power + power) / 2.0 * dt);
+    energy_add(&point->charge, (last_current + current) / 2.0 * dt);
+  }
+}
+
+void energy_update(uint64_t timestamp, double current, double power) {
+  // pending points lie between the latest sample and this one, the values there are interpolated
+  for(int i = 0; i < pending_num; i++) {
+    struct energy_point_t* point = pending[i];
+    if(point->pending && (point->count == total.count) && (point->timestamp >= total.timestamp) && (point->timestamp <= timestamp)) {
+      double frac = (timestamp > total.timestamp) ? (double)(point->timestamp - total.timestamp) / (double)(timestamp - total.timestamp) : 0;
+      energy_extend(point, point->timestamp, last_current + (current - last_current) * frac, last_power + (power - last_power) * frac);
+    }
+    point->pending = false;
+  }
+  pending_num = 0;
+
+  energy_extend(&total, timestamp, current, power);
+  total.count++;
+  last_current = current;
+  last_power = power;
+  last_valid = true;
+}
+
+void energy_point(struct energy_point_t* point, uint64_t timestamp, bool refine) {
+  // until the next sample arrives, the latest values are assumed to continue
+  energy_extend(point, timestamp, last_current, last_power);
+  point->pending = refine && (pending_num < ENERGY_PENDING_MAX);
+  if(point->pending) {
+    pending[pending_num++] = point;
+  }
+}
+
+void energy_interval(const struct energy_point_t* start, const struct energy_point_t* stop, struct dc_powermon_energy_t* res) {
+  res->energy = energy_diff(&start->energy, &stop->energy);
+  res->charge = energy_diff(&start->charge, &stop->charge) / 3600.0;
+  res->duration = (double)(stop->elapsed - start->elapsed) / 1e9;
+  res->count = stop->count - start->count;
+}
+
+void energy_start(uint64_t timestamp) {
+  energy_point(&interval_start, timestamp, true);
+  interval_started = true;
+}
+
+bool energy_stop(uint64_t timestamp, struct dc_powermon_energy_t* res) {
+  if(!interval_started) {
+    return(false);
+  }
+
+  struct energy_point_t stop;
+  energy_point(&stop, timestamp, false);
+  energy_interval(&interval_start, &stop, res);
+  interval_started = false;
+  return(true);
+}
+
+void energy_total(uint64_t timestamp, struct dc_powermon_energy_t* res) {
+  struct energy_point_t start = { 0 };
+  struct energy_point_t stop;
+  energy_point(&stop, timestamp, false);
+  energy_interval(&start, &stop, res);
+}
+
+void energy_save(struct energy_point_t* point) {
+  *point = total;
+  point->pending = false;
+}
+
+void energy_restore(const struct energy_point_t* point) {
+  // timestamps of the previous run mean nothing now, integration starts over with the next sample
+  total = *point;
+  total.timestamp = 0;
+  total.pending = false;
+  last_valid = false;
+}
+
+int energy_format(char* buff, const struct dc_powermon_energy_t* res) {
+  return(sprintf(buff, "%.6f,%.9f,%.6f,%llu", res->energy, res->charge, res->duration, (unsigned long long)res->count));
+}
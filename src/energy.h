@@ -0,0 +1,51 @@
+#ifndef POWERMON_ENERGY_H
+#define POWERMON_ENERGY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dc-powermon-client/dc_powermon_cmds.h"
+
+// running sum with Kahan compensation, the actual value is sum - comp
+struct energy_sum_t {
+  double sum;
+  double comp;
+};
+
+// state of the integrator at some point in time, intervals are the difference of two points
+struct energy_point_t {
+  uint64_t timestamp;
+  uint64_t elapsed;             // ns integrated, unlike the timestamps this carries on across restarts
+  uint64_t count;
+  struct energy_sum_t energy;   // mJ
+  struct energy_sum_t charge;   // mAs
+  bool pending;
+};
+
+// integrate a new sample, current in mA and power in mW
+void energy_update(uint64_t timestamp, double current, double power);
+
+// take a point at timestamp, which must not be older than the latest sample
+// the integral is extrapolated from the latest sample, with refine the point must stay valid until the next sample,
+// which then replaces the extrapolation by an interpolation
+void energy_point(struct energy_point_t* point, uint64_t timestamp, bool refine);
+
+// result for the interval between two points
+void energy_interval(const struct energy_point_t* start, const struct energy_point_t* stop, struct dc_powermon_energy_t* res);
+
+// the interval of ENERGY:START and ENERGY:STOP?, stopping fails when it was not started
+void energy_start(uint64_t timestamp);
+bool energy_stop(uint64_t timestamp, struct dc_powermon_energy_t* res);
+
+// totals since the session started, from the first sample up to timestamp
+void energy_total(uint64_t timestamp, struct dc_powermon_energy_t* res);
+
+// get and set the totals of the latest sample, e.g. to carry them over to the next run
+// the gap between the last sample saved and the first one after restoring is not integrated
+void energy_save(struct energy_point_t* point);
+void energy_restore(const struct energy_point_t* point);
+
+// format the result as a single line without linefeed
+int energy_format(char* buff, const struct dc_powermon_energy_t* res);
+
+#endif
@@ -0,0 +1,145 @@
+#include "mcast.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// number of samples in a single datagram, keeps it below a typical 1500 byte MTU
+#define MCAST_BATCH_MAX           60
+
+// maximum time a sample may wait in an incomplete batch
+#define MCAST_BATCH_TIME_NS       20000000ULL
+
+static int mcast_fd = -1;
+static struct sockaddr_in mcast_addr = { 0 };
+
+static struct mcast_batch_t {
+  struct dc_powermon_frame_hdr_t hdr;
+  struct dc_powermon_sample_t samples[MCAST_BATCH_MAX];
+} __attribute__((packed)) batch = { 0 };
+
+static struct mcast_marker_t {
+  struct dc_powermon_frame_hdr_t hdr;
+  struct dc_powermon_marker_t marker;
+} __attribute__((packed)) marker_frame = { 0 };
+
+static uint32_t seq = 0;
+static uint32_t dropped = 0;
+
+static bool mcast_send(struct dc_powermon_frame_hdr_t* hdr, uint8_t type, uint8_t channels, size_t rec_len) {
+  // the records follow the header in memory, so the frame goes out in a single datagram
+  hdr->magic = DC_POWERMON_FRAME_MAGIC;
+  hdr->type = type;
+  hdr->channels = channels;
+  hdr->seq = seq++;
+  hdr->dropped = dropped;
+  hdr->len = hdr->num * rec_len;
+  size_t len = sizeof(struct dc_powermon_frame_hdr_t) + hdr->len;
+  return(sendto(mcast_fd, hdr, len, MSG_DONTWAIT, (struct sockaddr*)&mcast_addr, sizeof(mcast_addr)) == (ssize_t)len);
+}
+
+static void mcast_flush(void) {
+  if(!batch.hdr.num) {
+    return;
+  }
+  if(!mcast_send(&batch.hdr, DC_POWERMON_FRAME_SAMPLES, (1UL << DC_POWERMON_SAMPLE_NUM_VALS) - 1, sizeof(struct dc_powermon_sample_t))) {
+    dropped += batch.hdr.num;
+  }
+  batch.hdr.num = 0;
+}
+
+int mcast_setup(const char* dest, const char* iface) {
+  char addr[64] = { 0 };
+  const char* port = strrchr(dest, ':');
+  if(!port || ((size_t)(port - dest) >= sizeof(addr))) {
+    fprintf(stderr, "Invalid multicast destination %s, expected <addr>:<port>\n", dest);
+    return(-1);
+  }
+  memcpy(addr, dest, port - dest);
+
+  mcast_addr.sin_family = AF_INET;
+  mcast_addr.sin_port = htons(atoi(port + 1));
+  if(inet_pton(AF_INET, addr, &mcast_addr.sin_addr) != 1) {
+    fprintf(stderr, "Invalid multicast address %s\n", addr);
+    return(-1);
+  }
+
+  mcast_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if(mcast_fd < 0) {
+    fprintf(stderr, "Failed to create multicast socket, errno %d.\n", errno);
+    return(-1);
+  }
+
+  if(IN_MULTICAST(ntohl(mcast_addr.sin_addr.s_addr))) {
+    // keep it on the local network, and let local listeners receive it too
+    unsigned char ttl = 1;
+    unsigned char loop = 1;
+    setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    if(iface) {
+      struct in_addr if_addr = { 0 };
+      if((inet_pton(AF_INET, iface, &if_addr) != 1) || setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_IF, &if_addr, sizeof(if_addr))) {
+        fprintf(stderr, "Failed to set multicast interface %s\n", iface);
+        return(-1);
+      }
+    }
+
+  } else {
+    int yes = 1;
+    setsockopt(mcast_fd, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
+
+  }
+
+  return(mcast_fd);
+}
+
+void mcast_push(const struct dc_powermon_sample_t* sample) {
+  if(mcast_fd < 0) {
+    return;
+  }
+
+  memcpy(&batch.samples[batch.hdr.num], sample, sizeof(struct dc_powermon_sample_t));
+  batch.hdr.num++;
+  if((batch.hdr.num < MCAST_BATCH_MAX) && (sample->timestamp < batch.samples[0].timestamp + MCAST_BATCH_TIME_NS)) {
+    return;
+  }
+
+  // batch is complete, send it out
+  mcast_flush();
+}
+
+void mcast_push_marker(const struct dc_powermon_marker_t* marker) {
+  if(mcast_fd < 0) {
+    return;
+  }
+
+  // samples taken before the marker go out first, so that receivers get everything in order
+  mcast_flush();
+
+  // a lost marker shows up as a gap in the sequence numbers
+  memcpy(&marker_frame.marker, marker, sizeof(struct dc_powermon_marker_t));
+  marker_frame.hdr.num = 1;
+  (void)mcast_send(&marker_frame.hdr, DC_POWERMON_FRAME_MARKER, 0, sizeof(struct dc_powermon_marker_t));
+}
+
+void mcast_end(void) {
+  if(mcast_fd < 0) {
+    return;
+  }
+
+  // the last samples would never reach the receivers otherwise
+  mcast_flush();
+  close(mcast_fd);
+  mcast_fd = -1;
+}
+
+unsigned long mcast_dropped(void) {
+  return(dropped);
+}
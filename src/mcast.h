@@ -0,0 +1,22 @@
+#ifndef POWERMON_MCAST_H
+#define POWERMON_MCAST_H
+
+#include "dc-powermon-client/dc_powermon_cmds.h"
+
+// set up publishing to "<addr>:<port>", addr can be a multicast group or a broadcast address
+// iface is the address of the interface to send from, NULL for the default one
+int mcast_setup(const char* dest, const char* iface);
+
+// add a sample to the current batch, sending it out when full
+void mcast_push(const struct dc_powermon_sample_t* sample);
+
+// send out the current batch and then the marker
+void mcast_push_marker(const struct dc_powermon_marker_t* marker);
+
+// send out the incomplete batch and close the socket
+void mcast_end(void);
+
+// total number of samples that could not be sent
+unsigned long mcast_dropped(void);
+
+#endif
@@ -0,0 +1,78 @@
+#include "perf.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static const char* phase_names[PERF_NUM_PHASES] = { "read", "stats", "publish", "console", "control" };
+
+// only totals and maxima are kept, so that accounting a phase is just a few additions
+static struct perf_phase_t {
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+} phases[PERF_NUM_PHASES] = { 0 };
+
+static uint64_t hist[PERF_HIST_BUCKETS] = { 0 };
+static uint64_t last_sample = 0;
+
+static uint64_t report_interval = 0;
+static uint64_t report_next = 0;
+
+void perf_setup(int interval_s) {
+  report_interval = (uint64_t)interval_s * 1000000000ULL;
+  report_next = perf_now() + report_interval;
+}
+
+uint64_t perf_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+void perf_phase(enum perf_phase_e phase, uint64_t start, uint64_t end) {
+  struct perf_phase_t* p = &phases[phase];
+  uint64_t duration = end - start;
+  p->count++;
+  p->total += duration;
+  if(duration > p->max) {
+    p->max = duration;
+  }
+}
+
+void perf_sample(uint64_t timestamp) {
+  if(last_sample) {
+    // logarithmic buckets, the bucket is the index of the highest bit set
+    uint64_t interval = (timestamp - last_sample) / 1000ULL;
+    int bucket = interval ? 63 - __builtin_clzll(interval) : 0;
+    hist[(bucket < PERF_HIST_BUCKETS) ? bucket : PERF_HIST_BUCKETS - 1]++;
+  }
+  last_sample = timestamp;
+}
+
+int perf_format(char* buff, unsigned long missed) {
+  // average and maximum of each phase in us, then the interval histogram
+  int len = 0;
+  for(int i = 0; i < PERF_NUM_PHASES; i++) {
+    double avg = phases[i].count ? (double)phases[i].total / (double)phases[i].count / 1e3 : 0;
+    len += sprintf(&buff[len], "%s=%.1f/%.1f,", phase_names[i], avg, (double)phases[i].max / 1e3);
+  }
+  len += sprintf(&buff[len], "missed=%lu,hist=", missed);
+  for(int i = 0; i < PERF_HIST_BUCKETS; i++) {
+    len += sprintf(&buff[len], "%s%llu", i ? "/" : "", (unsigned long long)hist[i]);
+  }
+  return(len);
+}
+
+void perf_report(uint64_t now, unsigned long missed) {
+  if(!report_interval || (now < report_next)) {
+    return;
+  }
+
+  char buff[512];
+  perf_format(buff, missed);
+  fprintf(stderr, "\nperf: %s\n", buff);
+  report_next += report_interval;
+  if(report_next <= now) {
+    report_next = now + report_interval;
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef POWERMON_PERF_H
+#define POWERMON_PERF_H
+
+#include <stdint.h>
+
+// parts of a single acquisition loop iteration
+enum perf_phase_e {
+  PERF_PHASE_READ = 0,    // I2C register reads
+  PERF_PHASE_STATS,       // statistics and history update
+  PERF_PHASE_PUBLISH,     // stream, multicast and shared memory
+  PERF_PHASE_CONSOLE,     // console output
+  PERF_PHASE_CONTROL,     // control connections
+  PERF_NUM_PHASES,
+};
+
+// number of buckets in the histogram of sample intervals, bucket n counts intervals of 2^n us and up
+#define PERF_HIST_BUCKETS         21
+
+// print a summary every interval_s seconds, 0 to only collect
+void perf_setup(int interval_s);
+
+// get CLOCK_MONOTONIC_RAW in ns, cheap enough to call a few times for every sample
+uint64_t perf_now(void);
+
+// account time spent in a phase, start and end from perf_now
+void perf_phase(enum perf_phase_e phase, uint64_t start, uint64_t end);
+
+// account the interval to the previous sample
+void perf_sample(uint64_t timestamp);
+
+// format everything collected so far as a single line without linefeed, missed is the number of missed deadlines
+int perf_format(char* buff, unsigned long missed);
+
+// print the summary when it is due
+void perf_report(uint64_t now, unsigned long missed);
+
+#endif
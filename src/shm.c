@@ -0,0 +1,100 @@
+#include "shm.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static struct dc_powermon_shm_t* shm = NULL;
+static char shm_name[256] = { 0 };
+
+int shm_setup(const char* name) {
+  // POSIX shared memory names start with a slash
+  snprintf(shm_name, sizeof(shm_name), "%s%s", (name[0] == '/') ? "" : "/", name);
+
+  int fd = shm_open(shm_name, O_CREAT | O_RDWR, 0644);
+  if(fd < 0) {
+    fprintf(stderr, "Failed to open shared memory %s, errno %d.\n", shm_name, errno);
+    return(-1);
+  }
+
+  if(ftruncate(fd, sizeof(struct dc_powermon_shm_t)) != 0) {
+    fprintf(stderr, "Failed to resize shared memory, errno %d.\n", errno);
+    close(fd);
+    return(-1);
+  }
+
+  shm = mmap(NULL, sizeof(struct dc_powermon_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(shm == MAP_FAILED) {
+    fprintf(stderr, "Failed to map shared memory, errno %d.\n", errno);
+    shm = NULL;
+    return(-1);
+  }
+
+  // readers check the magic last, so it is only valid once everything else is
+  __atomic_store_n(&shm->magic, 0, __ATOMIC_RELEASE);
+  shm->version = DC_POWERMON_SHM_VERSION;
+  shm->ring_size = DC_POWERMON_SHM_RING_SIZE;
+  shm->sample_size = sizeof(struct dc_powermon_sample_t);
+  __atomic_store_n(&shm->stats_seq, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&shm->head, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&shm->marker_head, 0, __ATOMIC_RELAXED);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  shm->generation = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+  __atomic_store_n(&shm->pid, (int32_t)getpid(), __ATOMIC_RELAXED);
+  __atomic_store_n(&shm->magic, DC_POWERMON_SHM_MAGIC, __ATOMIC_RELEASE);
+  return(0);
+}
+
+void shm_end(void) {
+  if(!shm) {
+    return;
+  }
+
+  // readers that still have it mapped see that it is dead, even after it was unlinked
+  __atomic_store_n(&shm->magic, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&shm->pid, 0, __ATOMIC_RELEASE);
+  munmap(shm, sizeof(struct dc_powermon_shm_t));
+  shm_unlink(shm_name);
+  shm = NULL;
+}
+
+void shm_push(const struct dc_powermon_sample_t* sample) {
+  if(!shm) {
+    return;
+  }
+
+  // fill the slot first, then make it visible by moving the head
+  uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_RELAXED);
+  memcpy(&shm->ring[head & (DC_POWERMON_SHM_RING_SIZE - 1)], sample, sizeof(struct dc_powermon_sample_t));
+  __atomic_store_n(&shm->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void shm_push_marker(const struct dc_powermon_marker_t* marker) {
+  if(!shm) {
+    return;
+  }
+
+  uint64_t head = __atomic_load_n(&shm->marker_head, __ATOMIC_RELAXED);
+  memcpy(&shm->markers[head & (DC_POWERMON_SHM_MARKER_SIZE - 1)], marker, sizeof(struct dc_powermon_marker_t));
+  __atomic_store_n(&shm->marker_head, head + 1, __ATOMIC_RELEASE);
+}
+
+void shm_stats(const struct dc_powermon_shm_stats_t* stats) {
+  if(!shm) {
+    return;
+  }
+
+  uint64_t seq = __atomic_load_n(&shm->stats_seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&shm->stats_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&shm->stats, stats, sizeof(struct dc_powermon_shm_stats_t));
+  __atomic_store_n(&shm->stats_seq, seq + 2, __ATOMIC_RELEASE);
+}
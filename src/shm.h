@@ -0,0 +1,21 @@
+#ifndef POWERMON_SHM_H
+#define POWERMON_SHM_H
+
+#include "dc-powermon-client/dc_powermon_shm.h"
+
+// create and map the shared memory segment
+int shm_setup(const char* name);
+
+// remove the shared memory segment
+void shm_end(void);
+
+// publish a new sample to the ring
+void shm_push(const struct dc_powermon_sample_t* sample);
+
+// publish a new marker to the marker ring
+void shm_push_marker(const struct dc_powermon_marker_t* marker);
+
+// publish new statistics
+void shm_stats(const struct dc_powermon_shm_stats_t* stats);
+
+#endif
@@ -0,0 +1,267 @@
+#include "state.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+
+#define STATE_MAGIC               0x54535044UL  // "DPST"
+#define STATE_VERSION             1
+
+// a single checkpoint, it is complete when the checksum matches
+struct state_slot_t {
+  uint64_t seq;             // incremented for every checkpoint, 0 means never written
+  uint64_t saved;           // CLOCK_REALTIME in ns
+  struct state_t state;
+  uint64_t checksum;
+};
+
+// checkpoints alternate between the two slots, so one that is cut short by a crash or power loss
+// still leaves the previous one intact
+struct state_file_t {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_size;
+  uint32_t reserved;
+  struct state_slot_t slots[2];
+};
+
+static struct state_file_t* file = NULL;
+static uint64_t file_seq = 0;
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// latest checkpoint handed over by the acquisition loop, guarded by a seqlock
+static struct state_t snapshot = { 0 };
+static unsigned long snapshot_seq = 0;
+
+// the writer sleeps on the condition between checkpoints, so that stopping does not wait for the next one
+static pthread_t writer;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond;
+static bool running = false;
+static bool stopping = false;
+
+static uint64_t state_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static uint64_t state_checksum(const struct state_slot_t* slot) {
+  // FNV-1a of everything but the checksum itself
+  const uint8_t* ptr = (const uint8_t*)slot;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for(size_t i = 0; i < offsetof(struct state_slot_t, checksum); i++) {
+    hash ^= ptr[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return(hash);
+}
+
+static bool state_valid(const struct state_slot_t* slot) {
+  return(slot->seq && (slot->checksum == state_checksum(slot)));
+}
+
+static void state_write(const struct state_t* state) {
+  // checkpoint n always goes to slot n % 2, so this overwrites the older one
+  file_seq++;
+  struct state_slot_t* slot = &file->slots[file_seq % 2];
+  slot->seq = file_seq;
+  slot->saved = state_now();
+  memcpy(&slot->state, state, sizeof(struct state_t));
+  slot->checksum = state_checksum(slot);
+  if(msync(file, sizeof(struct state_file_t), MS_SYNC) != 0) {
+    fprintf(stderr, "Failed to write state file, errno %d.\n", errno);
+  }
+}
+
+static void state_read(struct state_t* state, unsigned long* seq) {
+  // retry until the acquisition loop was not updating the checkpoint while we copied it
+  unsigned long seq_before = 0;
+  unsigned long seq_after = 0;
+  do {
+    seq_before = __atomic_load_n(&snapshot_seq, __ATOMIC_ACQUIRE);
+    memcpy(state, &snapshot, sizeof(struct state_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    seq_after = __atomic_load_n(&snapshot_seq, __ATOMIC_RELAXED);
+  } while((seq_before & 1) || (seq_before != seq_after));
+  *seq = seq_before;
+}
+
+static void* state_writer(void* arg) {
+  (void)arg;
+
+  // syncing to the disk can take a while on an SD card, which is why it is done here and not in the acquisition loop
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  unsigned long written = 0;
+  for(;;) {
+    next.tv_sec += STATE_CHECKPOINT_NS / 1000000000ULL;
+    pthread_mutex_lock(&writer_lock);
+    while(!stopping && (pthread_cond_timedwait(&writer_cond, &writer_lock, &next) != ETIMEDOUT));
+    bool stop = stopping;
+    pthread_mutex_unlock(&writer_lock);
+    if(stop) {
+      break;
+    }
+
+    struct state_t state;
+    unsigned long seq = 0;
+    state_read(&state, &seq);
+    if(seq == written) {
+      continue;
+    }
+
+    pthread_mutex_lock(&file_lock);
+    if(file) {
+      state_write(&state);
+    }
+    pthread_mutex_unlock(&file_lock);
+    written = seq;
+  }
+
+  return(NULL);
+}
+
+static void state_new(struct state_t* state) {
+  memset(state, 0, sizeof(struct state_t));
+  if(getrandom(&state->session, sizeof(state->session), 0) != sizeof(state->session)) {
+    // not cryptographic anyway, it only has to differ between sessions
+    state->session = state_now() ^ ((uint64_t)getpid() << 32);
+  }
+  state->started = state_now();
+}
+
+int state_setup(const char* path, struct state_t* state) {
+  state_new(state);
+  if(!path) {
+    return(0);
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(fd < 0) {
+    fprintf(stderr, "Failed to open state file %s, errno %d.\n", path, errno);
+    return(-1);
+  }
+
+  // an empty file is a new session, anything else must be a state file of this version
+  struct stat st;
+  if(fstat(fd, &st) != 0) {
+    fprintf(stderr, "Failed to read state file %s, errno %d.\n", path, errno);
+    close(fd);
+    return(-1);
+  }
+  if(((size_t)st.st_size != 0) && ((size_t)st.st_size != sizeof(struct state_file_t))) {
+    fprintf(stderr, "State file %s has an unknown format\n", path);
+    close(fd);
+    return(-1);
+  }
+  if(ftruncate(fd, sizeof(struct state_file_t)) != 0) {
+    fprintf(stderr, "Failed to resize state file, errno %d.\n", errno);
+    close(fd);
+    return(-1);
+  }
+
+  file = mmap(NULL, sizeof(struct state_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(file == MAP_FAILED) {
+    fprintf(stderr, "Failed to map state file, errno %d.\n", errno);
+    file = NULL;
+    return(-1);
+  }
+
+  int restored = 0;
+  if(st.st_size == 0) {
+    file->magic = STATE_MAGIC;
+    file->version = STATE_VERSION;
+    file->slot_size = sizeof(struct state_slot_t);
+
+  } else if((file->magic != STATE_MAGIC) || (file->version != STATE_VERSION) || (file->slot_size != sizeof(struct state_slot_t))) {
+    fprintf(stderr, "State file %s has an unknown format\n", path);
+    munmap(file, sizeof(struct state_file_t));
+    file = NULL;
+    return(-1);
+
+  } else {
+    // the latest complete checkpoint wins
+    const struct state_slot_t* latest = NULL;
+    for(int i = 0; i < 2; i++) {
+      if(state_valid(&file->slots[i]) && (!latest || (file->slots[i].seq > latest->seq))) {
+        latest = &file->slots[i];
+      }
+    }
+    if(latest) {
+      memcpy(state, &latest->state, sizeof(struct state_t));
+      state->restores++;
+      file_seq = latest->seq;
+      restored = 1;
+    }
+
+  }
+
+  // the session is on disk right away, even if the daemon does not get to the first checkpoint
+  state_write(state);
+  memcpy(&snapshot, state, sizeof(struct state_t));
+  stopping = false;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&writer_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  // SIGINT and SIGTERM must interrupt the acquisition loop, so the writer inherits them blocked
+  sigset_t block, prev;
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &block, &prev);
+  int ret = pthread_create(&writer, NULL, state_writer, NULL);
+  pthread_sigmask(SIG_SETMASK, &prev, NULL);
+  if(ret != 0) {
+    fprintf(stderr, "Failed to start state writer, error %d.\n", ret);
+    pthread_cond_destroy(&writer_cond);
+    return(-1);
+  }
+  running = true;
+  return(restored);
+}
+
+void state_update(const struct state_t* state) {
+  unsigned long seq = __atomic_load_n(&snapshot_seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&snapshot_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&snapshot, state, sizeof(struct state_t));
+  __atomic_store_n(&snapshot_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void state_end(const struct state_t* state) {
+  // the writer may be in the middle of a checkpoint, the final one is written here
+  if(running) {
+    pthread_mutex_lock(&writer_lock);
+    stopping = true;
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_join(writer, NULL);
+    pthread_cond_destroy(&writer_cond);
+    running = false;
+  }
+
+  pthread_mutex_lock(&file_lock);
+  if(file) {
+    state_write(state);
+    munmap(file, sizeof(struct state_file_t));
+    file = NULL;
+  }
+  pthread_mutex_unlock(&file_lock);
+}
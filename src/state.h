@@ -0,0 +1,35 @@
+#ifndef POWERMON_STATE_H
+#define POWERMON_STATE_H
+
+#include <stdint.h>
+
+#include "energy.h"
+#include "dc-powermon-client/dc_powermon_cmds.h"
+
+// how often the acquisition loop hands over a checkpoint
+#define STATE_CHECKPOINT_NS       1000000000ULL
+
+// everything carried over to the next run
+struct state_t {
+  uint64_t session;         // random ID, stays the same across restarts
+  uint64_t started;         // CLOCK_REALTIME in ns when the session started
+  uint64_t restores;        // how often the session was restored
+  uint64_t count;
+  double min[DC_POWERMON_SAMPLE_NUM_VALS];
+  double max[DC_POWERMON_SAMPLE_NUM_VALS];
+  struct energy_point_t energy;
+};
+
+// map the state file and restore the latest complete checkpoint into state
+// returns 1 when a session was restored, 0 when a new one was started and -1 on failure
+// without a path, only a new session ID is created and nothing is saved
+// the writer thread inherits the scheduling of the caller, so this must be called before switching to real-time priority
+int state_setup(const char* path, struct state_t* state);
+
+// hand over a new checkpoint to be written, never blocks
+void state_update(const struct state_t* state);
+
+// write the final checkpoint and unmap the file
+void state_end(const struct state_t* state);
+
+#endif
@@ -0,0 +1,337 @@
+#include "stream.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+// size of the per-subscriber output queue, once it is full the subscriber is too slow
+#define STREAM_QUEUE_SIZE         65536
+
+// maximum number of samples in a single frame
+#define STREAM_BATCH_MAX          64
+
+// maximum time a sample may wait in an incomplete frame
+#define STREAM_BATCH_TIME_NS      20000000ULL
+
+// worst case length of a single CSV record
+#define STREAM_CSV_LINE_MAX       256
+
+enum stream_policy_e {
+  STREAM_POLICY_DROP = 0,
+  STREAM_POLICY_DISCONNECT,
+};
+
+static struct stream_client_t {
+  bool active;
+  int fd;
+  bool binary;
+  enum stream_policy_e policy;
+  uint8_t channels;
+
+  // decimation
+  uint64_t interval;
+  uint64_t next;
+
+  // frame being assembled
+  char batch[STREAM_BATCH_MAX * STREAM_CSV_LINE_MAX];
+  size_t batch_len;
+  uint8_t batch_type;
+  uint16_t batch_num;
+  uint64_t batch_start;
+  uint32_t seq;
+  uint32_t dropped;
+
+  // commands from the subscriber, until a complete line was received
+  char input[64];
+  size_t input_len;
+
+  // frames waiting to be sent
+  char queue[STREAM_QUEUE_SIZE];
+  size_t queue_pos;
+  size_t queue_len;
+} clients[STREAM_MAX_CLIENTS] = { 0 };
+
+// timestamp of the latest sample
+static uint64_t latest = 0;
+
+// samples and markers dropped for all subscribers so far
+static unsigned long dropped_total = 0;
+
+static void stream_close(struct stream_client_t* cl) {
+  close(cl->fd);
+  cl->active = false;
+}
+
+static void stream_flush(struct stream_client_t* cl) {
+  // send as much as the socket takes without blocking
+  while(cl->queue_pos < cl->queue_len) {
+    ssize_t sent = send(cl->fd, &cl->queue[cl->queue_pos], cl->queue_len - cl->queue_pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(sent < 0) {
+      if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+        return;
+      }
+      stream_close(cl);
+      return;
+    }
+    cl->queue_pos += sent;
+  }
+  cl->queue_pos = 0;
+  cl->queue_len = 0;
+}
+
+static void stream_batch_finish(struct stream_client_t* cl) {
+  if(!cl->batch_num) {
+    return;
+  }
+
+  if(cl->binary) {
+    struct dc_powermon_frame_hdr_t* hdr = (struct dc_powermon_frame_hdr_t*)cl->batch;
+    hdr->magic = DC_POWERMON_FRAME_MAGIC;
+    hdr->type = cl->batch_type;
+    hdr->channels = (cl->batch_type == DC_POWERMON_FRAME_SAMPLES) ? cl->channels : 0;
+    hdr->reserved = 0;
+    hdr->seq = cl->seq;
+    hdr->dropped = cl->dropped;
+    hdr->num = cl->batch_num;
+    hdr->len = cl->batch_len - sizeof(struct dc_powermon_frame_hdr_t);
+  }
+  cl->seq++;
+
+  // make room at the end of the queue, if possible
+  if((cl->queue_pos > 0) && (cl->queue_len + cl->batch_len > STREAM_QUEUE_SIZE)) {
+    memmove(cl->queue, &cl->queue[cl->queue_pos], cl->queue_len - cl->queue_pos);
+    cl->queue_len -= cl->queue_pos;
+    cl->queue_pos = 0;
+  }
+
+  if(cl->queue_len + cl->batch_len > STREAM_QUEUE_SIZE) {
+    // subscriber is not keeping up
+    if(cl->policy == STREAM_POLICY_DISCONNECT) {
+      fprintf(stderr, "stream subscriber too slow, disconnecting\n");
+      stream_close(cl);
+      return;
+    }
+    // a dropped marker counts like a dropped sample, the subscriber has to know it missed something
+    cl->dropped += cl->batch_num;
+    dropped_total += cl->batch_num;
+
+  } else {
+    memcpy(&cl->queue[cl->queue_len], cl->batch, cl->batch_len);
+    cl->queue_len += cl->batch_len;
+
+  }
+
+  cl->batch_num = 0;
+  cl->batch_len = cl->binary ? sizeof(struct dc_powermon_frame_hdr_t) : 0;
+  cl->batch_type = DC_POWERMON_FRAME_SAMPLES;
+}
+
+static void stream_batch_add(struct stream_client_t* cl, const struct dc_powermon_sample_t* sample) {
+  if(!cl->batch_num) {
+    cl->batch_start = sample->timestamp;
+  }
+
+  char* ptr = &cl->batch[cl->batch_len];
+  if(cl->binary) {
+    memcpy(ptr, &sample->timestamp, sizeof(sample->timestamp));
+    ptr += sizeof(sample->timestamp);
+    for(int i = 0; i < DC_POWERMON_SAMPLE_NUM_VALS; i++) {
+      if(cl->channels & (1UL << i)) {
+        memcpy(ptr, &sample->val[i], sizeof(sample->val[i]));
+        ptr += sizeof(sample->val[i]);
+      }
+    }
+
+  } else {
+    ptr += sprintf(ptr, "%llu.%09llu", (unsigned long long)(sample->timestamp / 1000000000ULL), (unsigned long long)(sample->timestamp % 1000000000ULL));
+    for(int i = 0; i < DC_POWERMON_SAMPLE_NUM_VALS; i++) {
+      if(cl->channels & (1UL << i)) {
+        ptr += sprintf(ptr, ",%.6f", (double)sample->val[i]);
+      }
+    }
+    ptr += sprintf(ptr, DC_POWERMON_RSP_LINEFEED);
+
+  }
+
+  cl->batch_len = ptr - cl->batch;
+  cl->batch_num++;
+  if(cl->batch_num >= STREAM_BATCH_MAX) {
+    stream_batch_finish(cl);
+  }
+}
+
+static bool stream_input(struct stream_client_t* cl, const char* data, size_t len) {
+  // the only thing a subscriber may send is a request to stop, returns true when it did
+  while(len > 0) {
+    size_t chunk = sizeof(cl->input) - cl->input_len;
+    if(chunk > len) {
+      chunk = len;
+    }
+    memcpy(&cl->input[cl->input_len], data, chunk);
+    cl->input_len += chunk;
+    data += chunk;
+    len -= chunk;
+
+    char* end = NULL;
+    while((end = memchr(cl->input, '\n', cl->input_len))) {
+      size_t line_len = end - cl->input + 1;
+      if((line_len == strlen(DC_POWERMON_CMD_STREAM_STOP)) && (memcmp(cl->input, DC_POWERMON_CMD_STREAM_STOP, line_len) == 0)) {
+        return(true);
+      }
+      cl->input_len -= line_len;
+      memmove(cl->input, &cl->input[line_len], cl->input_len);
+    }
+
+    // nothing this long is a valid command
+    if(cl->input_len == sizeof(cl->input)) {
+      cl->input_len = 0;
+    }
+  }
+  return(false);
+}
+
+bool stream_start(int fd, char* args, bool bin, const char* pending, size_t pending_len) {
+  struct stream_client_t* cl = NULL;
+  for(int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    if(!clients[i].active) {
+      cl = &clients[i];
+      break;
+    }
+  }
+  if(!cl || !args) {
+    return(false);
+  }
+
+  // parse "<rate>,<channels>[,<format>[,<policy>]]"
+  double rate = strtod(args, &args);
+  if((rate < 0) || (*args != ',')) {
+    return(false);
+  }
+  unsigned long channels = strtoul(args + 1, &args, 0);
+  if(!channels || (channels >= (1UL << DC_POWERMON_SAMPLE_NUM_VALS))) {
+    return(false);
+  }
+
+  memset(cl, 0, sizeof(struct stream_client_t));
+  cl->channels = channels;
+  cl->interval = (rate > 0) ? (uint64_t)(1e9 / rate) : 0;
+  if(*args == ',') {
+    args++;
+    cl->binary = (strstr(args, DC_POWERMON_STREAM_FMT_BIN) == args);
+    args = strchr(args, ',');
+    if(args && (strstr(args + 1, DC_POWERMON_STREAM_POLICY_DISC) == args + 1)) {
+      cl->policy = STREAM_POLICY_DISCONNECT;
+    }
+  }
+  cl->batch_len = cl->binary ? sizeof(struct dc_powermon_frame_hdr_t) : 0;
+  cl->batch_type = DC_POWERMON_FRAME_SAMPLES;
+
+  // from now on, all writes must be non-blocking so a slow reader can't stall acquisition
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  cl->active = true;
+  cl->fd = fd;
+  if(bin) {
+    // the client parses the acknowledgement like any other response on a binary connection
+    struct dc_powermon_rec_hdr_t hdr = {
+      .magic = DC_POWERMON_REC_MAGIC,
+      .type = DC_POWERMON_REC_TEXT,
+      .reserved = 0,
+      .len = 2,
+    };
+    memcpy(cl->queue, &hdr, sizeof(hdr));
+    memcpy(&cl->queue[sizeof(hdr)], "OK", 2);
+    cl->queue_len = sizeof(hdr) + 2;
+  } else {
+    memcpy(cl->queue, DC_POWERMON_RSP_OK, strlen(DC_POWERMON_RSP_OK));
+    cl->queue_len = strlen(DC_POWERMON_RSP_OK);
+  }
+  stream_flush(cl);
+
+  // a client may have sent the stop right behind the start
+  if(cl->active && stream_input(cl, pending, pending_len)) {
+    stream_close(cl);
+  }
+  return(true);
+}
+
+void stream_push(const struct dc_powermon_sample_t* sample) {
+  latest = sample->timestamp;
+  for(int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    struct stream_client_t* cl = &clients[i];
+    if(!cl->active) {
+      continue;
+    }
+
+    // per-subscriber decimation
+    if(sample->timestamp < cl->next) {
+      continue;
+    }
+    cl->next += cl->interval;
+    if(cl->next <= sample->timestamp) {
+      cl->next = sample->timestamp + cl->interval;
+    }
+
+    stream_batch_add(cl, sample);
+  }
+}
+
+void stream_push_marker(const struct dc_powermon_marker_t* marker) {
+  for(int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    struct stream_client_t* cl = &clients[i];
+    if(!cl->active) {
+      continue;
+    }
+
+    // markers are not decimated and go out in a frame of their own, right after the samples taken before them
+    stream_batch_finish(cl);
+    if(!cl->active) {
+      continue;
+    }
+    char* ptr = &cl->batch[cl->batch_len];
+    if(cl->binary) {
+      memcpy(ptr, marker, sizeof(struct dc_powermon_marker_t));
+      ptr += sizeof(struct dc_powermon_marker_t);
+    } else {
+      ptr += sprintf(ptr, "%llu.%09llu,MARK,\"%.*s\"" DC_POWERMON_RSP_LINEFEED, (unsigned long long)(marker->timestamp / 1000000000ULL),
+        (unsigned long long)(marker->timestamp % 1000000000ULL), DC_POWERMON_MARKER_LABEL_LEN - 1, marker->label);
+    }
+    cl->batch_len = ptr - cl->batch;
+    cl->batch_num = 1;
+    cl->batch_type = DC_POWERMON_FRAME_MARKER;
+    stream_batch_finish(cl);
+  }
+}
+
+void stream_poll(void) {
+  for(int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+    struct stream_client_t* cl = &clients[i];
+    if(!cl->active) {
+      continue;
+    }
+
+    char buff[64];
+    ssize_t len = recv(cl->fd, buff, sizeof(buff), MSG_DONTWAIT);
+    if((len == 0) || ((len > 0) && stream_input(cl, buff, len))) {
+      stream_close(cl);
+      continue;
+    }
+
+    // do not let a sample wait for too long in an incomplete batch
+    if(cl->batch_num && (latest >= cl->batch_start + STREAM_BATCH_TIME_NS)) {
+      stream_batch_finish(cl);
+    }
+
+    if(cl->active) {
+      stream_flush(cl);
+    }
+  }
+}
+
+unsigned long stream_dropped(void) {
+  return(dropped_total);
+}
@@ -0,0 +1,29 @@
+#ifndef POWERMON_STREAM_H
+#define POWERMON_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "dc-powermon-client/dc_powermon_cmds.h"
+
+// maximum number of simultaneous stream subscribers
+#define STREAM_MAX_CLIENTS        8
+
+// start streaming to a connection, on success the stream takes ownership of the socket
+// the acknowledgement follows the format of the connection (bin), the stream sends its own frames after it
+// pending is whatever the client sent after the start command, it is handled like anything received later
+bool stream_start(int fd, char* args, bool bin, const char* pending, size_t pending_len);
+
+// offer a new sample to all subscribers
+void stream_push(const struct dc_powermon_sample_t* sample);
+
+// send a marker to all subscribers, in order with the samples
+void stream_push_marker(const struct dc_powermon_marker_t* marker);
+
+// flush queued frames and handle subscribers that left
+void stream_poll(void);
+
+// total number of samples and markers dropped for slow subscribers
+unsigned long stream_dropped(void);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef POWERMON_TEST_H
+#define POWERMON_TEST_H
+
+#include <stdio.h>
+#include <math.h>
+
+// checks carry on after a failure, so that a single run reports all of them
+static int test_failures = 0;
+
+#define TEST_CHECK(cond) do { \
+  if(!(cond)) { \
+    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    test_failures++; \
+  } \
+} while(0)
+
+#define TEST_NEAR(val, expected, tol) do { \
+  double test_val = (double)(val); \
+  double test_exp = (double)(expected); \
+  if(!(fabs(test_val - test_exp) <= (double)(tol))) { \
+    fprintf(stderr, "%s:%d: check failed: %s is %g, expected %g\n", __FILE__, __LINE__, #val, test_val, test_exp); \
+    test_failures++; \
+  } \
+} while(0)
+
+static inline int test_result(void) {
+  if(test_failures) {
+    fprintf(stderr, "%d checks failed\n", test_failures);
+    return(1);
+  }
+  return(0);
+}
+
+#endif
@@ -0,0 +1,158 @@
+#include "test.h"
+#include "test_daemon.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <poll.h>
+
+// requests of a single batch, of every kind of response
+#define TEST_REQS                 60
+
+enum req_type_e {
+  REQ_VALUE = 0,
+  REQ_MEAS,
+  REQ_ENERGY,
+  REQ_BLOCK,
+};
+
+struct req_t {
+  enum req_type_e type;
+  const char* cmd;
+  int err;
+  bool done;
+  bool valid;
+};
+
+static struct req_t reqs[TEST_REQS];
+static int completed = 0;
+static int out_of_order = 0;
+
+static void req_cb(struct dc_powermon_t* dev, int err, const char* rsp, size_t len, void* user) {
+  (void)dev;
+  struct req_t* req = user;
+  out_of_order += (req != &reqs[completed]);
+  completed++;
+  req->done = true;
+  req->err = err;
+  if(err != DC_POWERMON_ERR_NONE) {
+    return;
+  }
+
+  char* end = NULL;
+  struct dc_powermon_meas_t meas;
+  switch(req->type) {
+    case REQ_VALUE:
+      req->valid = (strtof(rsp, &end) > 0) && (end == rsp + len);
+      break;
+    case REQ_MEAS:
+      req->valid = (dc_powermon_parse_meas(rsp, &meas) == 0) && (meas.count > 0);
+      break;
+    case REQ_ENERGY:
+      req->valid = (strchr(rsp, ',') != NULL) && (strlen(rsp) == len);
+      break;
+    case REQ_BLOCK:
+      req->valid = (len > 0) && ((len % sizeof(struct dc_powermon_sample_t)) == 0);
+      break;
+  }
+}
+
+static bool closed = false;
+
+static void close_cb(struct dc_powermon_t* dev, int err, const char* rsp, size_t len, void* user) {
+  // the first response closes the handle, the requests still pending fail while it is closed
+  req_cb(dev, err, rsp, len, user);
+  if(completed == 1) {
+    dc_powermon_close(dev);
+    closed = true;
+  }
+}
+
+static void submit_batch(struct dc_powermon_t* dev, dc_powermon_cb_t cb) {
+  memset(reqs, 0, sizeof(reqs));
+  completed = 0;
+  out_of_order = 0;
+  for(int i = 0; i < TEST_REQS; i++) {
+    struct req_t* req = &reqs[i];
+    if(i == TEST_REQS / 2) {
+      req->type = REQ_BLOCK;
+      req->cmd = DC_POWERMON_CMD_FETCH_DATA " 0,0" DC_POWERMON_CMD_LINEFEED;
+    } else if(i == 3) {
+      req->type = REQ_ENERGY;
+      req->cmd = DC_POWERMON_CMD_ENERGY_TOTAL;
+    } else {
+      req->type = (i % 2) ? REQ_MEAS : REQ_VALUE;
+      req->cmd = (i % 2) ? DC_POWERMON_CMD_MEAS_ALL : DC_POWERMON_CMD_READ_POWER;
+    }
+    TEST_CHECK(dc_powermon_async_submit(dev, req->cmd, cb, req) == DC_POWERMON_ERR_NONE);
+  }
+}
+
+static void run_loop(struct dc_powermon_t* dev) {
+  for(int i = 0; (i < 1000) && dc_powermon_async_pending(dev); i++) {
+    struct pollfd pfd = { .fd = dc_powermon_async_fd(dev), .events = dc_powermon_async_events(dev) };
+    poll(&pfd, 1, 10);
+    dc_powermon_async_process(dev);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  struct test_daemon_t daemon;
+  if((argc < 2) || !test_daemon_start(&daemon, argv[1])) {
+    fprintf(stderr, "Failed to start the daemon\n");
+    return(1);
+  }
+  struct dc_powermon_t* dev = dc_powermon_open_uri(daemon.uri);
+  float val = 0;
+  TEST_CHECK(dc_powermon_dev_read_power(dev, &val) == DC_POWERMON_ERR_NONE);
+
+  // only single commands that leave the connection as it is
+  TEST_CHECK(dc_powermon_async_submit(dev, DC_POWERMON_CMD_SYSTEM_EXIT, req_cb, NULL) != DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_async_submit(dev, DC_POWERMON_CMD_ID DC_POWERMON_CMD_MEAS_ALL, req_cb, NULL) != DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_async_submit(dev, "*IDN?", req_cb, NULL) != DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_async_pending(dev) == 0);
+
+  // responses of all kinds complete in the order they were submitted
+  submit_batch(dev, req_cb);
+  TEST_CHECK(dc_powermon_dev_read_power(dev, &val) != DC_POWERMON_ERR_NONE);
+  run_loop(dev);
+  TEST_CHECK(completed == TEST_REQS);
+  TEST_CHECK(out_of_order == 0);
+  for(int i = 0; i < TEST_REQS; i++) {
+    if((reqs[i].err != DC_POWERMON_ERR_NONE) || !reqs[i].valid) {
+      fprintf(stderr, "request %d (%.*s) err %d\n", i, (int)strcspn(reqs[i].cmd, "\n"), reqs[i].cmd, reqs[i].err);
+      test_failures++;
+    }
+  }
+
+  // cancelled requests fail in order as well, and the handle is usable again right away
+  submit_batch(dev, req_cb);
+  dc_powermon_async_cancel(dev);
+  TEST_CHECK(completed == TEST_REQS);
+  TEST_CHECK(out_of_order == 0);
+  TEST_CHECK(reqs[TEST_REQS - 1].err == DC_POWERMON_ERR_FAILED);
+  TEST_CHECK(dc_powermon_async_pending(dev) == 0);
+  TEST_CHECK(dc_powermon_dev_read_power(dev, &val) == DC_POWERMON_ERR_NONE);
+
+  dc_powermon_close(dev);
+
+  // a callback may close the handle, which is freed only once the dispatch that ran it returns
+  dev = dc_powermon_open_uri(daemon.uri);
+  submit_batch(dev, close_cb);
+  int fd = dc_powermon_async_fd(dev);
+  int ret = DC_POWERMON_ERR_NONE;
+  for(int i = 0; (i < 1000) && !closed; i++) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    poll(&pfd, 1, 10);
+    ret = dc_powermon_async_process(dev);
+  }
+  TEST_CHECK(closed);
+  TEST_CHECK(ret == DC_POWERMON_ERR_CLOSED);
+  TEST_CHECK(completed == TEST_REQS);
+  TEST_CHECK(out_of_order == 0);
+  TEST_CHECK(reqs[0].err == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(reqs[TEST_REQS - 1].err == DC_POWERMON_ERR_CLOSED);
+
+  TEST_CHECK(test_daemon_stop(&daemon));
+  return(test_result());
+}
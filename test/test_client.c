@@ -0,0 +1,499 @@
+#include "test.h"
+#include "test_daemon.h"
+#include "dc-powermon-client/dc_powermon_priv.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// default averaging window of the daemon, the average is only complete after that many samples
+#define TEST_WINDOW               128
+
+// large enough for the daemon's whole history
+#define TEST_HISTORY_MAX          65536
+
+static struct dc_powermon_sample_t history[TEST_HISTORY_MAX];
+static struct dc_powermon_sample_t range[TEST_HISTORY_MAX];
+
+// threads sharing handles
+#define TEST_THREADS              8
+#define TEST_CALLS                50
+
+static char shm_name[64];
+static char tcp_port[16];
+static const char* const daemon_args[] = { "--shm", "--shm_name", shm_name, "--control", tcp_port, NULL };
+
+static void test_sleep_ms(long ms) {
+  struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+  nanosleep(&ts, NULL);
+}
+
+static void test_meas(struct dc_powermon_t* dev) {
+  // the snapshot parser on a fixed response
+  struct dc_powermon_meas_t meas;
+  TEST_CHECK(dc_powermon_parse_meas("12.000000345,42,3.3,3.2,3.4,0.01,0,0.02,10,0,200,33,0,660", &meas) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK((meas.timestamp.tv_sec == 12) && (meas.timestamp.tv_nsec == 345));
+  TEST_CHECK(meas.count == 42);
+  TEST_NEAR(meas.ch[DC_POWERMON_CH_V_BUS].min, 3.2, 1e-6);
+  TEST_NEAR(meas.ch[DC_POWERMON_CH_I_SHUNT].max, 200, 1e-6);
+  TEST_NEAR(meas.ch[DC_POWERMON_CH_P_SHUNT].avg, 33, 1e-6);
+  TEST_CHECK(dc_powermon_parse_meas("12.5,42,3.3,3.2", &meas) == DC_POWERMON_ERR_RESPONSE);
+  TEST_CHECK(dc_powermon_parse_meas("ERR", &meas) == DC_POWERMON_ERR_RESPONSE);
+
+  // a snapshot from the daemon, every channel with consistent statistics once the averaging window filled up
+  for(int i = 0; i < 100; i++) {
+    TEST_CHECK(dc_powermon_dev_read_all(dev, &meas) == DC_POWERMON_ERR_NONE);
+    if(meas.count >= TEST_WINDOW) {
+      break;
+    }
+    test_sleep_ms(10);
+  }
+  TEST_CHECK(meas.count >= TEST_WINDOW);
+  TEST_CHECK((meas.timestamp.tv_sec > 0) || (meas.timestamp.tv_nsec > 0));
+  for(int i = 0; i < DC_POWERMON_NUM_CHANNELS; i++) {
+    TEST_CHECK((meas.ch[i].min <= meas.ch[i].avg) && (meas.ch[i].avg <= meas.ch[i].max));
+  }
+  TEST_NEAR(meas.ch[DC_POWERMON_CH_V_BUS].avg, 3.3, 0.1);
+
+  // the text response parses to the same kind of snapshot
+  char rsp[256];
+  struct dc_powermon_meas_t text;
+  TEST_CHECK(dc_powermon_dev_query(dev, DC_POWERMON_CMD_MEAS_ALL, rsp, sizeof(rsp), DC_POWERMON_TIMEOUT_DEFAULT) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_parse_meas(rsp, &text) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(text.count >= meas.count);
+  TEST_NEAR(text.ch[DC_POWERMON_CH_V_BUS].avg, 3.3, 0.1);
+}
+
+static void test_fetch_data(struct dc_powermon_t* dev) {
+  // everything the daemon has, a fixed range of it is the same samples every time
+  test_sleep_ms(100);
+  size_t num = 0;
+  TEST_CHECK(dc_powermon_dev_fetch_data(dev, 0, 0, history, TEST_HISTORY_MAX, &num) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(num > 100);
+  if(num <= 100) {
+    return;
+  }
+  TEST_NEAR(history[num - 1].val[DC_POWERMON_CH_V_BUS], 3.3, 0.1);
+
+  // start and stop are both included
+  size_t first = num / 4;
+  size_t last = num / 2;
+  size_t len = 0;
+  TEST_CHECK(dc_powermon_dev_fetch_data(dev, history[first].timestamp, history[last].timestamp, range, TEST_HISTORY_MAX, &len) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(len == last - first + 1);
+  TEST_CHECK((len == last - first + 1) && !memcmp(range, &history[first], len * sizeof(struct dc_powermon_sample_t)));
+
+  // a range that lies in between two samples or after the last one is empty
+  TEST_CHECK(dc_powermon_dev_fetch_data(dev, history[first].timestamp + 1, history[first + 1].timestamp - 1, range, TEST_HISTORY_MAX, &len) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(len == 0);
+  TEST_CHECK(dc_powermon_dev_fetch_data(dev, UINT64_MAX - 1, UINT64_MAX, range, TEST_HISTORY_MAX, &len) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(len == 0);
+
+  // the connection is still in sync after the blocks
+  struct dc_powermon_meas_t meas;
+  TEST_CHECK(dc_powermon_dev_read_all(dev, &meas) == DC_POWERMON_ERR_NONE);
+}
+
+static uint64_t test_clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static void test_timestamps(struct dc_powermon_t* dev) {
+  // every sample is later than the one before, on the raw monotonic clock of this machine
+  size_t num = 0;
+  TEST_CHECK(dc_powermon_dev_fetch_data(dev, 0, 0, history, TEST_HISTORY_MAX, &num) == DC_POWERMON_ERR_NONE);
+  uint64_t now = test_clock_ns(CLOCK_MONOTONIC_RAW);
+  TEST_CHECK(num > 0);
+  if(!num) {
+    return;
+  }
+  size_t unordered = 0;
+  for(size_t i = 1; i < num; i++) {
+    unordered += (history[i].timestamp <= history[i - 1].timestamp);
+  }
+  TEST_CHECK(unordered == 0);
+  TEST_CHECK((history[num - 1].timestamp <= now) && (now - history[num - 1].timestamp < 1000000000ULL));
+
+  // the next block carries on from where the last one ended
+  uint64_t last = history[num - 1].timestamp;
+  test_sleep_ms(10);
+  TEST_CHECK(dc_powermon_dev_fetch_data(dev, last + 1, 0, history, TEST_HISTORY_MAX, &num) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK((num > 0) && (history[0].timestamp > last));
+  if(!num) {
+    return;
+  }
+
+  // with the offset, they are on the wall clock
+  int64_t offset = 0;
+  TEST_CHECK(dc_powermon_dev_clock_offset(dev, &offset) == DC_POWERMON_ERR_NONE);
+  TEST_NEAR((double)(int64_t)(history[num - 1].timestamp + offset - test_clock_ns(CLOCK_REALTIME)) / 1e9, 0, 1);
+}
+
+static double test_cpu_s(pid_t pid) {
+  // user and system time, fields 14 and 15 of /proc/<pid>/stat after the command name in parentheses
+  char path[64];
+  char buff[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  FILE* fp = fopen(path, "r");
+  if(!fp) {
+    return(-1);
+  }
+  size_t len = fread(buff, 1, sizeof(buff) - 1, fp);
+  fclose(fp);
+  buff[len] = '\0';
+  const char* ptr = strrchr(buff, ')');
+  unsigned long utime = 0;
+  unsigned long stime = 0;
+  if(!ptr || (sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)) {
+    return(-1);
+  }
+  return((double)(utime + stime) / (double)sysconf(_SC_CLK_TCK));
+}
+
+static void test_rate(struct test_daemon_t* daemon, const char* exe) {
+  // the same daemon, sampling at a fixed rate
+  TEST_CHECK(test_daemon_stop(daemon));
+  const char* args[] = { "--rate", "1000", NULL };
+  if(!test_daemon_start_args(daemon, exe, args)) {
+    fprintf(stderr, "Failed to start the daemon\n");
+    test_failures++;
+    return;
+  }
+  struct dc_powermon_t* dev = dc_powermon_open_uri(daemon->uri);
+  uint64_t start = test_clock_ns(CLOCK_MONOTONIC_RAW);
+  double cpu = test_cpu_s(daemon->pid);
+  test_sleep_ms(500);
+  double busy = (test_cpu_s(daemon->pid) - cpu) / 0.5;
+
+  // samples are a period apart, and it sleeps in between instead of spinning
+  // a loaded machine may make it skip periods, but never sample more often
+  size_t num = 0;
+  TEST_CHECK(dc_powermon_dev_fetch_data(dev, start, 0, history, TEST_HISTORY_MAX, &num) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK((num > 100) && (num < 600));
+  size_t near = 0;
+  for(size_t i = 1; i < num; i++) {
+    uint64_t interval = history[i].timestamp - history[i - 1].timestamp;
+    near += (interval > 800000ULL) && (interval < 1200000ULL);
+  }
+  TEST_CHECK(near > num / 2);
+  TEST_CHECK((cpu >= 0) && (busy < 0.5));
+
+  char rsp[128];
+  TEST_CHECK(dc_powermon_dev_query(dev, DC_POWERMON_CMD_JITTER, rsp, sizeof(rsp), DC_POWERMON_TIMEOUT_DEFAULT) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(strtoul(rsp, NULL, 10) >= num);
+  dc_powermon_close(dev);
+}
+
+static void test_reconnect(struct dc_powermon_t* dev, struct test_daemon_t* daemon, const char* exe) {
+  // the handle stays open while the daemon restarts, the next query connects again
+  float val = 0;
+  TEST_CHECK(dc_powermon_dev_read_power(dev, &val) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(test_daemon_stop(daemon));
+  TEST_CHECK(dc_powermon_dev_read_power(dev, &val) == DC_POWERMON_ERR_CONNECT);
+  TEST_CHECK(test_daemon_start_args(daemon, exe, daemon_args));
+  TEST_CHECK(dc_powermon_dev_read_power(dev, &val) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(val > 0);
+
+  // a restart between two queries is not noticed at all
+  TEST_CHECK(test_daemon_stop(daemon));
+  TEST_CHECK(test_daemon_start_args(daemon, exe, daemon_args));
+  char id[256];
+  TEST_CHECK(dc_powermon_dev_id(dev, id) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(strlen(id) > 0);
+}
+
+static void test_markers(struct dc_powermon_t* dev) {
+  // markers are timestamped on the samples' clock, in the order they were set
+  uint64_t first = 0;
+  uint64_t second = 0;
+  TEST_CHECK(dc_powermon_dev_mark(dev, "tx start", &first) == DC_POWERMON_ERR_NONE);
+  test_sleep_ms(10);
+  TEST_CHECK(dc_powermon_dev_mark(dev, "tx end", &second) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(second > first);
+  size_t num = 0;
+  TEST_CHECK(dc_powermon_dev_fetch_data(dev, first, second, history, TEST_HISTORY_MAX, &num) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK((num > 0) && (history[0].timestamp >= first) && (history[num - 1].timestamp <= second));
+
+  // start and stop of the range are both included
+  struct dc_powermon_marker_t markers[16];
+  TEST_CHECK(dc_powermon_dev_fetch_markers(dev, first, second, markers, 16, &num) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(num == 2);
+  if(num == 2) {
+    TEST_CHECK((markers[0].timestamp == first) && (strcmp(markers[0].label, "tx start") == 0));
+    TEST_CHECK((markers[1].timestamp == second) && (strcmp(markers[1].label, "tx end") == 0));
+  }
+  TEST_CHECK(dc_powermon_dev_fetch_markers(dev, first + 1, 0, markers, 16, &num) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK((num == 1) && (strcmp(markers[0].label, "tx end") == 0));
+  TEST_CHECK(dc_powermon_dev_fetch_markers(dev, second + 1, 0, markers, 16, &num) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(num == 0);
+
+  // labels that can't be sent in quotes are refused before anything is sent
+  char label[DC_POWERMON_MARKER_LABEL_LEN + 1];
+  memset(label, 'x', sizeof(label) - 1);
+  label[sizeof(label) - 1] = '\0';
+  TEST_CHECK(dc_powermon_dev_mark(dev, "say \"hi\"", NULL) == DC_POWERMON_ERR_FAILED);
+  TEST_CHECK(dc_powermon_dev_mark(dev, "two\nlines", NULL) == DC_POWERMON_ERR_FAILED);
+  TEST_CHECK(dc_powermon_dev_mark(dev, label, NULL) == DC_POWERMON_ERR_FAILED);
+
+  // the daemon truncates long labels it gets from elsewhere
+  char cmd[2 * DC_POWERMON_MARKER_LABEL_LEN];
+  char rsp[64];
+  snprintf(cmd, sizeof(cmd), DC_POWERMON_CMD_MARK " \"%s\"" DC_POWERMON_CMD_LINEFEED, label);
+  TEST_CHECK(dc_powermon_dev_query(dev, cmd, rsp, sizeof(rsp), DC_POWERMON_TIMEOUT_DEFAULT) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_dev_fetch_markers(dev, second + 1, 0, markers, 16, &num) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK((num == 1) && (strlen(markers[0].label) == DC_POWERMON_MARKER_LABEL_LEN - 1));
+}
+
+static void test_transports(const char* uri) {
+  // the same daemon over its Unix socket and its shared memory segment
+  struct dc_powermon_t* sock = dc_powermon_open_uri(uri);
+  char shm_uri[96];
+  snprintf(shm_uri, sizeof(shm_uri), DC_POWERMON_URI_SHM "%s", shm_name);
+  struct dc_powermon_t* shm = dc_powermon_open_uri(shm_uri);
+  TEST_CHECK(sock && shm);
+  if(!sock || !shm) {
+    dc_powermon_close(sock);
+    dc_powermon_close(shm);
+    return;
+  }
+
+  char id[256];
+  char shm_id[256];
+  TEST_CHECK(dc_powermon_dev_id(sock, id) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_dev_id(shm, shm_id) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(strlen(shm_id) > 0);
+
+  struct dc_powermon_meas_t meas;
+  float val = 0;
+  TEST_CHECK(dc_powermon_dev_read_all(shm, &meas) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(meas.count > 0);
+  TEST_NEAR(meas.ch[DC_POWERMON_CH_V_BUS].avg, 3.3, 0.1);
+  TEST_CHECK((dc_powermon_dev_read_vbus(shm, &val) == DC_POWERMON_ERR_NONE) && (val > 3));
+
+  // a range of the history is the same samples through either
+  size_t num = 0;
+  TEST_CHECK(dc_powermon_dev_fetch_data(sock, 0, 0, history, TEST_HISTORY_MAX, &num) == DC_POWERMON_ERR_NONE);
+  if(num > 10) {
+    size_t len = 0;
+    TEST_CHECK(dc_powermon_dev_fetch_data(shm, history[num - 10].timestamp, history[num - 1].timestamp, range, TEST_HISTORY_MAX, &len) == DC_POWERMON_ERR_NONE);
+    TEST_CHECK((len == 10) && !memcmp(range, &history[num - 10], len * sizeof(struct dc_powermon_sample_t)));
+  }
+
+  // markers set over the socket show up in the segment
+  uint64_t timestamp = 0;
+  TEST_CHECK(dc_powermon_dev_mark(sock, "transport", &timestamp) == DC_POWERMON_ERR_NONE);
+  struct dc_powermon_marker_t marker;
+  TEST_CHECK(dc_powermon_dev_fetch_markers(shm, timestamp, timestamp, &marker, 1, &num) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK((num == 1) && (strcmp(marker.label, "transport") == 0));
+
+  // there is no socket to stream from or to drive asynchronously
+  TEST_CHECK(dc_powermon_stream_start(shm, 0, 15, NULL, NULL) == NULL);
+  TEST_CHECK(dc_powermon_async_submit(shm, DC_POWERMON_CMD_READ_POWER, NULL, NULL) != DC_POWERMON_ERR_NONE);
+  dc_powermon_close(shm);
+  dc_powermon_close(sock);
+
+  // a segment that does not exist is like a server that does not answer
+  shm = dc_powermon_open_uri(DC_POWERMON_URI_SHM "dc-powermon-test-nonexistent");
+  TEST_CHECK((shm == NULL) || (dc_powermon_dev_read_power(shm, &val) == DC_POWERMON_ERR_CONNECT));
+  dc_powermon_close(shm);
+}
+
+static void test_formats(const char* uri) {
+  // one handle in each format, the results are the same
+  struct dc_powermon_t* bin = dc_powermon_open_uri(uri);
+  struct dc_powermon_t* asc = dc_powermon_open_uri(uri);
+  char id[256];
+  char asc_id[256];
+  TEST_CHECK(dc_powermon_dev_id(bin, id) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_dev_id(asc, asc_id) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_priv_set_binary(asc, false, NULL) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(bin->binary && !asc->binary);
+  TEST_CHECK(strcmp(id, asc_id) == 0);
+
+  // history and markers are sent the same way in both, only the framing differs
+  uint64_t timestamp = 0;
+  TEST_CHECK(dc_powermon_dev_mark(asc, "format", &timestamp) == DC_POWERMON_ERR_NONE);
+  test_sleep_ms(10);
+  size_t num = 0;
+  size_t len = 0;
+  TEST_CHECK(dc_powermon_dev_fetch_data(bin, 0, timestamp, history, TEST_HISTORY_MAX, &num) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_dev_fetch_data(asc, 0, timestamp, range, TEST_HISTORY_MAX, &len) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK((num > 0) && (len == num) && !memcmp(history, range, num * sizeof(struct dc_powermon_sample_t)));
+  struct dc_powermon_marker_t markers[2][16];
+  TEST_CHECK(dc_powermon_dev_fetch_markers(bin, 0, 0, markers[0], 16, &num) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_dev_fetch_markers(asc, 0, 0, markers[1], 16, &len) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK((num > 0) && (len == num) && !memcmp(markers[0], markers[1], num * sizeof(struct dc_powermon_marker_t)));
+
+  struct dc_powermon_session_t session[2];
+  TEST_CHECK(dc_powermon_dev_session(bin, &session[0]) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_dev_session(asc, &session[1]) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK((session[0].id == session[1].id) && (session[0].restores == session[1].restores));
+  TEST_CHECK((session[0].started.tv_sec == session[1].started.tv_sec) && (session[0].started.tv_nsec == session[1].started.tv_nsec));
+
+  // measurements keep changing, the text ones are rounded as well
+  struct dc_powermon_meas_t meas[2];
+  TEST_CHECK(dc_powermon_dev_read_all(bin, &meas[0]) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_dev_read_all(asc, &meas[1]) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(meas[1].count >= meas[0].count);
+  TEST_NEAR(meas[0].ch[DC_POWERMON_CH_V_BUS].avg, meas[1].ch[DC_POWERMON_CH_V_BUS].avg, 0.01);
+  char rsp[2][256];
+  TEST_CHECK(dc_powermon_dev_query(bin, DC_POWERMON_CMD_MEAS_ALL, rsp[0], sizeof(rsp[0]), DC_POWERMON_TIMEOUT_DEFAULT) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_dev_query(asc, DC_POWERMON_CMD_MEAS_ALL, rsp[1], sizeof(rsp[1]), DC_POWERMON_TIMEOUT_DEFAULT) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK((dc_powermon_parse_meas(rsp[0], &meas[0]) == DC_POWERMON_ERR_NONE) && (dc_powermon_parse_meas(rsp[1], &meas[1]) == DC_POWERMON_ERR_NONE));
+  TEST_NEAR(meas[0].ch[DC_POWERMON_CH_V_BUS].avg, meas[1].ch[DC_POWERMON_CH_V_BUS].avg, 0.01);
+  float val[2] = { 0, 0 };
+  TEST_CHECK(dc_powermon_dev_read_vbus(bin, &val[0]) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_dev_read_vbus(asc, &val[1]) == DC_POWERMON_ERR_NONE);
+  TEST_NEAR(val[0], val[1], 0.01);
+  int64_t offset[2] = { 0, 0 };
+  TEST_CHECK(dc_powermon_dev_clock_offset(bin, &offset[0]) == DC_POWERMON_ERR_NONE);
+  TEST_CHECK(dc_powermon_dev_clock_offset(asc, &offset[1]) == DC_POWERMON_ERR_NONE);
+  TEST_NEAR(offset[0], offset[1], 1e6);
+
+  dc_powermon_close(bin);
+  dc_powermon_close(asc);
+}
+
+static int failures = 0;
+
+static void* shared_worker(void* arg) {
+  struct dc_powermon_t* dev = arg;
+  for(int i = 0; i < TEST_CALLS; i++) {
+    float val = 0;
+    if((dc_powermon_dev_read_power(dev, &val) != DC_POWERMON_ERR_NONE) || !(val > 0)) {
+      __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return(NULL);
+}
+
+static void* default_worker(void* arg) {
+  // every thread sets up the default handle for the same server, then uses it
+  (void)arg;
+  int port = atoi(tcp_port);
+  for(int i = 0; i < TEST_CALLS; i++) {
+    float val = 0;
+    if((dc_powermon_init_socket("localhost", port) != 0) || (dc_powermon_read_power(&val) != DC_POWERMON_ERR_NONE) || !(val > 0)) {
+      __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return(NULL);
+}
+
+static void run_threads(void* (*worker)(void*), void* arg) {
+  pthread_t threads[TEST_THREADS];
+  for(int i = 0; i < TEST_THREADS; i++) {
+    pthread_create(&threads[i], NULL, worker, arg);
+  }
+  for(int i = 0; i < TEST_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+static void test_tcp(void) {
+  // the server name is resolved once, by any of the ways to write it
+  int port = atoi(tcp_port);
+  char uri[64];
+  float val = 0;
+  struct dc_powermon_t* dev = dc_powermon_open("localhost", port);
+  TEST_CHECK(dev != NULL);
+  TEST_CHECK(dc_powermon_dev_read_power(dev, &val) == DC_POWERMON_ERR_NONE);
+  dc_powermon_close(dev);
+  snprintf(uri, sizeof(uri), DC_POWERMON_URI_TCP "127.0.0.1:%d", port);
+  dev = dc_powermon_open_uri(uri);
+  TEST_CHECK(dc_powermon_dev_read_power(dev, &val) == DC_POWERMON_ERR_NONE);
+  dc_powermon_close(dev);
+  if(access("/proc/net/if_inet6", F_OK) == 0) {
+    // the daemon's socket is dual-stack where the kernel has IPv6
+    snprintf(uri, sizeof(uri), DC_POWERMON_URI_TCP "[::1]:%d", port);
+    dev = dc_powermon_open_uri(uri);
+    TEST_CHECK(dc_powermon_dev_read_power(dev, &val) == DC_POWERMON_ERR_NONE);
+    dc_powermon_close(dev);
+  }
+
+  // a single handle shared by threads, the queries do not get mixed up
+  snprintf(uri, sizeof(uri), DC_POWERMON_URI_TCP "localhost:%d", port);
+  dev = dc_powermon_open_uri(uri);
+  TEST_CHECK(dev != NULL);
+  failures = 0;
+  run_threads(shared_worker, dev);
+  TEST_CHECK(failures == 0);
+  dc_powermon_close(dev);
+
+  // and the default handle, set up concurrently
+  run_threads(default_worker, NULL);
+  TEST_CHECK(failures == 0);
+}
+
+static long test_elapsed_ms(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return((now.tv_sec - start->tv_sec) * 1000L + (now.tv_nsec - start->tv_nsec) / 1000000L);
+}
+
+static void test_stalled(void) {
+  // a server that takes connections into its backlog, but never accepts or answers them
+  char path[96];
+  snprintf(path, sizeof(path), "/tmp/dc-powermon-test-stalled-%d.sock", (int)getpid());
+  unlink(path);
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  TEST_CHECK(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+  TEST_CHECK(listen(fd, 10) == 0);
+
+  // the query gives up once the handle's timeout passed
+  char uri[128];
+  snprintf(uri, sizeof(uri), DC_POWERMON_URI_UNIX "%s", path);
+  struct dc_powermon_t* dev = dc_powermon_open_uri(uri);
+  dc_powermon_dev_set_timeout(dev, 200);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  float val = 0;
+  TEST_CHECK(dc_powermon_dev_read_power(dev, &val) == DC_POWERMON_ERR_TIMEOUT);
+  long elapsed = test_elapsed_ms(&start);
+  TEST_CHECK((elapsed >= 190) && (elapsed < 1000));
+
+  // and so does one with a timeout of its own
+  char rsp[64];
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  TEST_CHECK(dc_powermon_dev_query(dev, DC_POWERMON_CMD_READ_POWER, rsp, sizeof(rsp), 100) == DC_POWERMON_ERR_TIMEOUT);
+  elapsed = test_elapsed_ms(&start);
+  TEST_CHECK((elapsed >= 90) && (elapsed < 1000));
+
+  dc_powermon_close(dev);
+  close(fd);
+  unlink(path);
+}
+
+int main(int argc, char* argv[]) {
+  // the daemon also publishes in shared memory, under a name of its own so that tests can run in parallel
+  snprintf(shm_name, sizeof(shm_name), "dc-powermon-test-%d", (int)getpid());
+  snprintf(tcp_port, sizeof(tcp_port), "%d", 20000 + (int)getpid() % 20000);
+  struct test_daemon_t daemon;
+  if((argc < 2) || !test_daemon_start_args(&daemon, argv[1], daemon_args)) {
+    fprintf(stderr, "Failed to start the daemon\n");
+    return(1);
+  }
+  struct dc_powermon_t* dev = dc_powermon_open_uri(daemon.uri);
+
+  test_meas(dev);
+  test_fetch_data(dev);
+  test_timestamps(dev);
+  test_markers(dev);
+  test_transports(daemon.uri);
+  test_tcp();
+  test_formats(daemon.uri);
+  test_reconnect(dev, &daemon, argv[1]);
+  test_stalled();
+  test_rate(&daemon, argv[1]);
+
+  dc_powermon_close(dev);
+  TEST_CHECK(test_daemon_stop(&daemon));
+  return(test_result());
+}
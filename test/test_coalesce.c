@@ -0,0 +1,99 @@
+#include "test.h"
+#include "test_daemon.h"
+#include "dc-powermon-client/dc_powermon_priv.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#define TEST_THREADS              8
+#define TEST_CALLS                50
+#define TEST_MARKERS_MAX          1024
+
+static struct dc_powermon_t* dev = NULL;
+static cb_write_t write_orig = NULL;
+
+// commands that actually went out to the daemon
+static int sent_power = 0;
+static int sent_mark = 0;
+
+static int write_count(struct dc_powermon_t* d, const char* buff, size_t len, const struct timespec* deadline) {
+  // called with the handle locked
+  if((len >= strlen(DC_POWERMON_CMD_READ_POWER)) && !memcmp(buff, DC_POWERMON_CMD_READ_POWER, strlen(DC_POWERMON_CMD_READ_POWER))) {
+    sent_power++;
+  } else if((len >= strlen(DC_POWERMON_CMD_MARK)) && !memcmp(buff, DC_POWERMON_CMD_MARK, strlen(DC_POWERMON_CMD_MARK))) {
+    sent_mark++;
+  }
+  return(write_orig(d, buff, len, deadline));
+}
+
+static int failures = 0;
+
+static void* read_worker(void* arg) {
+  (void)arg;
+  for(int i = 0; i < TEST_CALLS; i++) {
+    float val = 0;
+    if((dc_powermon_dev_read_power(dev, &val) != DC_POWERMON_ERR_NONE) || !(val > 0)) {
+      __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return(NULL);
+}
+
+static void* mark_worker(void* arg) {
+  (void)arg;
+  if(dc_powermon_dev_mark(dev, "coalesce", NULL) != DC_POWERMON_ERR_NONE) {
+    __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+  }
+  return(NULL);
+}
+
+static void run_threads(void* (*worker)(void*)) {
+  pthread_t threads[TEST_THREADS];
+  for(int i = 0; i < TEST_THREADS; i++) {
+    pthread_create(&threads[i], NULL, worker, NULL);
+  }
+  for(int i = 0; i < TEST_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  struct test_daemon_t daemon;
+  if((argc < 2) || !test_daemon_start(&daemon, argv[1])) {
+    fprintf(stderr, "Failed to start the daemon\n");
+    return(1);
+  }
+  dev = dc_powermon_open_uri(daemon.uri);
+  write_orig = dev->cb_write;
+  dev->cb_write = write_count;
+
+  // within the window, every thread gets the result of the first query
+  dc_powermon_dev_set_coalesce(dev, 60000);
+  run_threads(read_worker);
+  TEST_CHECK(failures == 0);
+  TEST_CHECK(sent_power == 1);
+
+  // markers change the daemon's state, so every one of them is sent
+  run_threads(mark_worker);
+  TEST_CHECK(failures == 0);
+  TEST_CHECK(sent_mark == TEST_THREADS);
+  static struct dc_powermon_marker_t markers[TEST_MARKERS_MAX];
+  size_t num = 0;
+  TEST_CHECK(dc_powermon_dev_fetch_markers(dev, 0, 0, markers, sizeof(markers) / sizeof(markers[0]), &num) == DC_POWERMON_ERR_NONE);
+  size_t found = 0;
+  for(size_t i = 0; i < num; i++) {
+    found += (strcmp(markers[i].label, "coalesce") == 0);
+  }
+  TEST_CHECK(found == TEST_THREADS);
+
+  // changing the window drops the cached results, disabling it sends every query
+  sent_power = 0;
+  dc_powermon_dev_set_coalesce(dev, -1);
+  run_threads(read_worker);
+  TEST_CHECK(failures == 0);
+  TEST_CHECK(sent_power == TEST_THREADS * TEST_CALLS);
+
+  dc_powermon_close(dev);
+  TEST_CHECK(test_daemon_stop(&daemon));
+  return(test_result());
+}
@@ -0,0 +1,88 @@
+#include "test.h"
+
+// the renderer's view of the statistics is internal to the console
+#include "console.c"
+
+// number of updates published while the reader is running
+#define TEST_UPDATES              1000000
+
+// updates per sparkline column
+#define TEST_PER_COLUMN           4
+
+static bool done = false;
+
+static void* writer(void* arg) {
+  // every field of update k is k, and each one adds 1 mA to the sparkline
+  (void)arg;
+  struct console_stats_t stats = { 0 };
+  for(unsigned long k = TEST_PER_COLUMN; k < TEST_UPDATES + TEST_PER_COLUMN; k++) {
+    stats.count = k;
+    for(int i = 0; i < DC_POWERMON_SAMPLE_NUM_VALS; i++) {
+      stats.avg[i] = (double)k;
+      stats.min[i] = (double)k;
+      stats.max[i] = (double)k;
+      stats.std[i] = (double)k;
+    }
+    stats.timestamp = k * (CONSOLE_SPARK_COLUMN_NS / TEST_PER_COLUMN);
+    stats.current = 1.0;
+    stats.overruns = k;
+    console_update(&stats);
+  }
+  __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+  return(NULL);
+}
+
+static bool stats_consistent(const struct console_stats_t* stats, const struct spark_t* columns) {
+  if(!stats->count) {
+    return(true);
+  }
+  for(int i = 0; i < DC_POWERMON_SAMPLE_NUM_VALS; i++) {
+    if((stats->avg[i] != (double)stats->count) || (stats->min[i] != (double)stats->count) ||
+       (stats->max[i] != (double)stats->count) || (stats->std[i] != (double)stats->count)) {
+      return(false);
+    }
+  }
+  if(stats->overruns != stats->count) {
+    return(false);
+  }
+
+  // the column of the latest update must already include it
+  uint64_t column = stats->timestamp / CONSOLE_SPARK_COLUMN_NS;
+  const struct spark_t* sp = &columns[column % SPARK_SLOTS];
+  unsigned long count = stats->count % TEST_PER_COLUMN + 1;
+  return((sp->column == column) && (sp->count == count) && (sp->sum == (double)count));
+}
+
+int main(void) {
+  pthread_t thread;
+  pthread_create(&thread, NULL, writer, NULL);
+
+  unsigned long reads = 0;
+  unsigned long torn = 0;
+  unsigned long last_count = 0;
+  for(;;) {
+    bool finished = __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+    struct console_stats_t stats;
+    struct spark_t columns[SPARK_SLOTS];
+    console_read(&stats, columns);
+    torn += !stats_consistent(&stats, columns);
+    TEST_CHECK(stats.count >= last_count);
+    last_count = stats.count;
+    reads++;
+    if(finished) {
+      break;
+    }
+  }
+  pthread_join(thread, NULL);
+  TEST_CHECK(reads > 0);
+  TEST_CHECK(torn == 0);
+
+  // the renderer stops within a frame, without waiting for new statistics
+  TEST_CHECK(console_setup(false) == 0);
+  struct timespec ts = { .tv_sec = 0, .tv_nsec = 300000000L };
+  nanosleep(&ts, NULL);
+  console_end();
+  TEST_CHECK(!running);
+
+  return(test_result());
+}
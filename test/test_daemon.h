@@ -0,0 +1,74 @@
+#ifndef POWERMON_TEST_DAEMON_H
+#define POWERMON_TEST_DAEMON_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "dc-powermon-client/dc_powermon_client.h"
+
+// daemon with the simulated device, listening on a Unix socket of its own so that tests can run in parallel
+struct test_daemon_t {
+  pid_t pid;
+  char path[128];
+  char uri[160];
+};
+
+// maximum number of extra arguments for the daemon
+#define TEST_DAEMON_ARGS_MAX      8
+
+// start the daemon with extra arguments (NULL-terminated, may be NULL) and wait until it answers, returns false when it does not
+static inline bool test_daemon_start_args(struct test_daemon_t* daemon, const char* exe, const char* const* args) {
+  snprintf(daemon->path, sizeof(daemon->path), "/tmp/dc-powermon-test-%d.sock", (int)getpid());
+  snprintf(daemon->uri, sizeof(daemon->uri), "unix://%s", daemon->path);
+  char control[160];
+  snprintf(control, sizeof(control), "unix:%s", daemon->path);
+
+  daemon->pid = fork();
+  if(daemon->pid < 0) {
+    return(false);
+  }
+  if(daemon->pid == 0) {
+    const char* argv[6 + TEST_DAEMON_ARGS_MAX + 1] = { exe, "--device", "sim", "--quiet", "--control", control };
+    for(int i = 0; args && args[i] && (i < TEST_DAEMON_ARGS_MAX); i++) {
+      argv[6 + i] = args[i];
+    }
+    execv(exe, (char* const*)argv);
+    _exit(127);
+  }
+
+  struct dc_powermon_t* dev = dc_powermon_open_uri(daemon->uri);
+  for(int i = 0; dev && (i < 100); i++) {
+    char id[256];
+    if(dc_powermon_dev_id(dev, id) == DC_POWERMON_ERR_NONE) {
+      dc_powermon_close(dev);
+      return(true);
+    }
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 50000000L };
+    nanosleep(&ts, NULL);
+  }
+  dc_powermon_close(dev);
+  kill(daemon->pid, SIGKILL);
+  waitpid(daemon->pid, NULL, 0);
+  return(false);
+}
+
+static inline bool test_daemon_start(struct test_daemon_t* daemon, const char* exe) {
+  return(test_daemon_start_args(daemon, exe, NULL));
+}
+
+// stop the daemon the way a service manager does, returns false unless it shut down cleanly
+static inline bool test_daemon_stop(struct test_daemon_t* daemon) {
+  int status = 0;
+  kill(daemon->pid, SIGTERM);
+  if(waitpid(daemon->pid, &status, 0) != daemon->pid) {
+    return(false);
+  }
+  return(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+}
+
+#endif
@@ -0,0 +1,134 @@
+#include "test.h"
+#include "energy.h"
+
+#include <stdint.h>
+
+#define MS                        1000000ULL
+#define S                         1000000000ULL
+
+// the integrator only moves forward, so every test starts where the previous one stopped
+static uint64_t now = 1 * S;
+
+static uint64_t feed(int num, double current, double power) {
+  // constant values, one sample per ms, returns the timestamp of the last one
+  for(int i = 0; i < num; i++) {
+    energy_update(now, current, power);
+    now += MS;
+  }
+  return(now - MS);
+}
+
+static void interval(uint64_t start, uint64_t stop, struct dc_powermon_energy_t* res) {
+  // both points must not be older than the latest sample
+  struct energy_point_t points[2];
+  energy_point(&points[0], start, false);
+  energy_point(&points[1], stop, false);
+  energy_interval(&points[0], &points[1], res);
+}
+
+static void test_constant(void) {
+  uint64_t first = feed(1, 10.0, 33.0);
+  struct energy_point_t start;
+  energy_point(&start, first, false);
+  uint64_t last = feed(1000, 10.0, 33.0);
+  struct energy_point_t stop;
+  energy_point(&stop, last, false);
+  struct dc_powermon_energy_t res;
+  energy_interval(&start, &stop, &res);
+  TEST_NEAR(res.energy, 33.0, 1e-9);
+  TEST_NEAR(res.charge, 10.0 / 3600.0, 1e-12);
+  TEST_NEAR(res.duration, 1.0, 1e-12);
+  TEST_CHECK(res.count == 1000);
+
+  // until the next sample, the latest values are assumed to continue
+  interval(last, last + 500 * MS, &res);
+  TEST_NEAR(res.energy, 33.0 * 0.5, 1e-9);
+  TEST_CHECK(res.count == 0);
+}
+
+static void test_ramp(void) {
+  // the trapezoidal rule is exact for a linear ramp, 0 to 100 mA in a second is 50 mAs
+  uint64_t first = feed(1, 0.0, 0.0);
+  struct energy_point_t start;
+  energy_point(&start, first, false);
+  for(int i = 1; i <= 1000; i++) {
+    energy_update(first + i * MS, i * 0.1, i * 0.33);
+  }
+  now = first + 1001 * MS;
+  struct energy_point_t stop;
+  energy_point(&stop, first + 1000 * MS, false);
+  struct dc_powermon_energy_t res;
+  energy_interval(&start, &stop, &res);
+  TEST_NEAR(res.charge * 3600.0, 50.0, 1e-9);
+  TEST_NEAR(res.energy, 165.0, 1e-9);
+}
+
+static void test_interpolation(void) {
+  // a point between two samples is interpolated once the second one arrives
+  uint64_t first = feed(1, 0.0, 0.0);
+  struct energy_point_t start;
+  struct energy_point_t mid;
+  energy_point(&start, first, false);
+  energy_point(&mid, first + MS / 2, true);
+  TEST_CHECK(mid.pending);
+  feed(1, 10.0, 100.0);
+  TEST_CHECK(!mid.pending);
+  struct dc_powermon_energy_t res;
+  energy_interval(&start, &mid, &res);
+  TEST_NEAR(res.energy, 50.0 / 2.0 * 0.0005, 1e-12);
+
+  // ENERGY:START and ENERGY:STOP? across a step
+  energy_start(now - MS / 2);
+  feed(1000, 10.0, 100.0);
+  TEST_CHECK(energy_stop(now - MS / 2, &res));
+  TEST_NEAR(res.energy, 100.0, 1e-9);
+  TEST_NEAR(res.duration, 1.0, 1e-12);
+  TEST_CHECK(res.count == 1000);
+  TEST_CHECK(!energy_stop(now, &res));
+}
+
+static void test_long_run(void) {
+  // an hour at 1 kHz, the compensated sum does not lose the small trapezoids
+  uint64_t first = feed(1, 10.0, 33.0);
+  struct energy_point_t start;
+  energy_point(&start, first, false);
+  uint64_t last = feed(3600 * 1000, 10.0, 33.0);
+  struct energy_point_t stop;
+  energy_point(&stop, last, false);
+  struct dc_powermon_energy_t res;
+  energy_interval(&start, &stop, &res);
+  TEST_NEAR(res.charge, 10.0, 1e-9);
+  TEST_NEAR(res.energy, 33.0 * 3600.0, 1e-6);
+}
+
+static void test_restore(void) {
+  // after a restart, the totals carry on and the time the daemon was not running is not integrated
+  struct energy_point_t zero = { 0 };
+  energy_restore(&zero);
+  now = 1 * S;
+  uint64_t last = feed(1001, 10.0, 33.0);
+  struct energy_point_t saved;
+  energy_save(&saved);
+  TEST_CHECK(saved.count == 1001);
+  TEST_CHECK(saved.elapsed == last - 1 * S);
+
+  // the monotonic clock started over with the reboot
+  energy_restore(&saved);
+  now = 5 * MS;
+  last = feed(1001, 20.0, 66.0);
+  struct dc_powermon_energy_t res;
+  energy_total(last, &res);
+  TEST_NEAR(res.energy, 33.0 + 66.0, 1e-9);
+  TEST_NEAR(res.charge, 30.0 / 3600.0, 1e-12);
+  TEST_NEAR(res.duration, 2.0, 1e-12);
+  TEST_CHECK(res.count == 2002);
+}
+
+int main(void) {
+  test_constant();
+  test_ramp();
+  test_interpolation();
+  test_long_run();
+  test_restore();
+  return(test_result());
+}
@@ -0,0 +1,92 @@
+#include "test.h"
+#include "test_daemon.h"
+#include "dc-powermon-client/dc_powermon.hpp"
+
+#include <chrono>
+#include <cstring>
+
+#include <sys/time.h>
+
+static void on_alarm(int sig) {
+  (void)sig;
+}
+
+static void set_alarm(long interval_us) {
+  // without SA_RESTART, so that every tick interrupts whatever the test is waiting in
+  struct sigaction sa;
+  std::memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_alarm;
+  sigaction(SIGALRM, &sa, NULL);
+  struct itimerval timer = { { 0, interval_us }, { 0, interval_us } };
+  setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+static dc_powermon::task<float> measure(dc_powermon::client& mon) {
+  auto meas = co_await mon.read_all();
+  TEST_CHECK(meas.count > 0);
+  co_return meas.ch[DC_POWERMON_CH_P_SHUNT].avg;
+}
+
+static dc_powermon::task<> measure_both(dc_powermon::client& mon, float* first, float* second) {
+  // two queries in flight from one coroutine each, driven by the same client
+  auto a = measure(mon);
+  auto b = measure(mon);
+  *first = co_await a;
+  *second = co_await b;
+}
+
+static dc_powermon::task<std::string> query_closed(dc_powermon::client& mon) {
+  co_return co_await mon.query("*IDN?");
+}
+
+static void test_read_all(dc_powermon::client& mon) {
+  float power = mon.run(measure(mon));
+  TEST_CHECK(power > 0);
+
+  float first = 0;
+  float second = 0;
+  mon.run(measure_both(mon, &first, &second));
+  TEST_CHECK((first > 0) && (second > 0));
+
+  // a query the daemon does not accept is an exception in the awaiting coroutine
+  bool thrown = false;
+  try {
+    mon.run(query_closed(mon));
+  } catch(const dc_powermon::error& e) {
+    thrown = true;
+  }
+  TEST_CHECK(thrown);
+}
+
+static void test_eintr(dc_powermon::client& mon) {
+  // signals arriving while waiting for responses neither fail the queries nor shorten the wait
+  set_alarm(200);
+  for(int i = 0; i < 20; i++) {
+    TEST_CHECK(mon.run(measure(mon)) > 0);
+  }
+  auto start = std::chrono::steady_clock::now();
+  TEST_CHECK(!mon.poll(200));
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  TEST_CHECK(elapsed.count() >= 190);
+  set_alarm(0);
+}
+
+int main(int argc, char* argv[]) {
+  struct test_daemon_t daemon;
+  if((argc < 2) || !test_daemon_start(&daemon, argv[1])) {
+    fprintf(stderr, "Failed to start the daemon\n");
+    return(1);
+  }
+
+  try {
+    dc_powermon::client mon(daemon.uri);
+    test_read_all(mon);
+    test_eintr(mon);
+  } catch(const dc_powermon::error& e) {
+    fprintf(stderr, "Unexpected %s\n", e.what());
+    test_failures++;
+  }
+
+  TEST_CHECK(test_daemon_stop(&daemon));
+  return(test_result());
+}
@@ -0,0 +1,70 @@
+#include "test.h"
+#include "mcast.h"
+#include "dc-powermon-client/dc_powermon_client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+// samples of a full batch, see mcast.c
+#define TEST_BATCH                60
+
+static uint64_t now = 1000000000ULL;
+
+static void push_samples(int num) {
+  // one sample per 100 us, so that only the batch size completes a batch
+  for(int i = 0; i < num; i++) {
+    struct dc_powermon_sample_t sample;
+    sample.timestamp = now;
+    for(int j = 0; j < DC_POWERMON_SAMPLE_NUM_VALS; j++) {
+      sample.val[j] = (float)(i + j);
+    }
+    mcast_push(&sample);
+    now += 100000ULL;
+  }
+}
+
+int main(void) {
+  // a group of its own on loopback, mcast_setup enables IP_MULTICAST_LOOP so that it is received on this host
+  char group[32];
+  char dest[48];
+  int port = 40000 + (getpid() % 20000);
+  snprintf(group, sizeof(group), "239.255.%d.%d", (getpid() >> 8) & 0xFF, getpid() & 0xFF);
+  snprintf(dest, sizeof(dest), "%s:%d", group, port);
+
+  struct dc_powermon_mcast_t rx;
+  TEST_CHECK(dc_powermon_mcast_open(&rx, group, port, "127.0.0.1") == EXIT_SUCCESS);
+  struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+  setsockopt(rx.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  TEST_CHECK(mcast_setup(dest, "127.0.0.1") >= 0);
+
+  // three full batches, the second one is lost on the way
+  static struct dc_powermon_sample_t buff[TEST_BATCH];
+  size_t num = 0;
+  push_samples(3 * TEST_BATCH);
+  TEST_CHECK(dc_powermon_mcast_recv(&rx, buff, TEST_BATCH, &num) == EXIT_SUCCESS);
+  TEST_CHECK(num == TEST_BATCH);
+  TEST_CHECK((rx.gap == 0) && (rx.lost == 0));
+  char frame[65536];
+  TEST_CHECK(recv(rx.fd, frame, sizeof(frame), 0) > 0);
+  TEST_CHECK(dc_powermon_mcast_recv(&rx, buff, TEST_BATCH, &num) == EXIT_SUCCESS);
+  TEST_CHECK(num == TEST_BATCH);
+  TEST_CHECK((rx.gap == 1) && (rx.lost == 1));
+  TEST_CHECK(rx.frames == 2);
+
+  // the incomplete batch goes out on shutdown
+  push_samples(10);
+  mcast_end();
+  TEST_CHECK(dc_powermon_mcast_recv(&rx, buff, TEST_BATCH, &num) == EXIT_SUCCESS);
+  TEST_CHECK(num == 10);
+  TEST_CHECK(rx.gap == 0);
+  TEST_CHECK(rx.dropped == 0);
+  TEST_CHECK(mcast_dropped() == 0);
+
+  dc_powermon_mcast_close(&rx);
+  return(test_result());
+}
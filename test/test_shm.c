@@ -0,0 +1,110 @@
+#include "test.h"
+#include "shm.h"
+#include "dc-powermon-client/dc_powermon_client.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <unistd.h>
+
+// number of updates published while the reader is running, small enough to be exact as a float
+#define TEST_UPDATES              1000000
+
+static bool done = false;
+
+static void* writer(void* arg) {
+  // every field of update k is k, so a reader that mixes two updates sees different values
+  (void)arg;
+  for(uint64_t k = 1; k <= TEST_UPDATES; k++) {
+    struct dc_powermon_sample_t sample;
+    sample.timestamp = k;
+    for(int i = 0; i < DC_POWERMON_SAMPLE_NUM_VALS; i++) {
+      sample.val[i] = (float)k;
+    }
+    shm_push(&sample);
+
+    struct dc_powermon_shm_stats_t stats;
+    stats.timestamp = k;
+    stats.count = k;
+    for(int i = 0; i < DC_POWERMON_SAMPLE_NUM_VALS; i++) {
+      stats.avg[i] = (float)k;
+      stats.min[i] = (float)k;
+      stats.max[i] = (float)k;
+    }
+    shm_stats(&stats);
+  }
+  __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+  return(NULL);
+}
+
+static bool stats_consistent(const struct dc_powermon_shm_stats_t* stats) {
+  for(int i = 0; i < DC_POWERMON_SAMPLE_NUM_VALS; i++) {
+    if((stats->avg[i] != (float)stats->count) || (stats->min[i] != (float)stats->count) || (stats->max[i] != (float)stats->count)) {
+      return(false);
+    }
+  }
+  return(stats->timestamp == stats->count);
+}
+
+int main(void) {
+  char name[64];
+  snprintf(name, sizeof(name), "dc-powermon-test-%d", (int)getpid());
+  TEST_CHECK(shm_setup(name) == 0);
+
+  struct dc_powermon_shm_reader_t rd;
+  TEST_CHECK(dc_powermon_shm_open(&rd, name) == 0);
+  TEST_CHECK(dc_powermon_shm_alive(&rd));
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, writer, NULL);
+
+  // read statistics and samples while they are being written
+  static struct dc_powermon_sample_t buff[256];
+  uint64_t last_count = 0;
+  uint64_t next = 1;
+  unsigned long torn = 0;
+  unsigned long gaps = 0;
+  for(;;) {
+    bool finished = __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+
+    struct dc_powermon_shm_stats_t stats;
+    TEST_CHECK(dc_powermon_shm_read_stats(&rd, &stats) == DC_POWERMON_ERR_NONE);
+    torn += !stats_consistent(&stats);
+    TEST_CHECK(stats.count >= last_count);
+    last_count = stats.count;
+
+    // samples that were overwritten are skipped and counted, the rest come in order
+    uint64_t lost = rd.lost;
+    size_t num = dc_powermon_shm_read(&rd, buff, sizeof(buff) / sizeof(buff[0]));
+    if(num) {
+      gaps += (buff[0].timestamp != next + (rd.lost - lost));
+      for(size_t i = 0; i < num; i++) {
+        torn += (buff[i].val[0] != (float)buff[i].timestamp) || (buff[i].val[3] != (float)buff[i].timestamp);
+        gaps += (i > 0) && (buff[i].timestamp != buff[i - 1].timestamp + 1);
+      }
+      next = buff[num - 1].timestamp + 1;
+    }
+
+    if(finished && !num) {
+      break;
+    }
+  }
+  pthread_join(thread, NULL);
+  TEST_CHECK(torn == 0);
+  TEST_CHECK(gaps == 0);
+  TEST_CHECK(last_count == TEST_UPDATES);
+  TEST_CHECK(next == TEST_UPDATES + 1);
+  TEST_CHECK(rd.pos == TEST_UPDATES);
+
+  // readers see the segment go away, even though they still have it mapped
+  shm_end();
+  struct dc_powermon_shm_stats_t stats;
+  TEST_CHECK(!dc_powermon_shm_alive(&rd));
+  TEST_CHECK(dc_powermon_shm_read_stats(&rd, &stats) == DC_POWERMON_ERR_CLOSED);
+  TEST_CHECK(dc_powermon_shm_read(&rd, buff, 1) == 0);
+  dc_powermon_shm_close(&rd);
+
+  return(test_result());
+}
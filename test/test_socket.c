@@ -0,0 +1,82 @@
+#include "test.h"
+#include "socket/socket.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static char path[96];
+
+static bool path_exists(void) {
+  struct stat st;
+  return(lstat(path, &st) == 0);
+}
+
+static void test_not_socket(void) {
+  // a regular file is never replaced
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+  TEST_CHECK(fd >= 0);
+  close(fd);
+  ino_t ino = 0;
+  TEST_CHECK(socket_setup_unix(path, false, 0600, &ino) < 0);
+  struct stat st;
+  TEST_CHECK((lstat(path, &st) == 0) && S_ISREG(st.st_mode));
+  unlink(path);
+}
+
+static void test_stale(void) {
+  // a socket file nobody listens on is left behind by a daemon that was killed
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  TEST_CHECK(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+  close(fd);
+  TEST_CHECK(path_exists());
+
+  ino_t ino = 0;
+  int listen_fd = socket_setup_unix(path, false, 0600, &ino);
+  TEST_CHECK(listen_fd >= 0);
+  struct stat st;
+  TEST_CHECK((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode) && (st.st_ino == ino));
+  TEST_CHECK((st.st_mode & 0777) == 0600);
+
+  // one that is still in use is not taken over, and stays where it is
+  ino_t other = 0;
+  TEST_CHECK(socket_setup_unix(path, false, 0600, &other) < 0);
+  TEST_CHECK((lstat(path, &st) == 0) && (st.st_ino == ino));
+  int client_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  TEST_CHECK(connect(client_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+  close(client_fd);
+
+  // only the file that was created is removed
+  socket_remove_unix(path, ino + 1);
+  TEST_CHECK(path_exists());
+  socket_remove_unix(path, ino);
+  TEST_CHECK(!path_exists());
+  close(listen_fd);
+}
+
+static void test_mode(void) {
+  // the permissions are in place as soon as the file exists
+  ino_t ino = 0;
+  int listen_fd = socket_setup_unix(path, true, 0660, &ino);
+  TEST_CHECK(listen_fd >= 0);
+  struct stat st;
+  TEST_CHECK((lstat(path, &st) == 0) && ((st.st_mode & 0777) == 0660));
+  socket_remove_unix(path, ino);
+  close(listen_fd);
+}
+
+int main(void) {
+  snprintf(path, sizeof(path), "/tmp/dc-powermon-test-socket-%d.sock", (int)getpid());
+  unlink(path);
+  test_not_socket();
+  test_stale();
+  test_mode();
+  return(test_result());
+}
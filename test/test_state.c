@@ -0,0 +1,135 @@
+#include "test.h"
+
+// the file layout and the checkpoint handed to the writer are internal to the state
+#include "state.c"
+
+// number of checkpoints handed over while the reader is running
+#define TEST_UPDATES              1000000
+
+static bool done = false;
+
+static void state_fake(struct state_t* state, uint64_t k) {
+  memset(state, 0, sizeof(struct state_t));
+  state->session = k;
+  state->count = k;
+  for(int i = 0; i < DC_POWERMON_SAMPLE_NUM_VALS; i++) {
+    state->min[i] = (double)k;
+    state->max[i] = (double)k;
+  }
+  state->energy.count = k;
+}
+
+static bool state_consistent(const struct state_t* state) {
+  for(int i = 0; i < DC_POWERMON_SAMPLE_NUM_VALS; i++) {
+    if((state->min[i] != (double)state->count) || (state->max[i] != (double)state->count)) {
+      return(false);
+    }
+  }
+  return((state->session == state->count) && (state->energy.count == state->count));
+}
+
+static void* updater(void* arg) {
+  (void)arg;
+  for(uint64_t k = 1; k <= TEST_UPDATES; k++) {
+    struct state_t state;
+    state_fake(&state, k);
+    state_update(&state);
+  }
+  __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+  return(NULL);
+}
+
+static void test_snapshot(void) {
+  // the writer thread never sees a checkpoint that is only partially handed over
+  pthread_t thread;
+  pthread_create(&thread, NULL, updater, NULL);
+  unsigned long torn = 0;
+  unsigned long last_seq = 0;
+  for(;;) {
+    bool finished = __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+    struct state_t state;
+    unsigned long seq = 0;
+    state_read(&state, &seq);
+    torn += (seq > 0) && !state_consistent(&state);
+    TEST_CHECK(!(seq & 1) && (seq >= last_seq));
+    last_seq = seq;
+    if(finished) {
+      break;
+    }
+  }
+  pthread_join(thread, NULL);
+  TEST_CHECK(torn == 0);
+  TEST_CHECK(last_seq == 2 * TEST_UPDATES);
+}
+
+static void corrupt_slot(const char* path, uint64_t seq) {
+  // flip a bit in the middle of the checkpoint with the given sequence number
+  int fd = open(path, O_RDWR);
+  struct state_file_t contents;
+  TEST_CHECK(pread(fd, &contents, sizeof(contents), 0) == sizeof(contents));
+  for(int i = 0; i < 2; i++) {
+    if(contents.slots[i].seq == seq) {
+      contents.slots[i].state.count ^= 1;
+    }
+  }
+  TEST_CHECK(pwrite(fd, &contents, sizeof(contents), 0) == sizeof(contents));
+  close(fd);
+}
+
+static void test_restore(const char* path) {
+  // a new file starts a new session
+  struct state_t state;
+  unlink(path);
+  TEST_CHECK(state_setup(path, &state) == 0);
+  uint64_t session = state.session;
+  TEST_CHECK(state.restores == 0);
+  state.count = 42;
+  state_end(&state);
+
+  // the final checkpoint is restored
+  TEST_CHECK(state_setup(path, &state) == 1);
+  TEST_CHECK(state.session == session);
+  TEST_CHECK(state.restores == 1);
+  TEST_CHECK(state.count == 42);
+
+  // checkpoints handed over while running are written by the writer thread
+  state.count = 43;
+  state_update(&state);
+  struct timespec ts = { .tv_sec = (STATE_CHECKPOINT_NS * 3 / 2) / 1000000000ULL, .tv_nsec = (STATE_CHECKPOINT_NS * 3 / 2) % 1000000000ULL };
+  nanosleep(&ts, NULL);
+  pthread_mutex_lock(&file_lock);
+  const struct state_slot_t* slot = &file->slots[file_seq % 2];
+  TEST_CHECK(state_valid(slot) && (slot->state.count == 43));
+  pthread_mutex_unlock(&file_lock);
+
+  // a torn final checkpoint falls back to the one before
+  state.count = 100;
+  state_end(&state);
+  corrupt_slot(path, file_seq);
+  TEST_CHECK(state_setup(path, &state) == 1);
+  TEST_CHECK(state.session == session);
+  TEST_CHECK(state.restores == 2);
+  TEST_CHECK(state.count == 43);
+  state_end(&state);
+
+  // nothing valid left is a new session
+  corrupt_slot(path, file_seq);
+  corrupt_slot(path, file_seq - 1);
+  TEST_CHECK(state_setup(path, &state) == 0);
+  TEST_CHECK(state.session != session);
+  TEST_CHECK(state.count == 0);
+  state_end(&state);
+
+  // files that are not state files are left alone
+  TEST_CHECK(truncate(path, sizeof(struct state_file_t) / 2) == 0);
+  TEST_CHECK(state_setup(path, &state) == -1);
+  unlink(path);
+}
+
+int main(void) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/dc-powermon-test-%d.state", (int)getpid());
+  test_snapshot();
+  test_restore(path);
+  return(test_result());
+}
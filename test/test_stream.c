@@ -0,0 +1,489 @@
+#include "test.h"
+#include "test_daemon.h"
+#include "stream.h"
+#include "dc-powermon-client/dc_powermon_priv.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+// everything a subscriber received, read from its end of a socket pair
+struct sub_t {
+  int fd;
+  bool closed;
+  char buff[1 << 20];
+  size_t len;
+};
+
+// what the frames received by a subscriber contained
+struct frames_t {
+  size_t num;
+  size_t samples;
+  size_t markers;
+  uint64_t timestamps[2048];
+  float vals[2048][DC_POWERMON_SAMPLE_NUM_VALS];
+  uint32_t seq_first;
+  uint32_t seq_last;
+  uint32_t dropped;
+  bool valid;
+};
+
+// markers set while a subscriber is not reading
+#define TEST_DROP_MARKERS         100
+
+static struct sub_t subs[4];
+static uint64_t now = 1000000000ULL;
+
+static bool sub_start(struct sub_t* sub, const char* args, const char* pending, int sndbuf) {
+  int fds[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    return(false);
+  }
+  if(sndbuf) {
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  }
+  memset(sub, 0, sizeof(struct sub_t));
+  sub->fd = fds[1];
+  fcntl(sub->fd, F_SETFL, fcntl(sub->fd, F_GETFL, 0) | O_NONBLOCK);
+
+  char buff[64];
+  snprintf(buff, sizeof(buff), "%s", args);
+  if(!stream_start(fds[0], buff, false, pending, pending ? strlen(pending) : 0)) {
+    close(fds[0]);
+    close(fds[1]);
+    return(false);
+  }
+  return(true);
+}
+
+static void sub_drain(struct sub_t* sub) {
+  while(!sub->closed && (sub->len < sizeof(sub->buff))) {
+    ssize_t len = recv(sub->fd, &sub->buff[sub->len], sizeof(sub->buff) - sub->len, 0);
+    if(len == 0) {
+      sub->closed = true;
+    } else if(len < 0) {
+      return;
+    } else {
+      sub->len += len;
+    }
+  }
+}
+
+static void sub_frames(const struct sub_t* sub, uint8_t channels, struct frames_t* res) {
+  memset(res, 0, sizeof(struct frames_t));
+  if((sub->len < strlen(DC_POWERMON_RSP_OK)) || memcmp(sub->buff, DC_POWERMON_RSP_OK, strlen(DC_POWERMON_RSP_OK))) {
+    return;
+  }
+
+  size_t rec_len = sizeof(uint64_t);
+  for(int i = 0; i < DC_POWERMON_SAMPLE_NUM_VALS; i++) {
+    rec_len += (channels & (1UL << i)) ? sizeof(float) : 0;
+  }
+
+  size_t pos = strlen(DC_POWERMON_RSP_OK);
+  while(pos + sizeof(struct dc_powermon_frame_hdr_t) <= sub->len) {
+    struct dc_powermon_frame_hdr_t hdr;
+    memcpy(&hdr, &sub->buff[pos], sizeof(hdr));
+    pos += sizeof(hdr);
+    if((hdr.magic != DC_POWERMON_FRAME_MAGIC) || (pos + hdr.len > sub->len)) {
+      return;
+    }
+    if(!res->num) {
+      res->seq_first = hdr.seq;
+    }
+    res->seq_last = hdr.seq;
+    res->dropped = hdr.dropped;
+    res->num++;
+
+    if(hdr.type == DC_POWERMON_FRAME_MARKER) {
+      res->markers += hdr.num;
+      pos += hdr.len;
+      continue;
+    }
+    if((hdr.type != DC_POWERMON_FRAME_SAMPLES) || (hdr.channels != channels) || (hdr.len != hdr.num * rec_len)) {
+      return;
+    }
+    for(int i = 0; i < hdr.num; i++) {
+      const char* ptr = &sub->buff[pos + i * rec_len];
+      size_t idx = res->samples++ % (sizeof(res->timestamps) / sizeof(res->timestamps[0]));
+      memcpy(&res->timestamps[idx], ptr, sizeof(uint64_t));
+      ptr += sizeof(uint64_t);
+      for(int j = 0; j < DC_POWERMON_SAMPLE_NUM_VALS; j++) {
+        res->vals[idx][j] = 0;
+        if(channels & (1UL << j)) {
+          memcpy(&res->vals[idx][j], ptr, sizeof(float));
+          ptr += sizeof(float);
+        }
+      }
+    }
+    pos += hdr.len;
+  }
+  res->valid = (pos == sub->len);
+}
+
+static void push_samples(int num) {
+  // one sample per ms, values are the sample index plus the channel
+  for(int i = 0; i < num; i++) {
+    struct dc_powermon_sample_t sample;
+    sample.timestamp = now;
+    for(int j = 0; j < DC_POWERMON_SAMPLE_NUM_VALS; j++) {
+      sample.val[j] = (float)(i + j);
+    }
+    stream_push(&sample);
+    stream_poll();
+    now += 1000000ULL;
+  }
+}
+
+static void push_marker(const char* label) {
+  struct dc_powermon_marker_t marker = { 0 };
+  marker.timestamp = now;
+  snprintf(marker.label, sizeof(marker.label), "%s", label);
+  stream_push_marker(&marker);
+  stream_poll();
+}
+
+static void test_decimation(void) {
+  // 10 Hz of a 1 kHz acquisition, next to a subscriber that gets every sample
+  struct frames_t* res = calloc(1, sizeof(struct frames_t));
+  TEST_CHECK(sub_start(&subs[0], "10,15," DC_POWERMON_STREAM_FMT_BIN, NULL, 0));
+  TEST_CHECK(sub_start(&subs[1], "0,5," DC_POWERMON_STREAM_FMT_BIN, NULL, 0));
+  uint64_t start = now;
+  push_samples(1000);
+  push_marker("end");
+  sub_drain(&subs[0]);
+  sub_drain(&subs[1]);
+
+  sub_frames(&subs[0], 15, res);
+  TEST_CHECK(res->valid);
+  TEST_CHECK(res->samples == 10);
+  TEST_CHECK(res->markers == 1);
+  for(size_t i = 0; i < res->samples; i++) {
+    TEST_CHECK(res->timestamps[i] == start + i * 100000000ULL);
+    TEST_NEAR(res->vals[i][2], i * 100 + 2, 0);
+  }
+
+  sub_frames(&subs[1], 5, res);
+  TEST_CHECK(res->valid);
+  TEST_CHECK(res->samples == 1000);
+  TEST_CHECK(res->markers == 1);
+  TEST_CHECK(res->seq_first == 0);
+  TEST_CHECK(res->seq_last == res->num - 1);
+  TEST_CHECK(res->dropped == 0);
+  TEST_CHECK(stream_dropped() == 0);
+  for(size_t i = 0; i < res->samples; i++) {
+    TEST_CHECK(res->timestamps[i] == start + i * 1000000ULL);
+    TEST_NEAR(res->vals[i][0], i, 0);
+    TEST_NEAR(res->vals[i][1], 0, 0);
+    TEST_NEAR(res->vals[i][2], i + 2, 0);
+  }
+
+  close(subs[0].fd);
+  close(subs[1].fd);
+  stream_poll();
+  free(res);
+}
+
+static void test_policy_drop(void) {
+  // a subscriber that does not read loses samples, but stays connected and is told how many
+  struct frames_t* res = calloc(1, sizeof(struct frames_t));
+  unsigned long dropped = stream_dropped();
+  TEST_CHECK(sub_start(&subs[0], "0,1," DC_POWERMON_STREAM_FMT_BIN "," DC_POWERMON_STREAM_POLICY_DROP, NULL, 4096));
+  push_samples(20000);
+  TEST_CHECK(stream_dropped() > dropped);
+
+  // markers that do not fit into the queue either are counted the same way
+  for(int i = 0; i < TEST_DROP_MARKERS; i++) {
+    push_marker("lost");
+  }
+
+  // once the subscriber catches up, the incomplete frame goes out together with a marker
+  for(int i = 0; i < 100; i++) {
+    stream_poll();
+    sub_drain(&subs[0]);
+  }
+  push_marker("end");
+  sub_drain(&subs[0]);
+  TEST_CHECK(!subs[0].closed);
+  sub_frames(&subs[0], 1, res);
+  TEST_CHECK(res->valid);
+  TEST_CHECK(res->markers < TEST_DROP_MARKERS + 1);
+  TEST_CHECK(res->dropped == stream_dropped() - dropped);
+  TEST_CHECK(res->samples + res->markers + res->dropped == 20000 + TEST_DROP_MARKERS + 1);
+  TEST_CHECK(res->seq_last > res->num - 1);
+
+  close(subs[0].fd);
+  stream_poll();
+  free(res);
+}
+
+static void test_policy_disconnect(void) {
+  // a subscriber that does not read is disconnected instead, without dropping anything
+  unsigned long dropped = stream_dropped();
+  TEST_CHECK(sub_start(&subs[0], "0,1," DC_POWERMON_STREAM_FMT_BIN "," DC_POWERMON_STREAM_POLICY_DISC, NULL, 4096));
+  push_samples(20000);
+  for(int i = 0; (i < 100) && !subs[0].closed; i++) {
+    stream_poll();
+    sub_drain(&subs[0]);
+  }
+  TEST_CHECK(subs[0].closed);
+  TEST_CHECK(stream_dropped() == dropped);
+  close(subs[0].fd);
+}
+
+static void test_stop(void) {
+  // a stop right behind the start
+  TEST_CHECK(sub_start(&subs[0], "0,1", DC_POWERMON_CMD_STREAM_STOP, 0));
+  sub_drain(&subs[0]);
+  TEST_CHECK(subs[0].closed);
+  TEST_CHECK((subs[0].len == strlen(DC_POWERMON_RSP_OK)) && !memcmp(subs[0].buff, DC_POWERMON_RSP_OK, subs[0].len));
+  close(subs[0].fd);
+
+  // a binary connection gets the acknowledgement as a text record
+  int fds[2];
+  TEST_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  char args[] = "0,1";
+  TEST_CHECK(stream_start(fds[0], args, true, DC_POWERMON_CMD_STREAM_STOP, strlen(DC_POWERMON_CMD_STREAM_STOP)));
+  struct dc_powermon_rec_hdr_t hdr = { 0 };
+  char ack[8] = { 0 };
+  TEST_CHECK(recv(fds[1], &hdr, sizeof(hdr), MSG_WAITALL) == (ssize_t)sizeof(hdr));
+  TEST_CHECK((hdr.magic == DC_POWERMON_REC_MAGIC) && (hdr.type == DC_POWERMON_REC_TEXT) && (hdr.len == 2));
+  TEST_CHECK(recv(fds[1], ack, sizeof(ack), 0) == 2);
+  TEST_CHECK(strcmp(ack, "OK") == 0);
+  close(fds[1]);
+
+  // and one sent later, split over two writes
+  TEST_CHECK(sub_start(&subs[0], "0,1", NULL, 0));
+  push_samples(10);
+  TEST_CHECK(write(subs[0].fd, "STREAM:", 7) == 7);
+  stream_poll();
+  sub_drain(&subs[0]);
+  TEST_CHECK(!subs[0].closed);
+  TEST_CHECK(write(subs[0].fd, "STOP\n", 5) == 5);
+  stream_poll();
+  sub_drain(&subs[0]);
+  TEST_CHECK(subs[0].closed);
+  close(subs[0].fd);
+
+  // the arguments are checked before a subscriber slot is taken
+  TEST_CHECK(!sub_start(&subs[0], "10", NULL, 0));
+  TEST_CHECK(!sub_start(&subs[0], "10,0", NULL, 0));
+  TEST_CHECK(!sub_start(&subs[0], "-1,1", NULL, 0));
+}
+
+static size_t client_samples(struct dc_powermon_stream_t* st) {
+  // whatever arrives within half a second
+  static struct dc_powermon_sample_t buff[4096];
+  size_t num = 0;
+  for(int i = 0; i < 50; i++) {
+    num += dc_powermon_stream_read(st, buff, sizeof(buff) / sizeof(buff[0]));
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000L };
+    nanosleep(&ts, NULL);
+  }
+  return(num);
+}
+
+// frames of the fake server, see fake_read
+#define TEST_FRAME_SAMPLES        1000
+#define TEST_FRAME_CHANNELS       0x05
+#define TEST_FRAME_DROPPED        7
+#define TEST_FRAME_LOST_SEQ       3
+
+// an old server without the binary format, that streams frames made up by the test
+static struct {
+  const char* rsp;
+  int frames;
+  int sent;
+  uint64_t timestamp;
+  char buff[sizeof(struct dc_powermon_frame_hdr_t) + TEST_FRAME_SAMPLES * (sizeof(uint64_t) + 2 * sizeof(float))];
+} fake;
+
+static int fake_setup(struct dc_powermon_t* dev, const struct timespec* deadline) {
+  (void)dev;
+  (void)deadline;
+  return(open("/dev/null", O_RDONLY));
+}
+
+static void fake_close(struct dc_powermon_t* dev) {
+  close(dev->fd);
+}
+
+static int fake_write(struct dc_powermon_t* dev, const char* buff, size_t len, const struct timespec* deadline) {
+  (void)dev;
+  (void)deadline;
+  bool form = (len >= 9) && !memcmp(buff, "SYST:FORM", 9);
+  fake.rsp = form ? DC_POWERMON_RSP_ERR : DC_POWERMON_RSP_OK;
+  return(DC_POWERMON_ERR_NONE);
+}
+
+static int fake_read(struct dc_powermon_t* dev, char* buff, size_t len, const struct timespec* deadline) {
+  (void)deadline;
+  if(fake.rsp) {
+    size_t rsp_len = strlen(fake.rsp);
+    memcpy(buff, fake.rsp, rsp_len);
+    fake.rsp = NULL;
+    return(rsp_len);
+  }
+  struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000L };
+  if(!dev->streaming || (fake.sent > fake.frames)) {
+    nanosleep(&ts, NULL);
+    return(-DC_POWERMON_ERR_TIMEOUT);
+  }
+
+  // sample frames with one sequence number left out, then a marker
+  struct dc_powermon_frame_hdr_t hdr = {
+    .magic = DC_POWERMON_FRAME_MAGIC,
+    .type = DC_POWERMON_FRAME_SAMPLES,
+    .channels = TEST_FRAME_CHANNELS,
+    .seq = fake.sent + (fake.sent >= TEST_FRAME_LOST_SEQ),
+    .dropped = TEST_FRAME_DROPPED,
+  };
+  char* ptr = &fake.buff[sizeof(hdr)];
+  if(fake.sent == fake.frames) {
+    struct dc_powermon_marker_t marker = { .timestamp = fake.timestamp };
+    snprintf(marker.label, sizeof(marker.label), "end");
+    memcpy(ptr, &marker, sizeof(marker));
+    ptr += sizeof(marker);
+    hdr.type = DC_POWERMON_FRAME_MARKER;
+    hdr.channels = 0;
+    hdr.num = 1;
+  } else {
+    for(int i = 0; i < TEST_FRAME_SAMPLES; i++) {
+      float vals[2] = { (float)i, (float)(i + 2) };
+      memcpy(ptr, &fake.timestamp, sizeof(uint64_t));
+      memcpy(ptr + sizeof(uint64_t), vals, sizeof(vals));
+      ptr += sizeof(uint64_t) + sizeof(vals);
+      fake.timestamp++;
+    }
+    hdr.num = TEST_FRAME_SAMPLES;
+  }
+  hdr.len = ptr - &fake.buff[sizeof(hdr)];
+  memcpy(fake.buff, &hdr, sizeof(hdr));
+  if(len < (size_t)(ptr - fake.buff)) {
+    return(-DC_POWERMON_ERR_RESPONSE);
+  }
+  memcpy(buff, fake.buff, ptr - fake.buff);
+  fake.sent++;
+  return(ptr - fake.buff);
+}
+
+static struct dc_powermon_stream_t* fake_start(struct dc_powermon_t* dev, int frames, dc_powermon_stream_cb_t cb, void* user) {
+  memset(&fake, 0, sizeof(fake));
+  fake.frames = frames;
+  dev->cb_setup = fake_setup;
+  dev->cb_close = fake_close;
+  dev->cb_read = fake_read;
+  dev->cb_write = fake_write;
+  return(dc_powermon_stream_start(dev, 0, TEST_FRAME_CHANNELS, cb, user));
+}
+
+static void fake_wait(struct dc_powermon_stream_t* st, struct dc_powermon_stream_stats_t* stats, int frames) {
+  // until the reader got all frames and the marker
+  for(int i = 0; i < 500; i++) {
+    dc_powermon_stream_get_stats(st, stats);
+    if(stats->frames == (uint64_t)frames + 1) {
+      return;
+    }
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000L };
+    nanosleep(&ts, NULL);
+  }
+}
+
+// what the callback got, and whether it came in order
+static uint64_t delivered = 0;
+static uint64_t misplaced = 0;
+
+static void deliver_cb(const struct dc_powermon_sample_t* samples, size_t num, void* user) {
+  (void)user;
+  for(size_t i = 0; i < num; i++) {
+    misplaced += (samples[i].timestamp != delivered) || !isnan(samples[i].val[1]) || (samples[i].val[2] != samples[i].val[0] + 2);
+    delivered++;
+  }
+}
+
+static void test_receiver(void) {
+  // a consumer that does not read loses whatever does not fit into the ring, and is told how much
+  static struct dc_powermon_sample_t buff[DC_POWERMON_STREAM_RING_SIZE];
+  int frames = DC_POWERMON_STREAM_RING_SIZE / TEST_FRAME_SAMPLES + 10;
+  struct dc_powermon_t* dev = dc_powermon_open_uri(DC_POWERMON_URI_UNIX "/nonexistent");
+  struct dc_powermon_stream_t* st = fake_start(dev, frames, NULL, NULL);
+  TEST_CHECK(st != NULL);
+  if(!st) {
+    dc_powermon_close(dev);
+    return;
+  }
+  struct dc_powermon_stream_stats_t stats;
+  fake_wait(st, &stats, frames);
+  TEST_CHECK(stats.frames == (uint64_t)frames + 1);
+  TEST_CHECK(stats.samples == DC_POWERMON_STREAM_RING_SIZE);
+  TEST_CHECK(stats.client_dropped == (uint64_t)frames * TEST_FRAME_SAMPLES - DC_POWERMON_STREAM_RING_SIZE);
+  TEST_CHECK(stats.server_dropped == TEST_FRAME_DROPPED);
+  TEST_CHECK(stats.lost_frames == 1);
+  TEST_CHECK(stats.markers == 1);
+  TEST_CHECK(stats.error == DC_POWERMON_ERR_NONE);
+
+  // the oldest samples are kept, in order
+  size_t num = dc_powermon_stream_read(st, buff, DC_POWERMON_STREAM_RING_SIZE);
+  TEST_CHECK(num == DC_POWERMON_STREAM_RING_SIZE);
+  size_t wrong = 0;
+  for(size_t i = 0; i < num; i++) {
+    wrong += (buff[i].timestamp != i) || !isnan(buff[i].val[1]);
+  }
+  TEST_CHECK(wrong == 0);
+  struct dc_powermon_marker_t marker;
+  TEST_CHECK(dc_powermon_stream_read_markers(st, &marker, 1) == 1);
+  TEST_CHECK(strcmp(marker.label, "end") == 0);
+  dc_powermon_stream_stop(st);
+
+  // a callback that keeps up gets every sample
+  frames = 20;
+  st = fake_start(dev, frames, deliver_cb, NULL);
+  TEST_CHECK(st != NULL);
+  if(st) {
+    fake_wait(st, &stats, frames);
+    dc_powermon_stream_stop(st);
+    TEST_CHECK(stats.client_dropped == 0);
+    TEST_CHECK(delivered == (uint64_t)frames * TEST_FRAME_SAMPLES);
+    TEST_CHECK(misplaced == 0);
+  }
+  dc_powermon_close(dev);
+}
+
+static void test_restart(const char* exe) {
+  // a handle can start streaming without being connected, and again after the previous stream stopped
+  struct test_daemon_t daemon;
+  if(!exe || !test_daemon_start(&daemon, exe)) {
+    fprintf(stderr, "Failed to start the daemon\n");
+    test_failures++;
+    return;
+  }
+  struct dc_powermon_t* dev = dc_powermon_open_uri(daemon.uri);
+  float val = 0;
+  for(int i = 0; i < 2; i++) {
+    struct dc_powermon_stream_t* st = dc_powermon_stream_start(dev, 0, 15, NULL, NULL);
+    TEST_CHECK(st != NULL);
+    if(!st) {
+      continue;
+    }
+    TEST_CHECK(client_samples(st) > 0);
+    dc_powermon_stream_stop(st);
+  }
+  TEST_CHECK(dc_powermon_dev_read_power(dev, &val) == DC_POWERMON_ERR_NONE);
+  dc_powermon_close(dev);
+  TEST_CHECK(test_daemon_stop(&daemon));
+}
+
+int main(int argc, char* argv[]) {
+  test_decimation();
+  test_policy_drop();
+  test_policy_disconnect();
+  test_stop();
+  test_receiver();
+  test_restart((argc > 1) ? argv[1] : NULL);
+  return(test_result());
+}
@@ -0,0 +1,432 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "argtable3.h"
+#include "dc_powermon_client.h"
+
+#define STR_HELPER(s) #s
+#define STR(s) STR_HELPER(s)
+
+// some default configuration values
+#define URI_DEFAULT               "localhost"
+#define MIX_DEFAULT               "MEAS:ALL?"
+#define CONNECTIONS_DEFAULT       1
+#define DURATION_DEFAULT          10
+
+#define CONNECTIONS_MAX           256
+#define CMDS_MAX                  8
+
+// FETCH:DATA? and FETCH:MARK? read at most this many entries, the rest is received and dropped
+#define FETCH_MAX                 4096
+
+// latency histogram with 16 linear sub-buckets per power of two, so values are within ~6 %
+#define HIST_SUB_BITS             4
+#define HIST_SUB                  (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS              (64 * HIST_SUB)
+
+struct hist_t {
+  uint64_t count[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+// a single command of the mix and its relative weight
+struct cmd_t {
+  char cmd[64];
+  int weight;
+};
+
+// per-connection state, only touched by its own thread until it is joined
+struct worker_t {
+  pthread_t thread;
+  int id;
+  struct dc_powermon_t* dev;
+  struct hist_t hist[CMDS_MAX];
+  uint64_t errors[CMDS_MAX];
+  uint64_t late;
+  struct dc_powermon_sample_t* samples;
+  struct dc_powermon_marker_t* markers;
+};
+
+static struct conf_t {
+  const char* uri;
+  int connections;
+  double rate;
+  double duration;
+  struct cmd_t cmds[CMDS_MAX];
+  int num_cmds;
+  int weight_total;
+} conf = {
+  .uri = URI_DEFAULT,
+  .connections = CONNECTIONS_DEFAULT,
+  .rate = 0,
+  .duration = DURATION_DEFAULT,
+  .num_cmds = 0,
+  .weight_total = 0,
+};
+
+static struct worker_t* workers = NULL;
+static volatile sig_atomic_t running = 1;
+
+// argtable arguments
+static struct args_t {
+  struct arg_str* uri;
+  struct arg_int* connections;
+  struct arg_dbl* rate;
+  struct arg_dbl* duration;
+  struct arg_str* mix;
+  struct arg_lit* histogram;
+  struct arg_lit* help;
+  struct arg_end* end;
+} args;
+
+static void sighandler(int signal) {
+  (void)signal;
+  running = 0;
+}
+
+static size_t hist_index(uint64_t val) {
+  if(val < HIST_SUB) {
+    return(val);
+  }
+  int shift = 63 - __builtin_clzll(val) - HIST_SUB_BITS;
+  return(((size_t)(shift + 1) << HIST_SUB_BITS) + ((val >> shift) & (HIST_SUB - 1)));
+}
+
+static uint64_t hist_upper(size_t idx) {
+  // largest value that falls into the bucket
+  if(idx < HIST_SUB) {
+    return(idx);
+  }
+  int shift = (idx >> HIST_SUB_BITS) - 1;
+  return((((uint64_t)(HIST_SUB + (idx & (HIST_SUB - 1))) + 1) << shift) - 1);
+}
+
+static void hist_add(struct hist_t* hist, uint64_t val) {
+  hist->count[hist_index(val)]++;
+  hist->total++;
+  if(val > hist->max) {
+    hist->max = val;
+  }
+}
+
+static void hist_merge(struct hist_t* dst, const struct hist_t* src) {
+  for(size_t i = 0; i < HIST_BUCKETS; i++) {
+    dst->count[i] += src->count[i];
+  }
+  dst->total += src->total;
+  if(src->max > dst->max) {
+    dst->max = src->max;
+  }
+}
+
+static uint64_t hist_percentile(const struct hist_t* hist, double pct) {
+  uint64_t target = (uint64_t)((double)hist->total * pct / 100.0 + 0.5);
+  if(target < 1) {
+    target = 1;
+  }
+  uint64_t seen = 0;
+  for(size_t i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->count[i];
+    if(seen >= target) {
+      // the bucket bound may overshoot the largest value that was actually seen
+      uint64_t val = hist_upper(i);
+      return((val < hist->max) ? val : hist->max);
+    }
+  }
+  return(hist->max);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+static int mix_parse(const char* mix) {
+  // semicolon-separated commands, each optionally followed by =weight, e.g. POWER:READ?=4;FETCH:DATA? 0,0=1
+  // commas are left alone, they separate the arguments of a command
+  while(*mix) {
+    if(conf.num_cmds >= CMDS_MAX) {
+      fprintf(stderr, "ERROR: At most %d commands can be mixed\n", CMDS_MAX);
+      return(-1);
+    }
+
+    size_t len = strcspn(mix, ";");
+    size_t cmd_len = strcspn(mix, "=;");
+    struct cmd_t* cmd = &conf.cmds[conf.num_cmds];
+    if((cmd_len == 0) || (cmd_len + 2 > sizeof(cmd->cmd))) {
+      fprintf(stderr, "ERROR: Invalid command in mix: %.*s\n", (int)len, mix);
+      return(-1);
+    }
+    memcpy(cmd->cmd, mix, cmd_len);
+    strcpy(&cmd->cmd[cmd_len], DC_POWERMON_CMD_LINEFEED);
+    cmd->weight = (cmd_len < len) ? atoi(&mix[cmd_len + 1]) : 1;
+    if(cmd->weight <= 0) {
+      fprintf(stderr, "ERROR: Invalid weight in mix: %.*s\n", (int)len, mix);
+      return(-1);
+    }
+    conf.weight_total += cmd->weight;
+    conf.num_cmds++;
+
+    mix += len;
+    if(*mix == ';') {
+      mix++;
+    }
+  }
+
+  if(!conf.num_cmds) {
+    fprintf(stderr, "ERROR: No commands to send\n");
+    return(-1);
+  }
+  return(0);
+}
+
+static int mix_pick(unsigned int* seed) {
+  int val = rand_r(seed) % conf.weight_total;
+  for(int i = 0; i < conf.num_cmds; i++) {
+    val -= conf.cmds[i].weight;
+    if(val < 0) {
+      return(i);
+    }
+  }
+  return(conf.num_cmds - 1);
+}
+
+static int query(struct worker_t* w, const char* cmd, char* rsp, size_t size) {
+  // blocks are read into a buffer instead of as text
+  unsigned long long start = 0, stop = 0;
+  if(strstr(cmd, DC_POWERMON_CMD_FETCH_DATA) == cmd) {
+    if(!w->samples && !(w->samples = malloc(FETCH_MAX * sizeof(struct dc_powermon_sample_t)))) {
+      return(DC_POWERMON_ERR_FAILED);
+    }
+    sscanf(cmd + strlen(DC_POWERMON_CMD_FETCH_DATA), " %llu,%llu", &start, &stop);
+    return(dc_powermon_dev_fetch_data(w->dev, start, stop, w->samples, FETCH_MAX, NULL));
+
+  } else if(strstr(cmd, DC_POWERMON_CMD_FETCH_MARK) == cmd) {
+    if(!w->markers && !(w->markers = malloc(FETCH_MAX * sizeof(struct dc_powermon_marker_t)))) {
+      return(DC_POWERMON_ERR_FAILED);
+    }
+    sscanf(cmd + strlen(DC_POWERMON_CMD_FETCH_MARK), " %llu,%llu", &start, &stop);
+    return(dc_powermon_dev_fetch_markers(w->dev, start, stop, w->markers, FETCH_MAX, NULL));
+
+  }
+
+  return(dc_powermon_dev_query(w->dev, cmd, rsp, size, DC_POWERMON_TIMEOUT_DEFAULT));
+}
+
+static void* worker_thread(void* arg) {
+  struct worker_t* w = arg;
+  unsigned int seed = w->id + 1;
+
+  // open loop when pacing: latency counts from when the query should have been sent,
+  // so a slow response also shows up in the queries that had to wait for it
+  uint64_t interval = (conf.rate > 0) ? (uint64_t)(1e9 * conf.connections / conf.rate) : 0;
+  uint64_t start = now_ns();
+  uint64_t stop = start + (uint64_t)(conf.duration * 1e9);
+  uint64_t next = start + (interval * w->id) / conf.connections;
+
+  char rsp[512];
+  while(running) {
+    uint64_t sched = now_ns();
+    if(interval) {
+      if(sched < next) {
+        struct timespec ts = { .tv_sec = next / 1000000000ULL, .tv_nsec = next % 1000000000ULL };
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+      } else if(sched - next > interval) {
+        w->late++;
+      }
+      sched = next;
+      next += interval;
+    }
+    if(sched >= stop) {
+      break;
+    }
+
+    int idx = mix_pick(&seed);
+    if(query(w, conf.cmds[idx].cmd, rsp, sizeof(rsp))) {
+      w->errors[idx]++;
+      continue;
+    }
+    hist_add(&w->hist[idx], now_ns() - sched);
+  }
+
+  return(NULL);
+}
+
+static void report_line(const char* name, const struct hist_t* hist, uint64_t errors, double elapsed) {
+  fprintf(stdout, "%-20s %10llu %8llu %10.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+    (unsigned long long)hist->total, (unsigned long long)errors, (double)hist->total / elapsed,
+    (double)hist_percentile(hist, 50.0) / 1e3, (double)hist_percentile(hist, 99.0) / 1e3,
+    (double)hist_percentile(hist, 99.9) / 1e3, (double)hist->max / 1e3);
+}
+
+static void report(double elapsed, bool histogram) {
+  struct hist_t* all = calloc(1, sizeof(struct hist_t));
+  struct hist_t* cmd = calloc(1, sizeof(struct hist_t));
+  if(!all || !cmd) {
+    free(all);
+    free(cmd);
+    return;
+  }
+
+  fprintf(stdout, "%-20s %10s %8s %10s %9s %9s %9s %9s\n", "command", "count", "errors", "rate/s", "p50/us", "p99/us", "p99.9/us", "max/us");
+  uint64_t errors_all = 0;
+  uint64_t late = 0;
+  for(int i = 0; i < conf.num_cmds; i++) {
+    memset(cmd, 0, sizeof(struct hist_t));
+    uint64_t errors = 0;
+    for(int j = 0; j < conf.connections; j++) {
+      hist_merge(cmd, &workers[j].hist[i]);
+      errors += workers[j].errors[i];
+    }
+    hist_merge(all, cmd);
+    errors_all += errors;
+
+    char name[64];
+    snprintf(name, sizeof(name), "%.*s", (int)strcspn(conf.cmds[i].cmd, DC_POWERMON_CMD_LINEFEED), conf.cmds[i].cmd);
+    report_line(name, cmd, errors, elapsed);
+  }
+  for(int j = 0; j < conf.connections; j++) {
+    late += workers[j].late;
+  }
+  report_line("total", all, errors_all, elapsed);
+  if(late) {
+    fprintf(stdout, "target rate not reached, %llu queries started more than one interval late\n", (unsigned long long)late);
+  }
+
+  if(histogram) {
+    // CSV of the non-empty buckets: upper bound in us, count, cumulative fraction
+    fprintf(stdout, "\nlatency_us,count,cumulative\n");
+    uint64_t seen = 0;
+    for(size_t i = 0; i < HIST_BUCKETS; i++) {
+      if(!all->count[i]) {
+        continue;
+      }
+      seen += all->count[i];
+      fprintf(stdout, "%.3f,%llu,%.6f\n", (double)hist_upper(i) / 1e3, (unsigned long long)all->count[i], (double)seen / (double)all->total);
+    }
+  }
+
+  free(all);
+  free(cmd);
+}
+
+int main(int argc, char** argv) {
+  void *argtable[] = {
+    args.uri = arg_str0("u", "uri", "uri", "Server to benchmark, host[:port], tcp://, unix:// or shm:// URI, defaults to " URI_DEFAULT),
+    args.connections = arg_int0("n", "connections", NULL, "Number of connections, each one driven by its own thread, defaults to " STR(CONNECTIONS_DEFAULT)),
+    args.rate = arg_dbl0("r", "rate", "queries/s", "Target rate over all connections, as fast as possible by default"),
+    args.duration = arg_dbl0("t", "duration", "seconds", "Duration of the run, defaults to " STR(DURATION_DEFAULT) " s"),
+    args.mix = arg_str0("m", "mix", "cmd[=weight];...", "Commands to send and their relative weights, separated by semicolons, defaults to " MIX_DEFAULT),
+    args.histogram = arg_lit0("H", "histogram", "Print the full latency histogram as CSV"),
+    args.help = arg_lit0(NULL, "help", "Display this help and exit"),
+    args.end = arg_end(2),
+  };
+
+  int exitcode = 0;
+  if(arg_nullcheck(argtable) != 0) {
+    fprintf(stderr, "%s: insufficient memory\n", argv[0]);
+    exitcode = 1;
+    goto exit;
+  }
+
+  int nerrors = arg_parse(argc, argv, argtable);
+  if(args.help->count > 0) {
+    fprintf(stdout, "dc-powermon control interface benchmark\n");
+    fprintf(stdout, "Usage: %s", argv[0]);
+    arg_print_syntax(stdout, argtable, "\n");
+    fprintf(stdout, "Reports throughput and latency percentiles per command, send SIGINT /Ctrl+C/ to stop early\n");
+    arg_print_glossary(stdout, argtable,"  %-25s %s\n");
+    exitcode = 0;
+    goto exit;
+  }
+
+  if(nerrors > 0) {
+    arg_print_errors(stdout, args.end, argv[0]);
+    fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+    exitcode = 1;
+    goto exit;
+  }
+
+  // parse arguments
+  if(args.uri->count) { conf.uri = args.uri->sval[0]; }
+  if(args.connections->count) { conf.connections = args.connections->ival[0]; }
+  if(args.rate->count) { conf.rate = args.rate->dval[0]; }
+  if(args.duration->count) { conf.duration = args.duration->dval[0]; }
+  if((conf.connections < 1) || (conf.connections > CONNECTIONS_MAX)) {
+    fprintf(stderr, "ERROR: Number of connections must be between 1 and %d\n", CONNECTIONS_MAX);
+    exitcode = 1;
+    goto exit;
+  }
+  if(mix_parse(args.mix->count ? args.mix->sval[0] : MIX_DEFAULT)) {
+    exitcode = 1;
+    goto exit;
+  }
+
+  workers = calloc(conf.connections, sizeof(struct worker_t));
+  if(!workers) {
+    fprintf(stderr, "ERROR: Failed to allocate workers\n");
+    exitcode = 1;
+    goto exit;
+  }
+
+  // connect everything before starting, so that connecting is not part of the measurement
+  for(int i = 0; i < conf.connections; i++) {
+    workers[i].id = i;
+    workers[i].dev = dc_powermon_open_uri(conf.uri);
+    char id[256] = { 0 };
+    int ret = workers[i].dev ? dc_powermon_dev_query(workers[i].dev, DC_POWERMON_CMD_ID, id, sizeof(id), DC_POWERMON_TIMEOUT_DEFAULT) : DC_POWERMON_ERR_CONNECT;
+    if((ret == DC_POWERMON_ERR_CLOSED) || ((ret == DC_POWERMON_ERR_NONE) && (strcmp(id, "ERR") == 0))) {
+      // connecting worked, but the server hung up right away or answered with ERR
+      fprintf(stderr, "ERROR: %s refused connection %d of %d, check the daemon's --control_max\n", conf.uri, i + 1, conf.connections);
+      exitcode = 1;
+      goto cleanup;
+    } else if(ret) {
+      fprintf(stderr, "ERROR: Failed to connect to %s\n", conf.uri);
+      exitcode = 1;
+      goto cleanup;
+    }
+  }
+
+  signal(SIGINT, sighandler);
+  uint64_t start = now_ns();
+  int started = 0;
+  for(; started < conf.connections; started++) {
+    if(pthread_create(&workers[started].thread, NULL, worker_thread, &workers[started])) {
+      fprintf(stderr, "ERROR: Failed to start worker thread\n");
+      running = 0;
+      exitcode = 1;
+      break;
+    }
+  }
+  for(int i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  double elapsed = (double)(now_ns() - start) / 1e9;
+
+  if(started == conf.connections) {
+    fprintf(stdout, "%s: %d connection(s), %.1f s\n", conf.uri, conf.connections, elapsed);
+    report(elapsed, args.histogram->count > 0);
+  }
+
+cleanup:
+  for(int i = 0; i < conf.connections; i++) {
+    dc_powermon_close(workers[i].dev);
+    free(workers[i].samples);
+    free(workers[i].markers);
+  }
+  free(workers);
+
+exit:
+  arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+
+  return exitcode;
+}
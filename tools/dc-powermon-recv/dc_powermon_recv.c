@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+
+#include "argtable3.h"
+#include "dc_powermon_client.h"
+
+static struct dc_powermon_mcast_t rx = { .fd = -1 };
+
+// argtable arguments
+static struct args_t {
+  struct arg_str* group;
+  struct arg_int* port;
+  struct arg_str* iface;
+  struct arg_lit* quiet;
+  struct arg_lit* help;
+  struct arg_end* end;
+} args;
+
+static void sighandler(int signal) {
+  (void)signal;
+  exit(EXIT_SUCCESS);
+}
+
+static void exithandler(void) {
+  fprintf(stderr, "received %llu frames, lost %llu, publisher dropped %lu samples\n",
+    (unsigned long long)rx.frames, (unsigned long long)rx.lost, (unsigned long)rx.dropped);
+  dc_powermon_mcast_close(&rx);
+}
+
+int main(int argc, char** argv) {
+  void *argtable[] = {
+    args.group = arg_str1("g", "group", "addr", "Multicast group or broadcast address the samples are published to"),
+    args.port = arg_int1("p", "port", NULL, "UDP port the samples are published to"),
+    args.iface = arg_str0("i", "iface", "addr", "Address of the interface to join the group on, e.g. 127.0.0.1 for loopback"),
+    args.quiet = arg_lit0("q", "quiet", "Do not print samples, only report lost frames"),
+    args.help = arg_lit0(NULL, "help", "Display this help and exit"),
+    args.end = arg_end(2),
+  };
+
+  int exitcode = 0;
+  if(arg_nullcheck(argtable) != 0) {
+    fprintf(stderr, "%s: insufficient memory\n", argv[0]);
+    exitcode = 1;
+    goto exit;
+  }
+
+  int nerrors = arg_parse(argc, argv, argtable);
+  if(args.help->count > 0) {
+    fprintf(stdout, "dc-powermon multicast receiver\n");
+    fprintf(stdout, "Usage: %s", argv[0]);
+    arg_print_syntax(stdout, argtable, "\n");
+    fprintf(stdout, "Prints received samples as CSV: timestamp, V_bus, V_shunt, I_shunt, P_shunt\n");
+    fprintf(stdout, "Markers are printed in between as: timestamp, MARK, \"label\"\n");
+    arg_print_glossary(stdout, argtable,"  %-25s %s\n");
+    exitcode = 0;
+    goto exit;
+  }
+
+  if(nerrors > 0) {
+    arg_print_errors(stdout, args.end, argv[0]);
+    fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+    exitcode = 1;
+    goto exit;
+  }
+
+  if(dc_powermon_mcast_open(&rx, args.group->sval[0], args.port->ival[0], args.iface->count ? args.iface->sval[0] : NULL)) {
+    fprintf(stderr, "ERROR: Failed to join %s:%d\n", args.group->sval[0], args.port->ival[0]);
+    exitcode = 1;
+    goto exit;
+  }
+
+  atexit(exithandler);
+  signal(SIGINT, sighandler);
+
+  for(;;) {
+    struct dc_powermon_sample_t samples[256];
+    size_t num = 0;
+    if(dc_powermon_mcast_recv(&rx, samples, sizeof(samples)/sizeof(samples[0]), &num)) {
+      fprintf(stderr, "ERROR: Failed to receive\n");
+      exitcode = 1;
+      break;
+    }
+
+    if(rx.gap) {
+      fprintf(stderr, "lost %lu frames\n", (unsigned long)rx.gap);
+    }
+
+    if(args.quiet->count) {
+      continue;
+    }
+
+    if(rx.marked) {
+      fprintf(stdout, "%llu.%09llu,MARK,\"%s\"\n",
+        (unsigned long long)(rx.marker.timestamp / 1000000000ULL), (unsigned long long)(rx.marker.timestamp % 1000000000ULL), rx.marker.label);
+    }
+
+    for(size_t i = 0; i < num; i++) {
+      fprintf(stdout, "%llu.%09llu,%.6f,%.6f,%.6f,%.6f\n",
+        (unsigned long long)(samples[i].timestamp / 1000000000ULL), (unsigned long long)(samples[i].timestamp % 1000000000ULL),
+        (double)samples[i].val[0], (double)samples[i].val[1], (double)samples[i].val[2], (double)samples[i].val[3]);
+    }
+  }
+
+exit:
+  arg_freetable(argtable, sizeof(argtable)/sizeof(argtable[0]));
+
+  return exitcode;
+}